@@ -0,0 +1,134 @@
+/* Auto-generated ROM file, created by mkrom. */
+
+#include <stddef.h>
+static const size_t lua_src_len = 8656;
+static const char lua_src[] = "ASC"
+"\x00\x00""!\xA6\x0E""bootstrap.lua\x00""-- Lua implementation of the luaromfs "
+"library.\x0A""-- Create and return the ROMFS module\x0A""--\x0A""-- Author: ch"
+"ris.smith@oozlum.co.uk\x0A""-- Copyright: (c) 2022 Oozlum\x0A""-- Licence: MIT"
+"\x0A\x0A""local api = {}\x0A""api.mount, api.extract, api.mount_file, api.cach"
+"e_stats, api.bytecode_tag, api.stats, api.lookup_timing,\x0A""  api.table_add,"
+" api.table_extract, api.table_list, api.table_stat, api.table_open = ...\x0A\x0A"
+"-- the mounted ROMs, in mount order, which is also the order of the ROM table\x0A"
+"-- in C that overlays their files.\x0A""local rom = {}\x0A\x0A""-- the search "
+"path templates of every ROM, in the order they first appear.\x0A""local templa"
+"tes = {}\x0A\x0A""-- modules searched for in the mounted ROMs, and those not f"
+"ound.\x0A""local searches, search_misses = 0, 0\x0A\x0A""-- the path and ROM e"
+"ach module was found at, and the modules not found in any\x0A""-- ROM.  Both a"
+"re cleared whenever the mounted ROMs change.\x0A""local resolved, unresolved ="
+" {}, {}\x0A\x0A""local function invalidate_searches()\x0A""  resolved, unresol"
+"ved = {}, {}\x0A""end\x0A\x0A""local M = {\x0A""  default_searchpath = '?;?.lu"
+"a;?/?.lua;?/init.lua',\x0A""}\x0A\x0A""local function rom_extract(r, file)\x0A"
+"  if file:sub(1, #r.mount_point) == r.mount_point then\x0A""    return api.ext"
+"ract(r.content, file:sub(#r.mount_point + 1))\x0A""  end\x0A""end\x0A\x0A""-- "
+"ROMs compiled to bytecode by mkrom -b are tagged with the stripped bytecode of"
+"\x0A""-- an empty chunk, which must match that of this Lua VM.\x0A""local byte"
+"code_tag = string.dump(load(''), true)\x0A\x0A""local function add_rom(content"
+", mount_point, searchpath)\x0A""  local tag = api.bytecode_tag(content)\x0A"" "
+" if tag and tag ~= bytecode_tag then\x0A""    return nil, 'ROM bytecode was co"
+"mpiled for a different Lua VM'\x0A""  end\x0A\x0A""  local rom_obj = {\x0A""  "
+"  content = content,\x0A""    mount_point = mount_point or '',\x0A""    search"
+"path = searchpath or M.default_searchpath or '',\x0A""    template_rank = {}\x0A"
+"  }\x0A""  if not api.table_add(content, rom_obj.mount_point) then\x0A""    re"
+"turn nil, 'Mount failed'\x0A""  end\x0A\x0A""  local rank = 0\x0A""  for path "
+"in string.gmatch(rom_obj.searchpath, \"([^;]+)\") do\x0A""    if not rom_obj.t"
+"emplate_rank[path] then\x0A""      rank = rank + 1\x0A""      rom_obj.template"
+"_rank[path] = rank\x0A""    end\x0A""    local known = false\x0A""    for _,t "
+"in ipairs(templates) do\x0A""      known = known or t == path\x0A""    end\x0A"
+"    if not known then\x0A""      templates[#templates + 1] = path\x0A""    end"
+"\x0A""  end\x0A""  rom[#rom + 1] = rom_obj\x0A""  invalidate_searches()\x0A\x0A"
+"  return {\x0A""    extract = function(self, file)\x0A""      return rom_extra"
+"ct(rom_obj, file)\x0A""    end,\x0A""    -- return the cache hits, misses and "
+"bytes held by files inflated from the ROM.\x0A""    cache_stats = function(sel"
+"f)\x0A""      return api.cache_stats(rom_obj.content)\x0A""    end,\x0A""    -"
+"- return a table of the statistics of the ROM, as per romfs.stats.\x0A""    st"
+"ats = function(self)\x0A""      return api.stats(rom_obj.content)\x0A""    end"
+"\x0A""  }\x0A""end\x0A\x0A""-- cache_limit bounds the bytes held by files infl"
+"ated from ROMs whose files are\x0A""-- compressed individually; the least rece"
+"ntly used files are released first.\x0A""local function mount_string(content, "
+"passphrase, mount_point, searchpath, cache_limit)\x0A""  content = api.mount(c"
+"ontent, passphrase, cache_limit)\x0A""  if not content then\x0A""    return ni"
+"l, 'Mount failed'\x0A""  end\x0A""  return add_rom(content, mount_point, searc"
+"hpath)\x0A""end\x0A""M.mount_string = mount_string\x0A\x0A""-- attach a ROM us"
+"erdata mounted and shared by the host, as by luaromfs_attach.\x0A""M.attach = "
+"add_rom\x0A\x0A""local function mount(file, passphrase, mount_point, searchpat"
+"h, cache_limit)\x0A""  if not file then\x0A""    return nil, 'No file specifie"
+"d'\x0A""  end\x0A""  local content, err = api.mount_file(file, passphrase, cac"
+"he_limit)\x0A""  if not content then\x0A""    return nil, err\x0A""  end\x0A"" "
+" return add_rom(content, mount_point, searchpath)\x0A""end\x0A""M.mount = moun"
+"t\x0A\x0A""-- return a table of the statistics of every ROM mounted by the pro"
+"cess, those\x0A""-- since unmounted included, and of the lookups in the ROMs o"
+"f this state that\x0A""-- found no file, with the modules searched for in the "
+"ROMs of this state and a\x0A""-- table of the statistics of each ROM mounted b"
+"y it in roms.\x0A""local function stats()\x0A""  local s = api.stats()\x0A""  "
+"s.searches, s.search_misses = searches, search_misses\x0A""  s.roms = {}\x0A"" "
+" for i,r in ipairs(rom) do\x0A""    s.roms[i] = api.stats(r.content)\x0A""    "
+"s.roms[i].mount_point = r.mount_point\x0A""  end\x0A""  return s\x0A""end\x0A""M"
+".stats = stats\x0A\x0A""-- return a sorted table of the full paths of the file"
+"s in the mounted ROMs\x0A""-- that start with prefix, or of every file if pref"
+"ix is nil.  Files are listed\x0A""-- without being extracted.\x0A""local funct"
+"ion list(prefix)\x0A""  local paths = api.table_list(prefix)\x0A""  table.sort"
+"(paths)\x0A""  return paths\x0A""end\x0A""M.list = list\x0A\x0A""-- return a t"
+"able describing the file or directory at the given full path in\x0A""-- the mo"
+"unted ROMs, with mode 'file' and size, or mode 'directory', or nil.\x0A""local"
+" function stat(path)\x0A""  local size = api.table_stat(path)\x0A""  if size t"
+"hen\x0A""    return { mode = 'file', size = size }\x0A""  elseif size == false"
+" then\x0A""    return { mode = 'directory' }\x0A""  end\x0A""end\x0A""M.stat ="
+" stat\x0A\x0A""-- open the file at the given full path in the mounted ROMs and"
+" return a handle\x0A""-- with read, lines, seek and close methods, as per io.o"
+"pen, which reads the\x0A""-- file a part at a time rather than extracting it a"
+"s a whole.\x0A""M.open = api.table_open\x0A\x0A""-- lookups are timed only whe"
+"n enabled, as reading the clock costs about as\x0A""-- much as a lookup.\x0A""M"
+".lookup_timing = api.lookup_timing\x0A\x0A""local function file_not_found(err)"
+"\x0A""  if err:match('No such file or directory') then\x0A""    return true\x0A"
+"  end\x0A""  return false\x0A""end\x0A\x0A""local function extract(file)\x0A"" "
+" return (api.table_extract(file))\x0A""end\x0A\x0A""-- the order in which load"
+"file and dofile look for files: on disk and then in\x0A""-- the ROMs, in the R"
+"OMs and then on disk, or only in the ROMs.\x0A""local resolution = 'disk-first"
+"'\x0A""local resolutions = { ['disk-first'] = true, ['rom-first'] = true, ['ro"
+"m-only'] = true }\x0A\x0A""-- set the resolution order of loadfile and dofile "
+"and return the previous one.\x0A""local function set_resolution(order)\x0A""  "
+"if not resolutions[order] then\x0A""    error('invalid resolution order: ' .. "
+"tostring(order), 2)\x0A""  end\x0A""  local previous = resolution\x0A""  resol"
+"ution = order\x0A""  return previous\x0A""end\x0A""M.set_resolution = set_reso"
+"lution\x0A\x0A""local function not_found(file)\x0A""  return nil, 'cannot open"
+" ' .. tostring(file) .. ': No such file or directory'\x0A""end\x0A\x0A""local "
+"old_loadfile = loadfile\x0A""loadfile = function(file)\x0A""  local f, err\x0A"
+"\x0A""  -- the ROM index is checked first so that files held in ROM cost no fa"
+"iled\x0A""  -- filesystem calls.  Standard input is always read as usual.\x0A"" "
+" if resolution ~= 'disk-first' and file ~= nil then\x0A""    f = extract(file)"
+"\x0A""    if f then\x0A""      return load(f, file)\x0A""    elseif resolution"
+" == 'rom-only' then\x0A""      return not_found(file)\x0A""    end\x0A""    re"
+"turn old_loadfile(file)\x0A""  end\x0A\x0A""  f, err = old_loadfile(file)\x0A"" "
+" if not f then\x0A""    if file_not_found(err) then\x0A""      f = extract(fil"
+"e)\x0A""      if f then\x0A""        f, err = load(f, file)\x0A""      else\x0A"
+"        f, err = not_found(file)\x0A""      end\x0A""    end\x0A""  end\x0A\x0A"
+"  return f, err\x0A""end\x0A\x0A""dofile = function(file)\x0A""  local f, err "
+"= loadfile(file)\x0A""  if not f then\x0A""    error(err)\x0A""  end\x0A""  re"
+"turn f()\x0A""end\x0A\x0A""table.insert(package.searchers, 3, function(modulen"
+"ame)\x0A""  searches = searches + 1\x0A""  if unresolved[modulename] then\x0A"" "
+"   search_misses = search_misses + 1\x0A""    return nil\x0A""  end\x0A\x0A"" "
+" local cached = resolved[modulename]\x0A""  if cached then\x0A""    local file"
+" = rom_extract(rom[cached.mount], cached.filename)\x0A""    if file then\x0A"" "
+"     return load(file, cached.filename)\x0A""    end\x0A""  end\x0A\x0A""  -- "
+"probe the ROM table once per template.  A file is found through the\x0A""  -- "
+"templates of the ROM holding it, and the ROM mounted first wins, then the\x0A"" "
+" -- template earliest in its search path.  Where the table resolves a path to\x0A"
+"  -- a ROM that does not search the template, the later ROMs that do are probe"
+"d\x0A""  -- directly, as the path may be shadowed in them.\x0A""  local module"
+"path = string.gsub(modulename, \"%.\", \"/\")\x0A""  local found, found_file, "
+"found_mount, found_rank\x0A""  for _,path in ipairs(templates) do\x0A""    loc"
+"al filename = string.gsub(path, \"%?\", modulepath)\x0A""    local file, mount"
+" = api.table_extract(filename)\x0A""    local rank = file and rom[mount].templ"
+"ate_rank[path]\x0A""    if file and not rank then\x0A""      file = nil\x0A"" "
+"     for m = mount + 1, found_mount or #rom do\x0A""        rank = rom[m].temp"
+"late_rank[path]\x0A""        file = rank and rom_extract(rom[m], filename)\x0A"
+"        if file then\x0A""          mount = m\x0A""          break\x0A""      "
+"  end\x0A""      end\x0A""    end\x0A""    if file and (not found or mount < f"
+"ound_mount or (mount == found_mount and rank < found_rank)) then\x0A""      fo"
+"und, found_file, found_mount, found_rank = filename, file, mount, rank\x0A""  "
+"  end\x0A""  end\x0A""  if found then\x0A""    resolved[modulename] = { filena"
+"me = found, mount = found_mount }\x0A""    return load(found_file, found)\x0A"" "
+" end\x0A""  unresolved[modulename] = true\x0A""  search_misses = search_misses"
+" + 1\x0A""  return nil\x0A""end)\x0A\x0A""return M\x0A\x0A\x00\x00\x00\x00\x00"
+"\x00\x00\x00\x00\x00\x00\x00\x00\x01\x00\x00\x00\x02""IDX";
\ No newline at end of file
@@ -38,6 +38,7 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
 /*****************************************************************************/
 #include <string.h> // CBC mode, for memset
 #include "aes.h"
+#include "aes_ni.h"
 
 /*****************************************************************************/
 /* Defines:                                                                  */
@@ -496,10 +497,18 @@ static void XorWithIv(uint8_t* buf, const uint8_t* Iv)
   }
 }
 
-void AES_CBC_encrypt_buffer(struct AES_ctx *ctx, uint8_t* buf, uint32_t length)
+void AES_CBC_encrypt_buffer(struct AES_ctx *ctx, uint8_t* buf, size_t length)
 {
   uintptr_t i;
   uint8_t *Iv = ctx->Iv;
+#if AES_NI
+  /* Oozlum: use the AES-NI instructions where the CPU has them. */
+  if (aesni_available() && length % AES_BLOCKLEN == 0)
+  {
+    aesni_cbc_encrypt(ctx->RoundKey, Nr, ctx->Iv, buf, length);
+    return;
+  }
+#endif
   for (i = 0; i < length; i += AES_BLOCKLEN)
   {
     XorWithIv(buf, Iv);
@@ -511,10 +520,17 @@ void AES_CBC_encrypt_buffer(struct AES_ctx *ctx, uint8_t* buf, uint32_t length)
   memcpy(ctx->Iv, Iv, AES_BLOCKLEN);
 }
 
-void AES_CBC_decrypt_buffer(struct AES_ctx* ctx, uint8_t* buf,  uint32_t length)
+void AES_CBC_decrypt_buffer(struct AES_ctx* ctx, uint8_t* buf,  size_t length)
 {
   uintptr_t i;
   uint8_t storeNextIv[AES_BLOCKLEN];
+#if AES_NI
+  if (aesni_available() && length % AES_BLOCKLEN == 0)
+  {
+    aesni_cbc_decrypt(ctx->RoundKey, Nr, ctx->Iv, buf, length);
+    return;
+  }
+#endif
   for (i = 0; i < length; i += AES_BLOCKLEN)
   {
     memcpy(storeNextIv, buf, AES_BLOCKLEN);
@@ -533,11 +549,11 @@ void AES_CBC_decrypt_buffer(struct AES_ctx* ctx, uint8_t* buf,  uint32_t length)
 #if defined(CTR) && (CTR == 1)
 
 /* Symmetrical operation: same function for encrypting as for decrypting. Note any IV/nonce should never be reused with the same key */
-void AES_CTR_xcrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, uint32_t length)
+void AES_CTR_xcrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, size_t length)
 {
   uint8_t buffer[AES_BLOCKLEN];
   
-  unsigned i;
+  size_t i;
   int bi;
   for (i = 0, bi = AES_BLOCKLEN; i < length; ++i, ++bi)
   {
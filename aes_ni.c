@@ -0,0 +1,210 @@
+/* aes_ni.c AES-NI implementation of the AES CBC mode functions.
+ *
+ * The key schedule produced by aes.c is used as-is for encryption and is
+ * converted with AESIMC for the equivalent inverse cipher used by AESDEC.
+ * CBC decryption has no dependency between blocks, so it is interleaved over
+ * several blocks to hide the instruction latency, and over two blocks per
+ * instruction with VAES where available.
+ *
+ * Author: chris.smith@oozlum.co.uk
+ * Copyright: (c) 2022 Oozlum
+ * Licence: MIT
+ */
+#include "aes_ni.h"
+
+#if AES_NI
+
+#include <immintrin.h>
+
+#define MAX_ROUNDS 14
+
+/* 0 if not yet known, 1 if not supported, 2 for AES-NI and 3 for VAES. */
+static volatile int aesni_support;
+
+static int cpu_support(void)
+{
+  int support;
+
+  support = aesni_support;
+  if (!support)
+  {
+    __builtin_cpu_init();
+    support = 1;
+    if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("sse2"))
+    {
+      support = 2;
+      if (__builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx2"))
+        support = 3;
+    }
+    aesni_support = support;
+  }
+
+  return support;
+}
+
+/* return non-zero if the CPU supports the AES-NI instructions. */
+int aesni_available(void)
+{
+  return cpu_support() > 1;
+}
+
+__attribute__((target("aes,sse2")))
+void aesni_cbc_encrypt(const uint8_t *round_keys, int rounds, uint8_t *iv, uint8_t *buf, size_t length)
+{
+  __m128i key[MAX_ROUNDS + 1], block;
+  int i;
+
+  for (i = 0; i <= rounds; ++i)
+    key[i] = _mm_loadu_si128((const __m128i*)(round_keys + i * 16));
+
+  block = _mm_loadu_si128((const __m128i*)iv);
+  for (; length >= 16; length -= 16, buf += 16)
+  {
+    block = _mm_xor_si128(block, _mm_loadu_si128((const __m128i*)buf));
+    block = _mm_xor_si128(block, key[0]);
+    for (i = 1; i < rounds; ++i)
+      block = _mm_aesenc_si128(block, key[i]);
+    block = _mm_aesenclast_si128(block, key[rounds]);
+    _mm_storeu_si128((__m128i*)buf, block);
+  }
+
+  _mm_storeu_si128((__m128i*)iv, block);
+}
+
+/* load the decryption key schedule for the equivalent inverse cipher. */
+__attribute__((target("aes,sse2")))
+static void load_decrypt_keys(const uint8_t *round_keys, int rounds, __m128i *key)
+{
+  int i;
+
+  key[0] = _mm_loadu_si128((const __m128i*)(round_keys + rounds * 16));
+  for (i = 1; i < rounds; ++i)
+    key[i] = _mm_aesimc_si128(_mm_loadu_si128((const __m128i*)(round_keys + (rounds - i) * 16)));
+  key[rounds] = _mm_loadu_si128((const __m128i*)round_keys);
+}
+
+/* decrypt the blocks of buf four at a time, then singly, returning the last
+ * ciphertext block.
+ */
+__attribute__((target("aes,sse2")))
+static __m128i cbc_decrypt_blocks(const __m128i *key, int rounds, __m128i prev, uint8_t *buf, size_t length)
+{
+  __m128i c0, c1, c2, c3, b0, b1, b2, b3;
+  int i;
+
+  for (; length >= 64; length -= 64, buf += 64)
+  {
+    c0 = _mm_loadu_si128((const __m128i*)buf);
+    c1 = _mm_loadu_si128((const __m128i*)(buf + 16));
+    c2 = _mm_loadu_si128((const __m128i*)(buf + 32));
+    c3 = _mm_loadu_si128((const __m128i*)(buf + 48));
+    b0 = _mm_xor_si128(c0, key[0]);
+    b1 = _mm_xor_si128(c1, key[0]);
+    b2 = _mm_xor_si128(c2, key[0]);
+    b3 = _mm_xor_si128(c3, key[0]);
+    for (i = 1; i < rounds; ++i)
+    {
+      b0 = _mm_aesdec_si128(b0, key[i]);
+      b1 = _mm_aesdec_si128(b1, key[i]);
+      b2 = _mm_aesdec_si128(b2, key[i]);
+      b3 = _mm_aesdec_si128(b3, key[i]);
+    }
+    b0 = _mm_xor_si128(_mm_aesdeclast_si128(b0, key[rounds]), prev);
+    b1 = _mm_xor_si128(_mm_aesdeclast_si128(b1, key[rounds]), c0);
+    b2 = _mm_xor_si128(_mm_aesdeclast_si128(b2, key[rounds]), c1);
+    b3 = _mm_xor_si128(_mm_aesdeclast_si128(b3, key[rounds]), c2);
+    _mm_storeu_si128((__m128i*)buf, b0);
+    _mm_storeu_si128((__m128i*)(buf + 16), b1);
+    _mm_storeu_si128((__m128i*)(buf + 32), b2);
+    _mm_storeu_si128((__m128i*)(buf + 48), b3);
+    prev = c3;
+  }
+
+  for (; length >= 16; length -= 16, buf += 16)
+  {
+    c0 = _mm_loadu_si128((const __m128i*)buf);
+    b0 = _mm_xor_si128(c0, key[0]);
+    for (i = 1; i < rounds; ++i)
+      b0 = _mm_aesdec_si128(b0, key[i]);
+    _mm_storeu_si128((__m128i*)buf, _mm_xor_si128(_mm_aesdeclast_si128(b0, key[rounds]), prev));
+    prev = c0;
+  }
+
+  return prev;
+}
+
+/* decrypt the blocks of buf eight at a time with VAES, returning the number of
+ * bytes decrypted and updating prev to the last ciphertext block.
+ */
+__attribute__((target("vaes,avx2,aes")))
+static size_t vaes_cbc_decrypt_blocks(const __m128i *key, int rounds, __m128i *prev, uint8_t *buf, size_t length)
+{
+  __m256i k[MAX_ROUNDS + 1], c0, c1, c2, c3, b0, b1, b2, b3;
+  __m128i last;
+  size_t done;
+  int i;
+
+  for (i = 0; i <= rounds; ++i)
+    k[i] = _mm256_broadcastsi128_si256(key[i]);
+
+  last = *prev;
+  for (done = 0; length - done >= 128; done += 128, buf += 128)
+  {
+    c0 = _mm256_loadu_si256((const __m256i*)buf);
+    c1 = _mm256_loadu_si256((const __m256i*)(buf + 32));
+    c2 = _mm256_loadu_si256((const __m256i*)(buf + 64));
+    c3 = _mm256_loadu_si256((const __m256i*)(buf + 96));
+    b0 = _mm256_xor_si256(c0, k[0]);
+    b1 = _mm256_xor_si256(c1, k[0]);
+    b2 = _mm256_xor_si256(c2, k[0]);
+    b3 = _mm256_xor_si256(c3, k[0]);
+    for (i = 1; i < rounds; ++i)
+    {
+      b0 = _mm256_aesdec_epi128(b0, k[i]);
+      b1 = _mm256_aesdec_epi128(b1, k[i]);
+      b2 = _mm256_aesdec_epi128(b2, k[i]);
+      b3 = _mm256_aesdec_epi128(b3, k[i]);
+    }
+    b0 = _mm256_aesdeclast_epi128(b0, k[rounds]);
+    b1 = _mm256_aesdeclast_epi128(b1, k[rounds]);
+    b2 = _mm256_aesdeclast_epi128(b2, k[rounds]);
+    b3 = _mm256_aesdeclast_epi128(b3, k[rounds]);
+
+    /* each block is chained to the ciphertext block before it. */
+    b0 = _mm256_xor_si256(b0, _mm256_inserti128_si256(_mm256_castsi128_si256(last), _mm256_castsi256_si128(c0), 1));
+    b1 = _mm256_xor_si256(b1, _mm256_loadu_si256((const __m256i*)(buf + 16)));
+    b2 = _mm256_xor_si256(b2, _mm256_loadu_si256((const __m256i*)(buf + 48)));
+    b3 = _mm256_xor_si256(b3, _mm256_loadu_si256((const __m256i*)(buf + 80)));
+    last = _mm256_extracti128_si256(c3, 1);
+
+    _mm256_storeu_si256((__m256i*)buf, b0);
+    _mm256_storeu_si256((__m256i*)(buf + 32), b1);
+    _mm256_storeu_si256((__m256i*)(buf + 64), b2);
+    _mm256_storeu_si256((__m256i*)(buf + 96), b3);
+  }
+
+  *prev = last;
+  return done;
+}
+
+__attribute__((target("aes,sse2")))
+void aesni_cbc_decrypt(const uint8_t *round_keys, int rounds, uint8_t *iv, uint8_t *buf, size_t length)
+{
+  __m128i key[MAX_ROUNDS + 1], prev;
+  size_t done;
+
+  load_decrypt_keys(round_keys, rounds, key);
+  prev = _mm_loadu_si128((const __m128i*)iv);
+
+  if (cpu_support() == 3)
+  {
+    done = vaes_cbc_decrypt_blocks(key, rounds, &prev, buf, length);
+    buf += done;
+    length -= done;
+  }
+
+  prev = cbc_decrypt_blocks(key, rounds, prev, buf, length);
+  _mm_storeu_si128((__m128i*)iv, prev);
+}
+
+#endif
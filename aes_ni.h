@@ -0,0 +1,31 @@
+/* aes_ni.h AES-NI implementation of the AES CBC mode functions.
+ *
+ * Author: chris.smith@oozlum.co.uk
+ * Copyright: (c) 2022 Oozlum
+ * Licence: MIT
+ */
+#ifndef AES_NI_H
+#define AES_NI_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define AES_NI 1
+#else
+  #define AES_NI 0
+#endif
+
+#if AES_NI
+/* return non-zero if the CPU supports the AES-NI instructions. */
+int aesni_available(void);
+
+/* encrypt or decrypt length bytes of buf in place using CBC mode, given the
+ * expanded key schedule in FIPS-197 byte order and the number of rounds.  iv is
+ * updated to chain subsequent calls.  length must be a multiple of 16.
+ */
+void aesni_cbc_encrypt(const uint8_t *round_keys, int rounds, uint8_t *iv, uint8_t *buf, size_t length);
+void aesni_cbc_decrypt(const uint8_t *round_keys, int rounds, uint8_t *iv, uint8_t *buf, size_t length);
+#endif
+
+#endif
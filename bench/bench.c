@@ -0,0 +1,365 @@
+/* Benchmarks of the luaromfs library.
+ *
+ * Synthetic source trees of Lua modules are archived with mkrom in each ROM
+ * format, and the time taken to mount the ROMs, extract files from them and
+ * require every module through the Lua library is measured, along with
+ * requiring the same modules from the filesystem.  Each result is written to
+ * stdout as a line of JSON:
+ *   {"bench":"extract","format":"RFS","files":100,"file_len":1024,"mounts":1,"iterations":...,"ns_per_op":...}
+ *
+ * Usage: bench <mkrom> [min_time_ms]
+ *
+ * Author: chris.smith@oozlum.co.uk
+ * Copyright: (c) 2022 Oozlum
+ * Licence: MIT
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <lua.h>
+#include <lualib.h>
+#include <lauxlib.h>
+#include "romfs.h"
+#include "luaromfs.h"
+
+#define DEBUG(...) fprintf(stderr, __VA_ARGS__)
+
+/* each benchmark is repeated until it has run for at least min_time_ns and
+ * MIN_ITERATIONS times.
+ */
+#define MIN_ITERATIONS 3
+static long long min_time_ns = 200000000LL;
+
+/* the other ROMs mounted before the benchmarked ROM hold OTHER_FILES modules. */
+#define OTHER_FILES 10
+
+static const char *mkrom;
+static char work_dir[] = "/tmp/luaromfs-bench.XXXXXX";
+
+typedef struct _Tree
+{
+  size_t files;
+  size_t file_len;
+  const char *prefix; /* module name prefix. */
+  char dir[256];
+}
+  Tree;
+
+typedef struct _Format
+{
+  const char *name;
+  const char *options;
+  const char *passphrase;
+}
+  Format;
+
+static const Format formats[] = {
+  { "ASC", "-u", 0 },
+  { "RFS", "", 0 },
+  { "RFS-f", "-f", 0 },
+  { "ENC", "-e bench", "bench" },
+  { "ENC-f", "-f -e bench", "bench" },
+};
+
+static const size_t file_counts[] = { 10, 100, 1000 };
+static const size_t file_lens[] = { 1024, 16384 };
+static const int mount_counts[] = { 1, 8, 32 };
+
+/* the state of a benchmark, passed to each operation. */
+typedef struct _Bench
+{
+  const Tree *tree;
+  const Format *format;
+  const char *rom_path;
+  const char *other_rom_path;
+  int mounts;
+  char *blob;
+  size_t blob_len;
+  const char *romfs;
+  char **paths;
+  size_t next;
+}
+  Bench;
+
+static long long now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void fail(const char *message)
+{
+  DEBUG("bench: %s\n", message);
+  exit(1);
+}
+
+/* write a Lua module of about file_len bytes of pseudo-random words. */
+static void write_module(const char *path, const char *name, size_t file_len, unsigned int seed)
+{
+  static const char *words[] = {
+    "local", "function", "return", "end", "table", "string", "value", "index",
+    "module", "insert", "format", "self", "count", "result", "error", "true"
+  };
+  FILE *f;
+  size_t len;
+
+  f = fopen(path, "w");
+  if (!f)
+    fail("unable to write a module");
+
+  len = fprintf(f, "-- %s\nlocal M = { name = '%s' }\nM.data = [[\n", name, name);
+  while (len < file_len)
+  {
+    seed = seed * 1103515245 + 12345;
+    len += fprintf(f, "%s%s", words[(seed >> 16) % 16], (seed >> 8) % 8 ? " " : "\n");
+  }
+  fprintf(f, "]]\nreturn M\n");
+  fclose(f);
+}
+
+/* create a source tree of Lua modules named <prefix>NNNN. */
+static void make_tree(Tree *tree, size_t files, size_t file_len, const char *prefix)
+{
+  char path[PATH_MAX], name[32];
+  size_t i;
+
+  tree->files = files;
+  tree->file_len = file_len;
+  tree->prefix = prefix;
+  snprintf(tree->dir, sizeof(tree->dir), "%s/%s_%lu_%lu", work_dir, prefix, files, file_len);
+  if (mkdir(tree->dir, 0700) != 0)
+    fail("unable to create a source tree");
+
+  for (i = 0; i != files; ++i)
+  {
+    snprintf(name, sizeof(name), "%s%04lu", prefix, i);
+    snprintf(path, sizeof(path), "%s/%s.lua", tree->dir, name);
+    write_module(path, name, file_len, i);
+  }
+}
+
+/* archive a source tree with mkrom. */
+static void make_rom(const Tree *tree, const Format *format, char *rom_path, size_t rom_path_len)
+{
+  char command[3 * PATH_MAX];
+
+  snprintf(rom_path, rom_path_len, "%s.%s.rom", tree->dir, format->name);
+  snprintf(command, sizeof(command), "%s %s -x %s/ %s/ %s 2>/dev/null",
+      mkrom, format->options, tree->dir, tree->dir, rom_path);
+  if (system(command) != 0)
+    fail("mkrom failed");
+}
+
+static char* read_rom(const char *path, size_t *len)
+{
+  FILE *f;
+  char *blob;
+  long size;
+
+  f = fopen(path, "rb");
+  if (!f || fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0)
+    fail("unable to read a ROM");
+  rewind(f);
+
+  blob = (char*)malloc(size);
+  if (!blob || fread(blob, 1, size, f) != (size_t)size)
+    fail("unable to read a ROM");
+  fclose(f);
+
+  *len = size;
+  return blob;
+}
+
+/* run an operation repeatedly, doubling the batch size until the minimum time
+ * has elapsed, and write the result.
+ */
+static void run_bench(const char *name, void (*op)(Bench*), Bench *bench)
+{
+  long long start, elapsed;
+  size_t iterations, batch, i;
+
+  elapsed = 0;
+  iterations = 0;
+  for (batch = 1; elapsed < min_time_ns || iterations < MIN_ITERATIONS; batch *= 2)
+  {
+    start = now_ns();
+    for (i = 0; i != batch; ++i)
+      op(bench);
+    elapsed += now_ns() - start;
+    iterations += batch;
+  }
+
+  printf("{\"bench\":\"%s\",\"format\":\"%s\",\"files\":%lu,\"file_len\":%lu,\"mounts\":%d,"
+      "\"iterations\":%lu,\"ns_per_op\":%.1f}\n",
+      name, bench->format ? bench->format->name : "FS", bench->tree->files, bench->tree->file_len,
+      bench->mounts, iterations, (double)elapsed / iterations);
+  fflush(stdout);
+}
+
+static void op_mount(Bench *bench)
+{
+  size_t len;
+
+  unmount_rom(mount_rom(bench->blob, bench->blob_len, &len, bench->format->passphrase));
+}
+
+static void op_mount_file(Bench *bench)
+{
+  size_t len;
+
+  unmount_rom(mount_rom_file(bench->rom_path, &len, bench->format->passphrase));
+}
+
+static void op_extract(Bench *bench)
+{
+  if (!extract_rom_file(bench->romfs, bench->paths[bench->next], 0))
+    fail("extract failed");
+  bench->next = (bench->next + 1) % bench->tree->files;
+}
+
+static void op_extract_miss(Bench *bench)
+{
+  if (extract_rom_file(bench->romfs, "missing/module.lua", 0))
+    fail("extract of a missing file succeeded");
+}
+
+/* mount any other ROMs and the benchmarked ROM in a new Lua state and require
+ * each module, or require each module from the filesystem if there is no ROM.
+ */
+static void op_require(Bench *bench)
+{
+  static const char *script =
+    "local passphrase, prefix, count, fs_path, other, mounts, rom = ...\n"
+    "local romfs = require'luaromfs'\n"
+    "for i = 2, mounts do assert(romfs.mount(other, passphrase)) end\n"
+    "if rom then assert(romfs.mount(rom, passphrase)) end\n"
+    "if fs_path then package.path = fs_path end\n"
+    "for i = 0, count - 1 do require(string.format('%s%04d', prefix, i)) end\n";
+  char fs_path[PATH_MAX + 8];
+  lua_State *L;
+
+  L = luaL_newstate();
+  if (!L)
+    fail("unable to create a Lua state");
+  luaL_openlibs(L);
+  luaromfs_require(L);
+
+  if (luaL_loadstring(L, script) != LUA_OK)
+    fail(lua_tostring(L, -1));
+
+  snprintf(fs_path, sizeof(fs_path), "%s/?.lua", bench->tree->dir);
+  lua_pushstring(L, bench->format ? bench->format->passphrase : 0);
+  lua_pushstring(L, bench->tree->prefix);
+  lua_pushinteger(L, bench->tree->files);
+  lua_pushstring(L, bench->rom_path ? 0 : fs_path);
+  lua_pushstring(L, bench->other_rom_path);
+  lua_pushinteger(L, bench->mounts);
+  lua_pushstring(L, bench->rom_path);
+  if (lua_pcall(L, 7, 0, 0) != LUA_OK)
+    fail(lua_tostring(L, -1));
+
+  lua_close(L);
+}
+
+/* benchmark a ROM format on a source tree. */
+static void bench_format(const Tree *tree, const Tree *other, const Format *format)
+{
+  char rom_path[PATH_MAX], other_rom_path[PATH_MAX], name[32];
+  Bench bench;
+  size_t len, i;
+  int m;
+
+  make_rom(tree, format, rom_path, sizeof(rom_path));
+  make_rom(other, format, other_rom_path, sizeof(other_rom_path));
+
+  memset(&bench, 0, sizeof(bench));
+  bench.tree = tree;
+  bench.format = format;
+  bench.rom_path = rom_path;
+  bench.other_rom_path = other_rom_path;
+  bench.mounts = 1;
+  bench.blob = read_rom(rom_path, &bench.blob_len);
+  run_bench("mount", op_mount, &bench);
+  run_bench("mount_file", op_mount_file, &bench);
+
+  bench.paths = (char**)malloc(tree->files * sizeof(char*));
+  if (!bench.paths)
+    fail("out of memory");
+  for (i = 0; i != tree->files; ++i)
+  {
+    snprintf(name, sizeof(name), "%s%04lu.lua", tree->prefix, i);
+    bench.paths[i] = strdup(name);
+  }
+
+  /* extract each file once first, so that files compressed individually are
+   * measured from the cache.
+   */
+  bench.romfs = mount_rom(bench.blob, bench.blob_len, &len, format->passphrase);
+  if (!bench.romfs)
+    fail("mount failed");
+  for (i = 0; i != tree->files; ++i)
+    op_extract(&bench);
+  run_bench("extract", op_extract, &bench);
+  run_bench("extract_miss", op_extract_miss, &bench);
+  unmount_rom(bench.romfs);
+
+  for (m = 0; m != sizeof(mount_counts) / sizeof(mount_counts[0]); ++m)
+  {
+    bench.mounts = mount_counts[m];
+    if (bench.mounts == 1 || tree->files == 100)
+      run_bench("require", op_require, &bench);
+  }
+
+  for (i = 0; i != tree->files; ++i)
+    free(bench.paths[i]);
+  free(bench.paths);
+  free(bench.blob);
+}
+
+int main(int argc, char **argv)
+{
+  char command[PATH_MAX + 16];
+  Tree tree, other;
+  Bench bench;
+  size_t c, l, f;
+
+  if (argc < 2 || argc > 3)
+  {
+    DEBUG("%s <mkrom> [min_time_ms]\nBenchmark mounting, extracting and requiring from ROMs built with mkrom, "
+        "writing a line of JSON for each result.\n", argv[0]);
+    return 1;
+  }
+  mkrom = argv[1];
+  if (argc == 3)
+    min_time_ns = atoll(argv[2]) * 1000000LL;
+
+  if (!mkdtemp(work_dir))
+    fail("unable to create a working directory");
+
+  make_tree(&other, OTHER_FILES, 1024, "o");
+  for (c = 0; c != sizeof(file_counts) / sizeof(file_counts[0]); ++c)
+  {
+    for (l = 0; l != sizeof(file_lens) / sizeof(file_lens[0]); ++l)
+    {
+      make_tree(&tree, file_counts[c], file_lens[l], "m");
+      DEBUG("Benchmarking %lu files of %lu bytes...\n", tree.files, tree.file_len);
+
+      /* the filesystem baseline. */
+      memset(&bench, 0, sizeof(bench));
+      bench.tree = &tree;
+      bench.mounts = 0;
+      run_bench("require", op_require, &bench);
+
+      for (f = 0; f != sizeof(formats) / sizeof(formats[0]); ++f)
+        bench_format(&tree, &other, formats + f);
+    }
+  }
+
+  snprintf(command, sizeof(command), "rm -rf %s", work_dir);
+  return system(command) == 0 ? 0 : 1;
+}
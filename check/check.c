@@ -0,0 +1,608 @@
+/* Round trip checks of mkrom and the romfs library.
+ *
+ * Synthetic source trees are archived with mkrom in each ROM format, and every
+ * file is extracted, stat'ed, listed and streamed from the mounted ROMs and
+ * compared with its source.  The trees include a path longer than 254 bytes
+ * and identical files, which need the newer image formats, and a file large
+ * enough for encrypted ROMs to be decrypted in several windows.  A ROM holding a
+ * file of more than 4 GiB, which is too large to archive with mkrom here, is
+ * built by hand and streamed.  A line is written to stdout for each ROM checked
+ * and each failure is written to stderr.
+ *
+ * Usage: check <mkrom>
+ *
+ * Author: chris.smith@oozlum.co.uk
+ * Copyright: (c) 2022 Oozlum
+ * Licence: MIT
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "romfs.h"
+
+#define DEBUG(...) fprintf(stderr, __VA_ARGS__)
+
+/* the most files held by a source tree. */
+#define MAX_FILES 16
+
+/* the length of each read from a stream, chosen not to divide the lengths of
+ * the files or the windows they are compressed in.
+ */
+#define STREAM_READ_LEN 4093
+
+/* the length of the file of the hand built ROM, which only the varint lengths
+ * of version 2 entries can describe, and the length of its zero filled buffers.
+ */
+#define LARGE_FILE_LEN (0x100000000ULL + STREAM_READ_LEN)
+#define LARGE_BUFFER_LEN (1024 * 1024)
+
+/* the length of a file that compresses to more than the 4 MiB window in which
+ * encrypted ROMs are decrypted.
+ */
+#define BIG_FILE_LEN (10 * 1024 * 1024)
+
+static const char *mkrom;
+static char work_dir[] = "/tmp/luaromfs-check.XXXXXX";
+static int failures;
+
+typedef struct _Tree
+{
+  const char *name;
+  int needs_rfs;    /* non-zero if the tree cannot be archived uncompressed without -f. */
+  size_t files;
+  char *paths[MAX_FILES];
+  char dir[256];
+}
+  Tree;
+
+typedef struct _Format
+{
+  const char *name;
+  const char *options;
+  const char *passphrase;
+  int rfs;          /* non-zero if the format can hold any tree. */
+}
+  Format;
+
+static const Format formats[] = {
+  { "ASC", "-u", 0, 0 },
+  { "BIN", "", 0, 1 },
+  { "ENC", "-e check", "check", 1 },
+  { "RFS-f", "-f", 0, 1 },
+  { "RFS-fu", "-f -u", 0, 1 },
+  { "RFS-fd", "-f -d", 0, 1 },
+  { "ENC-f", "-f -e check", "check", 1 },
+  { "ENC-fu", "-f -u -e check", "check", 1 },
+  { "RFS-f-j", "-f -j 4", 0, 1 },
+#ifdef WITH_ZSTD
+  { "ZSTD", "-z zstd", 0, 1 },
+  { "ZSTD-f", "-f -z zstd", 0, 1 },
+  { "ZSTD-fd", "-f -d -z zstd", 0, 1 },
+  { "ZSTD-fe", "-f -e check -z zstd", "check", 1 },
+#endif
+#ifdef WITH_LZ4
+  { "LZ4", "-z lz4", 0, 1 },
+  { "LZ4-f", "-f -z lz4", 0, 1 },
+  { "LZ4-fe", "-f -e check -z lz4", "check", 1 },
+#endif
+};
+
+static void fail(const char *message)
+{
+  DEBUG("check: %s\n", message);
+  exit(1);
+}
+
+static void report(const Tree *tree, const Format *format, const char *how, const char *path, const char *message)
+{
+  DEBUG("check: %s %s %s: %s: %s\n", tree->name, format->name, how, path ? path : "-", message);
+  ++failures;
+}
+
+/* create each directory leading to a path. */
+static void make_dirs(const char *path)
+{
+  char dir[PATH_MAX];
+  char *slash;
+
+  snprintf(dir, sizeof(dir), "%s", path);
+  for (slash = strchr(dir + 1, '/'); slash; slash = strchr(slash + 1, '/'))
+  {
+    *slash = 0;
+    if (mkdir(dir, 0700) != 0 && access(dir, F_OK) != 0)
+      fail("unable to create a directory");
+    *slash = '/';
+  }
+}
+
+/* add a file of len pseudo-random bytes to a tree.  Text files are made of
+ * words, so that they compress, while binary files are made of bytes of any
+ * value in runs.  Files added with the same length, seed and type are identical.
+ */
+static void add_file(Tree *tree, const char *path, size_t len, unsigned int seed, int binary)
+{
+  static const char *words[] = {
+    "local", "function", "return", "end", "table", "string", "value", "index",
+    "module", "insert", "format", "self", "count", "result", "error", "true"
+  };
+  char full_path[PATH_MAX];
+  FILE *f;
+  size_t i;
+  int c;
+
+  if (tree->files == MAX_FILES)
+    fail("too many files");
+  tree->paths[tree->files++] = strdup(path);
+
+  snprintf(full_path, sizeof(full_path), "%s/%s", tree->dir, path);
+  make_dirs(full_path);
+  f = fopen(full_path, "wb");
+  if (!f)
+    fail("unable to write a file");
+
+  c = 0;
+  for (i = 0; i < len; )
+  {
+    seed = seed * 1103515245 + 12345;
+    if (binary)
+    {
+      if ((seed >> 8) % 4 == 0)
+        c = (seed >> 16) & 0xff;
+      fputc(c, f);
+      ++i;
+    }
+    else
+      i += fprintf(f, "%.*s%s", (int)(len - i), words[(seed >> 16) % 16], (seed >> 8) % 8 ? " " : "\n");
+  }
+  fclose(f);
+}
+
+static void make_tree(Tree *tree, const char *name)
+{
+  memset(tree, 0, sizeof(*tree));
+  tree->name = name;
+  snprintf(tree->dir, sizeof(tree->dir), "%s/%s", work_dir, name);
+  if (mkdir(tree->dir, 0700) != 0)
+    fail("unable to create a source tree");
+
+  add_file(tree, "empty.txt", 0, 1, 0);
+  add_file(tree, "init.lua", 2000, 2, 0);
+  add_file(tree, "lib/util.lua", 40000, 3, 0);
+  add_file(tree, "lib/sub/tiny.lua", 1, 4, 0);
+  add_file(tree, "data/blob.bin", 700000, 5, 1);
+}
+
+/* read a whole file, which is returned with its length in len. */
+static char* read_file(const char *path, size_t *len)
+{
+  FILE *f;
+  char *data;
+  long size;
+
+  f = fopen(path, "rb");
+  if (!f || fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 0)
+    fail("unable to read a file");
+  rewind(f);
+
+  data = (char*)malloc(size + 1);
+  if (!data || fread(data, 1, size, f) != (size_t)size)
+    fail("unable to read a file");
+  fclose(f);
+
+  *len = size;
+  return data;
+}
+
+/* read a file of a tree from its source. */
+static char* read_source(const Tree *tree, const char *path, size_t *len)
+{
+  char full_path[PATH_MAX];
+
+  snprintf(full_path, sizeof(full_path), "%s/%s", tree->dir, path);
+  return read_file(full_path, len);
+}
+
+/* archive a source tree with mkrom.
+ * return zero if mkrom failed.
+ */
+static int make_rom(const Tree *tree, const Format *format, char *rom_path, size_t rom_path_len)
+{
+  char command[3 * PATH_MAX];
+
+  snprintf(rom_path, rom_path_len, "%s.%s.rom", tree->dir, format->name);
+  snprintf(command, sizeof(command), "%s %s -x %s/ %s/ %s 2>/dev/null",
+      mkrom, format->options, tree->dir, tree->dir, rom_path);
+  return system(command) == 0;
+}
+
+typedef struct _Listing
+{
+  const Tree *tree;
+  const Format *format;
+  size_t files;
+}
+  Listing;
+
+static int check_listed(void *ctx, const char *mount_point, const char *path, size_t file_len)
+{
+  Listing *listing = (Listing*)ctx;
+  char *source;
+  size_t len;
+
+  (void)mount_point;
+  ++listing->files;
+  source = read_source(listing->tree, path, &len);
+  if (file_len != len)
+    report(listing->tree, listing->format, "list", path, "wrong length");
+  free(source);
+  return 0;
+}
+
+/* read a file through a stream, in pieces and again from its middle. */
+static void check_stream(const Tree *tree, const Format *format, const char *romfs, const char *path,
+    const char *source, size_t len)
+{
+  ROMStream *stream;
+  char buffer[STREAM_READ_LEN];
+  size_t offset, read_len;
+
+  stream = open_rom_file(romfs, path);
+  if (!stream)
+  {
+    report(tree, format, "stream", path, "not opened");
+    return;
+  }
+  if (rom_stream_len(stream) != len)
+    report(tree, format, "stream", path, "wrong length");
+
+  for (offset = 0; (read_len = read_rom_stream(stream, buffer, sizeof(buffer))) != 0; offset += read_len)
+  {
+    if (offset + read_len > len || memcmp(buffer, source + offset, read_len) != 0)
+      break;
+  }
+  if (read_len != 0 || offset != len || tell_rom_stream(stream) != len)
+    report(tree, format, "stream", path, "wrong content");
+
+  offset = len / 2;
+  if (!seek_rom_stream(stream, offset))
+    report(tree, format, "seek", path, "failed");
+  else
+  {
+    read_len = read_rom_stream(stream, buffer, sizeof(buffer));
+    if (read_len != (len - offset < sizeof(buffer) ? len - offset : sizeof(buffer))
+        || memcmp(buffer, source + offset, read_len) != 0)
+      report(tree, format, "seek", path, "wrong content");
+  }
+  if (seek_rom_stream(stream, len + 1))
+    report(tree, format, "seek", path, "beyond the end succeeded");
+
+  close_rom_stream(stream);
+}
+
+/* check every file of a tree against a mounted ROM. */
+static void check_rom(const Tree *tree, const Format *format, const char *romfs, const char *how)
+{
+  Listing listing;
+  const char *data;
+  char *source;
+  size_t len, file_len, i;
+
+  if (!romfs)
+  {
+    report(tree, format, how, 0, "mount failed");
+    return;
+  }
+
+  for (i = 0; i != tree->files; ++i)
+  {
+    source = read_source(tree, tree->paths[i], &len);
+
+    if (!stat_rom_file(romfs, tree->paths[i], &file_len))
+      report(tree, format, "stat", tree->paths[i], "not found");
+    else if (file_len != len)
+      report(tree, format, "stat", tree->paths[i], "wrong length");
+
+    data = extract_rom_file(romfs, tree->paths[i], &file_len);
+    if (!data)
+      report(tree, format, "extract", tree->paths[i], "not found");
+    else if (file_len != len || memcmp(data, source, len) != 0)
+      report(tree, format, "extract", tree->paths[i], "wrong content");
+
+    check_stream(tree, format, romfs, tree->paths[i], source, len);
+    free(source);
+  }
+
+  if (extract_rom_file(romfs, "missing.lua", 0) || stat_rom_file(romfs, "missing.lua", 0))
+    report(tree, format, how, "missing.lua", "found");
+
+  memset(&listing, 0, sizeof(listing));
+  listing.tree = tree;
+  listing.format = format;
+  if (list_rom_files(romfs, 0, check_listed, &listing) != tree->files || listing.files != tree->files)
+    report(tree, format, "list", 0, "wrong number of files");
+
+  unmount_rom(romfs);
+}
+
+/* archive a tree in a format and check the ROM mounted from memory and from
+ * disk.
+ */
+static void check_format(const Tree *tree, const Format *format)
+{
+  char rom_path[PATH_MAX];
+  char *blob;
+  size_t blob_len, len;
+  int before;
+
+  before = failures;
+  if (!make_rom(tree, format, rom_path, sizeof(rom_path)))
+  {
+    if (format->rfs || !tree->needs_rfs)
+      report(tree, format, "mkrom", 0, "failed");
+    else if (access(rom_path, F_OK) == 0)
+      report(tree, format, "mkrom", rom_path, "left a partial ROM");
+    else
+      printf("ok   %-8s %s rejected\n", format->name, tree->name);
+    return;
+  }
+  if (!format->rfs && tree->needs_rfs)
+  {
+    report(tree, format, "mkrom", 0, "succeeded");
+    return;
+  }
+
+  blob = read_file(rom_path, &blob_len);
+  check_rom(tree, format, mount_rom(blob, blob_len, &len, format->passphrase), "mount");
+  free(blob);
+  check_rom(tree, format, mount_rom_file(rom_path, &len, format->passphrase), "mount_file");
+
+  printf("%s %-8s %s\n", failures == before ? "ok  " : "FAIL", format->name, tree->name);
+  fflush(stdout);
+}
+
+static size_t write_varint(unsigned char *p, unsigned long long value)
+{
+  size_t len;
+
+  for (len = 0; value > 0x7F; value >>= 7)
+    p[len++] = (value & 0x7F) | 0x80;
+  p[len++] = value;
+
+  return len;
+}
+
+static void write_be(unsigned char *p, unsigned long long value, int len)
+{
+  while (len--)
+  {
+    p[len] = value & 0xFF;
+    value >>= 8;
+  }
+}
+
+/* deflate a file of LARGE_FILE_LEN zero bytes, ending with "tail", as a zlib
+ * stream.
+ * return the stream, with its length in len.
+ */
+static unsigned char* deflate_large_file(size_t *len)
+{
+  z_stream strm;
+  unsigned char *zeros, *data;
+  unsigned long long left;
+  size_t alloc_len;
+  int ret;
+
+  zeros = (unsigned char*)calloc(1, LARGE_BUFFER_LEN);
+  alloc_len = 8 * LARGE_BUFFER_LEN;
+  data = (unsigned char*)malloc(alloc_len);
+  memset(&strm, 0, sizeof(strm));
+  if (!zeros || !data || deflateInit(&strm, Z_BEST_SPEED) != Z_OK)
+    fail("unable to deflate the large file");
+
+  left = LARGE_FILE_LEN - 4;
+  ret = Z_OK;
+  while (ret == Z_OK)
+  {
+    if (strm.avail_in == 0 && left)
+    {
+      strm.next_in = zeros;
+      strm.avail_in = left > LARGE_BUFFER_LEN ? LARGE_BUFFER_LEN : left;
+      left -= strm.avail_in;
+      if (!left)
+      {
+        /* the buffer is not read again, so its end holds the tail. */
+        memcpy(zeros + strm.avail_in, "tail", 4);
+        strm.avail_in += 4;
+      }
+    }
+    if (strm.avail_out == 0)
+    {
+      if (strm.total_out == alloc_len && !(data = (unsigned char*)realloc(data, alloc_len *= 2)))
+        fail("unable to deflate the large file");
+      strm.next_out = data + strm.total_out;
+      strm.avail_out = alloc_len - strm.total_out;
+    }
+    ret = deflate(&strm, left || strm.avail_in ? Z_NO_FLUSH : Z_FINISH);
+    if (ret == Z_BUF_ERROR && strm.avail_out == 0)
+      ret = Z_OK;
+  }
+  if (ret != Z_STREAM_END)
+    fail("unable to deflate the large file");
+
+  *len = strm.total_out;
+  deflateEnd(&strm);
+  free(zeros);
+  return data;
+}
+
+/* write a version 2 RFS ROM holding one file of LARGE_FILE_LEN bytes,
+ * compressed individually, with a path longer than 254 bytes:
+ *   "RFS", 2, RFS_FILES record, RFS_END record, entry, index of two slots.
+ */
+static void write_large_rom(const char *rom_path, const char *path)
+{
+  unsigned char header[32], file_header[16], footer[32], *data;
+  size_t data_len, header_len, file_header_len, path_len;
+  unsigned int hash;
+  const char *p;
+  FILE *f;
+
+  data = deflate_large_file(&data_len);
+  path_len = strlen(path) + 1;
+
+  memcpy(header, "RFS\x02\x82\0\0\0\x04\0\0\0\x01\0\0\0\0\0", 18);
+  header_len = 18;
+
+  /* the entry data holds the file method and length followed by the zlib stream. */
+  file_header[0] = 1;
+  file_header_len = 1 + write_varint(file_header + 1, LARGE_FILE_LEN);
+  header_len += write_varint(header + header_len, file_header_len + data_len);
+  header_len += write_varint(header + header_len, path_len);
+
+  /* the single entry is at the start of the image and is found by the FNV-1a
+   * hash of its path.
+   */
+  for (hash = 2166136261UL, p = path; *p; ++p)
+    hash = (hash ^ (unsigned char)*p) * 16777619UL;
+  memset(footer, 0, 16);
+  write_be(footer + (hash & 1) * 8, 1, 8);
+  write_be(footer + 16, 2, 4);
+  memcpy(footer + 20, "IDX", 3);
+
+  f = fopen(rom_path, "wb");
+  if (!f ||
+      fwrite(header, header_len, 1, f) != 1 ||
+      fwrite(path, path_len, 1, f) != 1 ||
+      fwrite(file_header, file_header_len, 1, f) != 1 ||
+      fwrite(data, data_len, 1, f) != 1 ||
+      fwrite(footer, 23, 1, f) != 1 ||
+      fclose(f) != 0)
+    fail("unable to write the large ROM");
+  free(data);
+}
+
+/* stream the start and end of the file of a hand built ROM of more than 4 GiB.
+ * The file is not extracted, which would need a buffer of its length.
+ */
+static void check_large_rom(const char *path)
+{
+  static const Format format = { "RFS-v2", "", 0, 1 };
+  Tree tree;
+  ROMStream *stream;
+  char rom_path[PATH_MAX], buffer[STREAM_READ_LEN], expected[STREAM_READ_LEN];
+  const char *romfs;
+  size_t len, file_len;
+  int before;
+
+  if (sizeof(size_t) < 8)
+    return;
+
+  before = failures;
+  memset(&tree, 0, sizeof(tree));
+  tree.name = "large";
+  snprintf(rom_path, sizeof(rom_path), "%s/large.rom", work_dir);
+  write_large_rom(rom_path, path);
+
+  romfs = mount_rom_file(rom_path, &len, 0);
+  if (!romfs)
+  {
+    report(&tree, &format, "mount_file", 0, "mount failed");
+    return;
+  }
+
+  if (!stat_rom_file(romfs, path, &file_len) || file_len != LARGE_FILE_LEN)
+    report(&tree, &format, "stat", path, "wrong length");
+
+  memset(expected, 0, sizeof(expected));
+  stream = open_rom_file(romfs, path);
+  if (!stream)
+    report(&tree, &format, "stream", path, "not opened");
+  else
+  {
+    if (rom_stream_len(stream) != LARGE_FILE_LEN)
+      report(&tree, &format, "stream", path, "wrong length");
+    if (read_rom_stream(stream, buffer, sizeof(buffer)) != sizeof(buffer) || memcmp(buffer, expected, sizeof(buffer)) != 0)
+      report(&tree, &format, "stream", path, "wrong content");
+
+    memcpy(expected + sizeof(expected) - 4, "tail", 4);
+    if (!seek_rom_stream(stream, LARGE_FILE_LEN - sizeof(buffer)) ||
+        read_rom_stream(stream, buffer, sizeof(buffer)) != sizeof(buffer) ||
+        memcmp(buffer, expected, sizeof(buffer)) != 0 ||
+        read_rom_stream(stream, buffer, sizeof(buffer)) != 0 ||
+        tell_rom_stream(stream) != LARGE_FILE_LEN)
+      report(&tree, &format, "seek", path, "wrong content");
+    close_rom_stream(stream);
+  }
+  unmount_rom(romfs);
+
+  printf("%s %-8s %s\n", failures == before ? "ok  " : "FAIL", format.name, tree.name);
+  fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+  char command[PATH_MAX + 16], path[PATH_MAX];
+  Tree trees[4];
+  size_t t, f, i;
+
+  if (argc != 2)
+  {
+    DEBUG("%s <mkrom>\nCheck that every file of ROMs built with mkrom in each format is extracted, "
+        "stat'ed, listed and streamed as it was archived.\n", argv[0]);
+    return 1;
+  }
+  mkrom = argv[1];
+
+  if (!mkdtemp(work_dir))
+    fail("unable to create a working directory");
+
+  make_tree(trees + 0, "plain");
+
+  /* a path longer than 254 bytes, made of names no longer than 255 bytes. */
+  make_tree(trees + 1, "long");
+  trees[1].needs_rfs = 1;
+  memset(path, 'a', 120);
+  path[120] = '/';
+  memset(path + 121, 'b', 120);
+  path[241] = '/';
+  memset(path + 242, 'c', 60);
+  strcpy(path + 302, ".lua");
+  add_file(trees + 1, path, 5000, 6, 0);
+
+  /* identical files, which are stored once. */
+  make_tree(trees + 2, "dup");
+  add_file(trees + 2, "copy/init.lua", 2000, 2, 0);
+  add_file(trees + 2, "copy/blob.bin", 700000, 5, 1);
+  add_file(trees + 2, "copy/empty.txt", 0, 1, 0);
+
+  /* a file large enough that even compressed, an encrypted ROM holding it is
+   * decrypted in several windows and in parallel.
+   */
+  make_tree(trees + 3, "big");
+  add_file(trees + 3, "data/big.bin", BIG_FILE_LEN, 7, 1);
+
+  for (t = 0; t != sizeof(trees) / sizeof(trees[0]); ++t)
+  {
+    for (f = 0; f != sizeof(formats) / sizeof(formats[0]); ++f)
+      check_format(trees + t, formats + f);
+    for (i = 0; i != trees[t].files; ++i)
+      free(trees[t].paths[i]);
+  }
+
+  check_large_rom(path);
+
+  snprintf(command, sizeof(command), "rm -rf %s", work_dir);
+  if (system(command) != 0)
+    fail("unable to remove the working directory");
+
+  if (failures)
+  {
+    DEBUG("check: %d failures\n", failures);
+    return 1;
+  }
+  return 0;
+}
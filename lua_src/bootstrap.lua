@@ -6,10 +6,27 @@
 -- Licence: MIT
 
 local api = {}
-api.mount, api.extract = ...
+api.mount, api.extract, api.mount_file, api.cache_stats, api.bytecode_tag, api.stats, api.lookup_timing,
+  api.table_add, api.table_extract, api.table_list, api.table_stat, api.table_open = ...
 
+-- the mounted ROMs, in mount order, which is also the order of the ROM table
+-- in C that overlays their files.
 local rom = {}
 
+-- the search path templates of every ROM, in the order they first appear.
+local templates = {}
+
+-- modules searched for in the mounted ROMs, and those not found.
+local searches, search_misses = 0, 0
+
+-- the path and ROM each module was found at, and the modules not found in any
+-- ROM.  Both are cleared whenever the mounted ROMs change.
+local resolved, unresolved = {}, {}
+
+local function invalidate_searches()
+  resolved, unresolved = {}, {}
+end
+
 local M = {
   default_searchpath = '?;?.lua;?/?.lua;?/init.lua',
 }
@@ -20,43 +37,131 @@ local function rom_extract(r, file)
   end
 end
 
-local function mount_string(content, passphrase, mount_point, searchpath)
-  searchpath = searchpath or M.default_searchpath or ''
-  mount_point = mount_point or ''
-  content = api.mount(content, passphrase)
-  if not content then
-    return nil, 'Mount failed'
+-- ROMs compiled to bytecode by mkrom -b are tagged with the stripped bytecode of
+-- an empty chunk, which must match that of this Lua VM.
+local bytecode_tag = string.dump(load(''), true)
+
+local function add_rom(content, mount_point, searchpath)
+  local tag = api.bytecode_tag(content)
+  if tag and tag ~= bytecode_tag then
+    return nil, 'ROM bytecode was compiled for a different Lua VM'
   end
 
   local rom_obj = {
     content = content,
-    mount_point = mount_point,
-    searchpath = searchpath
+    mount_point = mount_point or '',
+    searchpath = searchpath or M.default_searchpath or '',
+    template_rank = {}
   }
+  if not api.table_add(content, rom_obj.mount_point) then
+    return nil, 'Mount failed'
+  end
+
+  local rank = 0
+  for path in string.gmatch(rom_obj.searchpath, "([^;]+)") do
+    if not rom_obj.template_rank[path] then
+      rank = rank + 1
+      rom_obj.template_rank[path] = rank
+    end
+    local known = false
+    for _,t in ipairs(templates) do
+      known = known or t == path
+    end
+    if not known then
+      templates[#templates + 1] = path
+    end
+  end
   rom[#rom + 1] = rom_obj
+  invalidate_searches()
 
   return {
     extract = function(self, file)
       return rom_extract(rom_obj, file)
+    end,
+    -- return the cache hits, misses and bytes held by files inflated from the ROM.
+    cache_stats = function(self)
+      return api.cache_stats(rom_obj.content)
+    end,
+    -- return a table of the statistics of the ROM, as per romfs.stats.
+    stats = function(self)
+      return api.stats(rom_obj.content)
     end
   }
 end
+
+-- cache_limit bounds the bytes held by files inflated from ROMs whose files are
+-- compressed individually; the least recently used files are released first.
+local function mount_string(content, passphrase, mount_point, searchpath, cache_limit)
+  content = api.mount(content, passphrase, cache_limit)
+  if not content then
+    return nil, 'Mount failed'
+  end
+  return add_rom(content, mount_point, searchpath)
+end
 M.mount_string = mount_string
 
-local function mount(file, passphrase, mount_point, searchpath)
+-- attach a ROM userdata mounted and shared by the host, as by luaromfs_attach.
+M.attach = add_rom
+
+local function mount(file, passphrase, mount_point, searchpath, cache_limit)
   if not file then
     return nil, 'No file specified'
   end
-  local f, err = io.open(file, 'r')
-  if not f then
+  local content, err = api.mount_file(file, passphrase, cache_limit)
+  if not content then
     return nil, err
   end
-  local rom_content = f:read('*a')
-  f:close()
-  return mount_string(rom_content, passphrase, mount_point or '', searchpath)
+  return add_rom(content, mount_point, searchpath)
 end
 M.mount = mount
 
+-- return a table of the statistics of every ROM mounted by the process, those
+-- since unmounted included, and of the lookups in the ROMs of this state that
+-- found no file, with the modules searched for in the ROMs of this state and a
+-- table of the statistics of each ROM mounted by it in roms.
+local function stats()
+  local s = api.stats()
+  s.searches, s.search_misses = searches, search_misses
+  s.roms = {}
+  for i,r in ipairs(rom) do
+    s.roms[i] = api.stats(r.content)
+    s.roms[i].mount_point = r.mount_point
+  end
+  return s
+end
+M.stats = stats
+
+-- return a sorted table of the full paths of the files in the mounted ROMs
+-- that start with prefix, or of every file if prefix is nil.  Files are listed
+-- without being extracted.
+local function list(prefix)
+  local paths = api.table_list(prefix)
+  table.sort(paths)
+  return paths
+end
+M.list = list
+
+-- return a table describing the file or directory at the given full path in
+-- the mounted ROMs, with mode 'file' and size, or mode 'directory', or nil.
+local function stat(path)
+  local size = api.table_stat(path)
+  if size then
+    return { mode = 'file', size = size }
+  elseif size == false then
+    return { mode = 'directory' }
+  end
+end
+M.stat = stat
+
+-- open the file at the given full path in the mounted ROMs and return a handle
+-- with read, lines, seek and close methods, as per io.open, which reads the
+-- file a part at a time rather than extracting it as a whole.
+M.open = api.table_open
+
+-- lookups are timed only when enabled, as reading the clock costs about as
+-- much as a lookup.
+M.lookup_timing = api.lookup_timing
+
 local function file_not_found(err)
   if err:match('No such file or directory') then
     return true
@@ -65,25 +170,53 @@ local function file_not_found(err)
 end
 
 local function extract(file)
-  local content
-  for _,r in ipairs(rom) do
-    content = rom_extract(r, file)
-    if content then
-      return content
-    end
+  return (api.table_extract(file))
+end
+
+-- the order in which loadfile and dofile look for files: on disk and then in
+-- the ROMs, in the ROMs and then on disk, or only in the ROMs.
+local resolution = 'disk-first'
+local resolutions = { ['disk-first'] = true, ['rom-first'] = true, ['rom-only'] = true }
+
+-- set the resolution order of loadfile and dofile and return the previous one.
+local function set_resolution(order)
+  if not resolutions[order] then
+    error('invalid resolution order: ' .. tostring(order), 2)
   end
+  local previous = resolution
+  resolution = order
+  return previous
+end
+M.set_resolution = set_resolution
+
+local function not_found(file)
+  return nil, 'cannot open ' .. tostring(file) .. ': No such file or directory'
 end
 
 local old_loadfile = loadfile
 loadfile = function(file)
-  local f, err = old_loadfile(file)
+  local f, err
+
+  -- the ROM index is checked first so that files held in ROM cost no failed
+  -- filesystem calls.  Standard input is always read as usual.
+  if resolution ~= 'disk-first' and file ~= nil then
+    f = extract(file)
+    if f then
+      return load(f, file)
+    elseif resolution == 'rom-only' then
+      return not_found(file)
+    end
+    return old_loadfile(file)
+  end
+
+  f, err = old_loadfile(file)
   if not f then
     if file_not_found(err) then
       f = extract(file)
       if f then
         f, err = load(f, file)
       else
-        f, err = nil, 'cannot open ' .. tostring(file) .. ': No such file or directory'
+        f, err = not_found(file)
       end
     end
   end
@@ -100,16 +233,52 @@ dofile = function(file)
 end
 
 table.insert(package.searchers, 3, function(modulename)
+  searches = searches + 1
+  if unresolved[modulename] then
+    search_misses = search_misses + 1
+    return nil
+  end
+
+  local cached = resolved[modulename]
+  if cached then
+    local file = rom_extract(rom[cached.mount], cached.filename)
+    if file then
+      return load(file, cached.filename)
+    end
+  end
+
+  -- probe the ROM table once per template.  A file is found through the
+  -- templates of the ROM holding it, and the ROM mounted first wins, then the
+  -- template earliest in its search path.  Where the table resolves a path to
+  -- a ROM that does not search the template, the later ROMs that do are probed
+  -- directly, as the path may be shadowed in them.
   local modulepath = string.gsub(modulename, "%.", "/")
-  for _,r in ipairs(rom) do
-    for path in string.gmatch(r.searchpath, "([^;]+)") do
-      local filename = string.gsub(path, "%?", modulepath)
-      local file = rom_extract(r, filename)
-      if file then
-        return load(file, filename)
+  local found, found_file, found_mount, found_rank
+  for _,path in ipairs(templates) do
+    local filename = string.gsub(path, "%?", modulepath)
+    local file, mount = api.table_extract(filename)
+    local rank = file and rom[mount].template_rank[path]
+    if file and not rank then
+      file = nil
+      for m = mount + 1, found_mount or #rom do
+        rank = rom[m].template_rank[path]
+        file = rank and rom_extract(rom[m], filename)
+        if file then
+          mount = m
+          break
+        end
       end
     end
+    if file and (not found or mount < found_mount or (mount == found_mount and rank < found_rank)) then
+      found, found_file, found_mount, found_rank = filename, file, mount, rank
+    end
+  end
+  if found then
+    resolved[modulename] = { filename = found, mount = found_mount }
+    return load(found_file, found)
   end
+  unresolved[modulename] = true
+  search_misses = search_misses + 1
   return nil
 end)
 
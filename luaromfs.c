@@ -5,6 +5,9 @@
  * Licence: MIT
  */
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
@@ -13,83 +16,861 @@
 
 #include ".lua_src.c"
 
-/* Lua C function.  Takes a ROM blob the stack and returns the string representation
- * of the ROM filesystem.  This function must be called for a ROM blob before
- * calling extract_romfile.
+#define ROM_METATABLE "luaromfs.rom"
+#define TABLE_METATABLE "luaromfs.table"
+#define FILE_METATABLE "luaromfs.file"
+
+/* bytes read ahead from a stream by a file handle, for reading lines. */
+#define FILE_BUFFER_LEN 4096
+
+/* a file opened by romfs.open. */
+typedef struct _FileHandle {
+  ROMStream *stream;    /* zero once the file is closed. */
+  size_t ahead;         /* position of the next unread byte in buffer. */
+  size_t ahead_len;     /* bytes held in buffer. */
+  char buffer[FILE_BUFFER_LEN];
+}
+  FileHandle;
+
+/* push a userdata owning the given mounted ROM filesystem, or nil. */
+static void push_rom(lua_State *L, const char *romfs)
+{
+  const char **rom;
+
+  if (!romfs)
+  {
+    lua_pushnil(L);
+    return;
+  }
+
+  rom = (const char**)lua_newuserdata(L, sizeof(const char*));
+  *rom = romfs;
+  luaL_setmetatable(L, ROM_METATABLE);
+}
+
+/* Lua C function.  Releases the ROM filesystem owned by a ROM userdata.
+ * Stack index 1: ROM userdata
+ */
+static int c_gc_rom(lua_State *L)
+{
+  const char **rom;
+
+  rom = (const char**)luaL_checkudata(L, 1, ROM_METATABLE);
+  unmount_rom(*rom);
+  *rom = 0;
+
+  return 0;
+}
+
+/* Lua C function.  Takes a ROM blob the stack and returns a userdata holding
+ * the mounted ROM filesystem, which references the blob.  This function must be
+ * called for a ROM blob before calling extract_romfile.
  * Stack index 1: ROM string blob
+ * Stack index 2: passphrase (optional)
+ * Stack index 3: cache limit in bytes (optional)
  */
 static int c_mount_rom(lua_State *L)
 {
   const char *rom_blob, *romfs, *passphrase;
-  size_t rom_blob_len, romfs_len;
+  size_t rom_blob_len, romfs_len, cache_limit;
+  lua_Integer limit;
 
   rom_blob = luaL_checklstring(L, 1, &rom_blob_len);
   passphrase = luaL_optstring(L, 2, 0);
-  romfs = mount_rom(rom_blob, rom_blob_len, &romfs_len, passphrase);
-  lua_settop(L, 0);
+  limit = luaL_optinteger(L, 3, 0);
+  luaL_argcheck(L, limit >= 0, 3, "cache limit must not be negative");
+  cache_limit = (size_t)limit;
+  romfs = mount_rom_in_place(rom_blob, rom_blob_len, &romfs_len, passphrase);
+  set_rom_cache_limit(romfs, cache_limit);
+  push_rom(L, romfs);
 
+  /* the ROM may be served from the blob, so keep the blob alive with it. */
   if (romfs)
   {
-    lua_pushlstring(L, romfs, romfs_len);
-    free((void*)romfs);
+    lua_pushvalue(L, 1);
+    lua_setuservalue(L, -2);
   }
-  else
+
+  return 1;
+}
+
+/* Lua C function.  Takes a ROM file path on the stack and returns a userdata
+ * holding the mounted ROM filesystem, or nil and an error message.
+ * Stack index 1: ROM file path
+ * Stack index 2: passphrase (optional)
+ * Stack index 3: cache limit in bytes (optional)
+ */
+static int c_mount_romfile(lua_State *L)
+{
+  const char *path, *romfs, *passphrase;
+  size_t romfs_len, cache_limit;
+  lua_Integer limit;
+
+  path = luaL_checkstring(L, 1);
+  passphrase = luaL_optstring(L, 2, 0);
+  limit = luaL_optinteger(L, 3, 0);
+  luaL_argcheck(L, limit >= 0, 3, "cache limit must not be negative");
+  cache_limit = (size_t)limit;
+  errno = 0;
+  romfs = mount_rom_file(path, &romfs_len, passphrase);
+  if (!romfs)
+  {
+    lua_pushnil(L);
+    if (errno)
+      lua_pushfstring(L, "%s: %s", path, strerror(errno));
+    else
+      lua_pushliteral(L, "Mount failed");
+    return 2;
+  }
+
+  set_rom_cache_limit(romfs, cache_limit);
+  lua_settop(L, 0);
+  push_rom(L, romfs);
+
+  return 1;
+}
+
+/* push the contents of the file matching the given path in a ROM, or in any ROM
+ * of a table if table is not NULL, or nil, and store the position of the ROM
+ * holding a file found in a table in mount_index.  If the ROM has a cache
+ * limit, another thread sharing it may evict the file at any time, so the file
+ * is extracted and copied while the ROM is locked, into a buffer sized from the
+ * index and allocated beforehand so that a Lua memory error cannot leave the
+ * ROM locked.
+ * return zero if the file is not found.
+ */
+static int push_file(lua_State *L, ROMTable *table, const char *romfs, const char *path, size_t *mount_index)
+{
+  luaL_Buffer b;
+  const char *file_content;
+  char *buffer;
+  size_t file_size, len;
+
+  /* find the ROM holding the file, and the length of the file, without
+   * inflating it.  A missing file is still extracted, to count the miss.
+   */
+  if (table)
+    romfs = stat_table_file(table, path, &file_size, mount_index) ? get_table_rom(table, *mount_index) : 0;
+  if (!romfs || !get_rom_cache_limit(romfs) || (!table && !stat_rom_file(romfs, path, &file_size)))
+  {
+    file_content = table ? extract_table_file(table, path, &len, 0) : extract_rom_file(romfs, path, &len);
+    if (file_content)
+      lua_pushlstring(L, file_content, len);
+    else
+      lua_pushnil(L);
+    return file_content != 0;
+  }
+
+  buffer = luaL_buffinitsize(L, &b, file_size);
+  lock_rom(romfs);
+  file_content = table ? extract_table_file(table, path, &len, 0) : extract_rom_file(romfs, path, &len);
+  if (file_content && len == file_size)
+    memcpy(buffer, file_content, len);
+  unlock_rom(romfs);
+
+  luaL_pushresultsize(&b, file_size);
+  if (!file_content || len != file_size)
+  {
+    lua_pop(L, 1);
     lua_pushnil(L);
+    return 0;
+  }
 
   return 1;
 }
 
-/* Lua C function.  Takes a ROM content and filename on the stack and returns the
+/* Lua C function.  Takes a ROM userdata and filename on the stack and returns the
  * file contents or nil.
- * Stack index 1: ROM content
+ * Stack index 1: ROM userdata
  * Stack index 2: filename
  */
 static int c_extract_romfile(lua_State *L)
 {
-  const char *rom, *file, *file_content;
-  size_t file_size;
+  const char **rom, *file;
 
-  rom = luaL_checkstring(L, 1);
+  rom = (const char**)luaL_checkudata(L, 1, ROM_METATABLE);
   file = luaL_checkstring(L, 2);
-  file_content = extract_rom_file(rom, file, &file_size);
+  push_file(L, 0, *rom, file, 0);
+
+  return 1;
+}
+
+/* Lua C function.  Takes a ROM userdata on the stack and returns the number of
+ * extractions served from and missing the cache of inflated files, and the
+ * bytes held by the cache.
+ * Stack index 1: ROM userdata
+ */
+static int c_cache_stats(lua_State *L)
+{
+  const char **rom;
+  size_t hits, misses, cache_len;
+
+  rom = (const char**)luaL_checkudata(L, 1, ROM_METATABLE);
+  hits = misses = cache_len = 0;
+  get_rom_cache_stats(*rom, &hits, &misses, &cache_len);
   lua_settop(L, 0);
 
-  if (file_content)
-    lua_pushlstring(L, file_content, file_size);
+  lua_pushinteger(L, (lua_Integer)hits);
+  lua_pushinteger(L, (lua_Integer)misses);
+  lua_pushinteger(L, (lua_Integer)cache_len);
+
+  return 3;
+}
+
+/* Lua C function.  Takes a ROM userdata on the stack and returns the tag of the
+ * Lua VM that compiled its .lua files to bytecode, or nil if the ROM does not
+ * hold bytecode.
+ * Stack index 1: ROM userdata
+ */
+static int c_bytecode_tag(lua_State *L)
+{
+  const char **rom, *tag;
+  size_t tag_len;
+
+  rom = (const char**)luaL_checkudata(L, 1, ROM_METATABLE);
+  tag = get_rom_bytecode_tag(*rom, &tag_len);
+  lua_settop(L, 0);
+
+  if (tag)
+    lua_pushlstring(L, tag, tag_len);
   else
     lua_pushnil(L);
 
   return 1;
 }
 
-/* lua module entry. */
-__attribute__((visibility ("default")))
-int luaopen_luaromfs(lua_State *L)
+/* set a field of the table at the top of the stack to an integer. */
+static void set_integer_field(lua_State *L, const char *name, unsigned long long value)
 {
-  const char *rom, *bootcode;
-  size_t src_len;
-  int ok;
+  lua_pushinteger(L, (lua_Integer)value);
+  lua_setfield(L, -2, name);
+}
+
+/* Lua C function.  Returns a table of the statistics of a ROM userdata, or of
+ * every ROM mounted by the process if none is given, together with the lookups
+ * in the ROM table of the Lua state, held as upvalue 1, that found no file.
+ * Stack index 1: ROM userdata (optional)
+ */
+static int c_stats(lua_State *L)
+{
+  const char **rom;
+  ROMTable **table;
+  ROMStats stats, misses;
+
+  rom = lua_isnoneornil(L, 1) ? 0 : (const char**)luaL_checkudata(L, 1, ROM_METATABLE);
+  get_rom_stats(rom ? *rom : 0, &stats);
+  if (!rom)
+  {
+    table = (ROMTable**)luaL_checkudata(L, lua_upvalueindex(1), TABLE_METATABLE);
+    get_table_stats(*table, &misses);
+    stats.lookups += misses.lookups;
+    stats.lookup_misses += misses.lookup_misses;
+    stats.entries_scanned += misses.entries_scanned;
+    stats.lookup_ns += misses.lookup_ns;
+  }
+  lua_settop(L, 0);
+
+  lua_createtable(L, 0, 11);
+  set_integer_field(L, "mounts", stats.mounts);
+  set_integer_field(L, "unmounts", stats.unmounts);
+  set_integer_field(L, "lookups", stats.lookups);
+  set_integer_field(L, "lookup_misses", stats.lookup_misses);
+  set_integer_field(L, "entries_scanned", stats.entries_scanned);
+  set_integer_field(L, "bytes_inflated", stats.bytes_inflated);
+  set_integer_field(L, "bytes_decrypted", stats.bytes_decrypted);
+  set_integer_field(L, "inflate_ns", stats.inflate_ns);
+  set_integer_field(L, "decrypt_ns", stats.decrypt_ns);
+  set_integer_field(L, "lookup_ns", stats.lookup_ns);
+  set_integer_field(L, "resident_bytes", stats.resident_bytes);
+
+  return 1;
+}
+
+/* Lua C function.  Enables or disables timing lookups.
+ * Stack index 1: boolean
+ */
+static int c_lookup_timing(lua_State *L)
+{
+  set_rom_lookup_timing(lua_toboolean(L, 1));
+
+  return 0;
+}
+
+/* Lua C function.  Releases the ROM table owned by a table userdata.
+ * Stack index 1: table userdata
+ */
+static int c_gc_table(lua_State *L)
+{
+  ROMTable **table;
+
+  table = (ROMTable**)luaL_checkudata(L, 1, TABLE_METATABLE);
+  release_rom_table(*table);
+  *table = 0;
+
+  return 0;
+}
+
+/* Lua C function.  Adds a ROM userdata to the ROM table of the Lua state, held
+ * as upvalue 1, under the given mount point.  The ROM userdata must be kept
+ * alive for as long as the table.  Returns true on success.
+ * Stack index 1: ROM userdata
+ * Stack index 2: mount point (optional)
+ */
+static int c_table_add(lua_State *L)
+{
+  ROMTable **table;
+  const char **rom, *mount_point;
+
+  table = (ROMTable**)luaL_checkudata(L, lua_upvalueindex(1), TABLE_METATABLE);
+  rom = (const char**)luaL_checkudata(L, 1, ROM_METATABLE);
+  mount_point = luaL_optstring(L, 2, 0);
+  lua_pushboolean(L, add_rom_to_table(*table, *rom, mount_point));
+
+  return 1;
+}
+
+/* Lua C function.  Takes a full path and returns the contents of the matching
+ * file in the ROM table of the Lua state, held as upvalue 1, and the position
+ * of the ROM holding it in the order the ROMs were added, or nil.
+ * Stack index 1: path
+ */
+static int c_table_extract(lua_State *L)
+{
+  ROMTable **table;
+  const char *path;
+  size_t mount_index;
+
+  table = (ROMTable**)luaL_checkudata(L, lua_upvalueindex(1), TABLE_METATABLE);
+  path = luaL_checkstring(L, 1);
+  if (!push_file(L, *table, 0, path, &mount_index))
+    return 1;
+
+  lua_pushinteger(L, (lua_Integer)mount_index + 1);
+  return 2;
+}
+
+/* ROMListCallback appending the full path of each file to the table at the top
+ * of the Lua stack.
+ */
+static int list_file(void *ctx, const char *mount_point, const char *path, size_t file_len)
+{
+  lua_State *L;
+
+  L = (lua_State*)ctx;
+  lua_pushfstring(L, "%s%s", mount_point, path);
+  lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+
+  return 0;
+}
+
+/* Lua C function.  Returns a table of the full paths of the files in the ROM
+ * table of the Lua state, held as upvalue 1, that start with the given prefix.
+ * Stack index 1: prefix (optional)
+ */
+static int c_table_list(lua_State *L)
+{
+  ROMTable **table;
+  const char *prefix;
+
+  table = (ROMTable**)luaL_checkudata(L, lua_upvalueindex(1), TABLE_METATABLE);
+  prefix = luaL_optstring(L, 1, "");
+  lua_newtable(L);
+  list_table_files(*table, prefix, list_file, L);
+
+  return 1;
+}
+
+/* ROMListCallback stopping at the first file. */
+static int find_file(void *ctx, const char *mount_point, const char *path, size_t file_len)
+{
+  return 1;
+}
+
+/* Lua C function.  Returns the length of the file matching the given full path
+ * in the ROM table of the Lua state, held as upvalue 1, or false if the path is
+ * a directory holding files, or nil.
+ * Stack index 1: path
+ */
+static int c_table_stat(lua_State *L)
+{
+  ROMTable **table;
+  const char *path;
+  size_t file_len;
+
+  table = (ROMTable**)luaL_checkudata(L, lua_upvalueindex(1), TABLE_METATABLE);
+  path = luaL_checkstring(L, 1);
+  if (stat_table_file(*table, path, &file_len, 0))
+    lua_pushinteger(L, (lua_Integer)file_len);
+  else
+  {
+    /* a directory is the prefix of a path, up to a separator. */
+    if (*path && path[strlen(path) - 1] != '/')
+      lua_pushfstring(L, "%s/", path);
+    else
+      lua_pushstring(L, path);
+    if (list_table_files(*table, lua_tostring(L, -1), find_file, 0))
+      lua_pushboolean(L, 0);
+    else
+      lua_pushnil(L);
+  }
+
+  return 1;
+}
+
+/* Lua C function.  Opens the file matching the given full path in the ROM table
+ * of the Lua state, held as upvalue 1, and returns a file handle, or nil and an
+ * error message.
+ * Stack index 1: path
+ */
+static int c_table_open(lua_State *L)
+{
+  ROMTable **table;
+  FileHandle *handle;
+  const char *path;
+
+  table = (ROMTable**)luaL_checkudata(L, lua_upvalueindex(1), TABLE_METATABLE);
+  path = luaL_checkstring(L, 1);
+
+  handle = (FileHandle*)lua_newuserdata(L, sizeof(FileHandle));
+  handle->stream = 0;
+  handle->ahead = handle->ahead_len = 0;
+  luaL_setmetatable(L, FILE_METATABLE);
+
+  handle->stream = open_table_file(*table, path);
+  if (!handle->stream)
+  {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: No such file or directory", path);
+    return 2;
+  }
+
+  return 1;
+}
+
+/* return the open file handle at the given stack index, raising an error if it
+ * is closed.
+ */
+static FileHandle* check_file(lua_State *L, int index)
+{
+  FileHandle *handle;
+
+  handle = (FileHandle*)luaL_checkudata(L, index, FILE_METATABLE);
+  if (!handle->stream)
+    luaL_error(L, "attempt to use a closed file");
+
+  return handle;
+}
+
+/* read ahead from the stream of a file handle if its buffer is empty.
+ * return the number of bytes held in the buffer.
+ */
+static size_t fill_file(FileHandle *handle)
+{
+  if (handle->ahead == handle->ahead_len)
+  {
+    handle->ahead = 0;
+    handle->ahead_len = read_rom_stream(handle->stream, handle->buffer, FILE_BUFFER_LEN);
+  }
+
+  return handle->ahead_len - handle->ahead;
+}
 
-  /* load and run the bootstrap from ROM. */
-  ok = 0;
-  rom = mount_rom(lua_src, lua_src_len, &src_len, 0);
-  bootcode = extract_rom_file(rom, "bootstrap.lua", 0);
-  if (bootcode)
+/* push up to n bytes read from a file handle.
+ * return zero at the end of the file.
+ */
+static int read_chars(lua_State *L, FileHandle *handle, size_t n)
+{
+  luaL_Buffer b;
+  char *p;
+  size_t len, read;
+
+  if (n == 0)
   {
-    if (luaL_loadstring(L, bootcode) == 0)
+    lua_pushliteral(L, "");
+    return fill_file(handle) != 0;
+  }
+
+  /* take what is buffered, then read the rest from the stream directly. */
+  len = rom_stream_len(handle->stream) - tell_rom_stream(handle->stream) + handle->ahead_len - handle->ahead;
+  if (n > len)
+    n = len;
+  p = luaL_buffinitsize(L, &b, n);
+  len = handle->ahead_len - handle->ahead;
+  if (len > n)
+    len = n;
+  memcpy(p, handle->buffer + handle->ahead, len);
+  handle->ahead += len;
+  read = len < n ? read_rom_stream(handle->stream, p + len, n - len) : 0;
+
+  luaL_pushresultsize(&b, len + read);
+  return len + read != 0;
+}
+
+/* push the next line read from a file handle, with its end of line if keep is
+ * non-zero.
+ * return zero at the end of the file.
+ */
+static int read_line(lua_State *L, FileHandle *handle, int keep)
+{
+  luaL_Buffer b;
+  const char *start, *end;
+  size_t len;
+  int found;
+
+  luaL_buffinit(L, &b);
+  found = 0;
+  len = 0;
+  while (!found && fill_file(handle))
+  {
+    start = handle->buffer + handle->ahead;
+    end = (const char*)memchr(start, '\n', handle->ahead_len - handle->ahead);
+    found = end != 0;
+    if (!found)
+      end = handle->buffer + handle->ahead_len;
+    luaL_addlstring(&b, start, end - start);
+    len += end - start;
+    handle->ahead += end - start + found;
+  }
+  if (found && keep)
+    luaL_addchar(&b, '\n');
+
+  luaL_pushresult(&b);
+  return found || len;
+}
+
+/* push everything left in a file handle. */
+static void read_all(lua_State *L, FileHandle *handle)
+{
+  luaL_Buffer b;
+  size_t len;
+
+  luaL_buffinit(L, &b);
+  while ((len = fill_file(handle)))
+  {
+    luaL_addlstring(&b, handle->buffer + handle->ahead, len);
+    handle->ahead = handle->ahead_len;
+  }
+  luaL_pushresult(&b);
+}
+
+/* Lua C function.  Reads from a file handle in the given formats, as per
+ * file:read: a number of bytes, "a" for the rest of the file, "l" for the next
+ * line, which is the default, or "L" for the next line with its end of line.
+ * Returns nil for each format that cannot be read and for those after it.
+ * Stack index 1: file handle
+ * Stack index 2...: formats (optional)
+ */
+static int c_file_read(lua_State *L)
+{
+  FileHandle *handle;
+  const char *format;
+  int nargs, n, ok;
+
+  handle = check_file(L, 1);
+  if (lua_gettop(L) == 1)
+    lua_pushliteral(L, "l");
+
+  nargs = lua_gettop(L) - 1;
+  luaL_checkstack(L, nargs, "too many arguments");
+  ok = 1;
+  for (n = 2; n <= nargs + 1 && ok; ++n)
+  {
+    if (lua_type(L, n) == LUA_TNUMBER)
+      ok = read_chars(L, handle, (size_t)luaL_checkinteger(L, n));
+    else
     {
-      lua_pushcclosure(L, c_mount_rom, 0);
-      lua_pushcclosure(L, c_extract_romfile, 0);
-      lua_call(L, 2, 1);
-      ok = 1;
+      format = luaL_checkstring(L, n);
+      if (*format == '*')
+        ++format;
+      if (*format == 'a')
+      {
+        read_all(L, handle);
+        ok = 1;
+      }
+      else if (*format == 'l' || *format == 'L')
+        ok = read_line(L, handle, *format == 'L');
+      else
+        return luaL_argerror(L, n, "invalid format");
+    }
+
+    if (!ok)
+    {
+      lua_pop(L, 1);
+      lua_pushnil(L);
     }
   }
-  else
+
+  return n - 2;
+}
+
+/* Lua C function.  Iterator returned by file:lines, reading the next line of
+ * the file handle held as upvalue 1.
+ */
+static int c_file_next_line(lua_State *L)
+{
+  FileHandle *handle;
+
+  handle = (FileHandle*)luaL_checkudata(L, lua_upvalueindex(1), FILE_METATABLE);
+  if (!handle->stream)
+    return luaL_error(L, "file is already closed");
+
+  if (!read_line(L, handle, 0))
+  {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+  }
+
+  return 1;
+}
+
+/* Lua C function.  Returns an iterator over the lines of a file handle.
+ * Stack index 1: file handle
+ */
+static int c_file_lines(lua_State *L)
+{
+  check_file(L, 1);
+  lua_settop(L, 1);
+  lua_pushcclosure(L, c_file_next_line, 1);
+
+  return 1;
+}
+
+/* Lua C function.  Moves the position of a file handle, as per file:seek, and
+ * returns the new position, or nil and an error message.
+ * Stack index 1: file handle
+ * Stack index 2: "set", "cur" (the default) or "end"
+ * Stack index 3: offset (optional, default 0)
+ */
+static int c_file_seek(lua_State *L)
+{
+  static const char *const modes[] = { "set", "cur", "end", 0 };
+  FileHandle *handle;
+  lua_Integer base, offset;
+  size_t pos;
+  int mode;
+
+  handle = check_file(L, 1);
+  mode = luaL_checkoption(L, 2, "cur", modes);
+  offset = luaL_optinteger(L, 3, 0);
+
+  /* the position of the handle is behind that of the stream by the bytes read ahead. */
+  pos = tell_rom_stream(handle->stream) - (handle->ahead_len - handle->ahead);
+  base = mode == 0 ? 0 : mode == 1 ? (lua_Integer)pos : (lua_Integer)rom_stream_len(handle->stream);
+  if (base + offset < 0 || base + offset > (lua_Integer)rom_stream_len(handle->stream))
+  {
+    lua_pushnil(L);
+    lua_pushliteral(L, "Invalid argument");
+    return 2;
+  }
+
+  if ((size_t)(base + offset) != pos)
+  {
+    handle->ahead = handle->ahead_len = 0;
+    if (!seek_rom_stream(handle->stream, (size_t)(base + offset)))
+    {
+      lua_pushnil(L);
+      lua_pushliteral(L, "Seek failed");
+      return 2;
+    }
+  }
+
+  lua_pushinteger(L, base + offset);
+  return 1;
+}
+
+/* Lua C function.  Closes a file handle.
+ * Stack index 1: file handle
+ */
+static int c_file_close(lua_State *L)
+{
+  FileHandle *handle;
+
+  handle = check_file(L, 1);
+  close_rom_stream(handle->stream);
+  handle->stream = 0;
+  lua_pushboolean(L, 1);
+
+  return 1;
+}
+
+/* Lua C function.  Closes a file handle if it is open.
+ * Stack index 1: file handle
+ */
+static int c_gc_file(lua_State *L)
+{
+  FileHandle *handle;
+
+  handle = (FileHandle*)luaL_checkudata(L, 1, FILE_METATABLE);
+  close_rom_stream(handle->stream);
+  handle->stream = 0;
+
+  return 0;
+}
+
+/* The bootstrap is found in the embedded ROM once per process, and the first
+ * Lua state to compile it dumps its bytecode for the later states to load,
+ * so that opening the library neither mounts the ROM nor parses the source.
+ */
+static pthread_once_t bootstrap_once = PTHREAD_ONCE_INIT;
+static const char *bootstrap_src;
+static size_t bootstrap_src_len;
+static pthread_mutex_t bootstrap_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *bootstrap_bytecode;
+static size_t bootstrap_bytecode_len;
+
+/* the embedded ROM is uncompressed and is used in place for the life of the
+ * process.  It is not one of the host's ROMs, so it is left out of their
+ * statistics.
+ */
+static void find_bootstrap(void)
+{
+  const char *rom;
+  size_t romfs_len;
+
+  rom = mount_rom_unlisted(lua_src, lua_src_len, &romfs_len, 0);
+  bootstrap_src = extract_rom_file(rom, "bootstrap.lua", &bootstrap_src_len);
+}
+
+typedef struct _Bytecode {
+  char *data;
+  size_t len;
+}
+  Bytecode;
+
+/* lua_Writer collecting the bytecode of the bootstrap. */
+static int write_bytecode(lua_State *L, const void *p, size_t len, void *ud)
+{
+  Bytecode *bytecode;
+  char *data;
+
+  bytecode = (Bytecode*)ud;
+  data = (char*)realloc(bytecode->data, bytecode->len + len);
+  if (!data)
+    return 1;
+
+  memcpy(data + bytecode->len, p, len);
+  bytecode->data = data;
+  bytecode->len += len;
+
+  return 0;
+}
+
+/* load the bootstrap as a function on the stack, or an error message.
+ * return zero on failure.
+ */
+static int load_bootstrap(lua_State *L)
+{
+  Bytecode bytecode;
+  const char *data;
+  size_t len;
+
+  pthread_mutex_lock(&bootstrap_lock);
+  data = bootstrap_bytecode;
+  len = bootstrap_bytecode_len;
+  pthread_mutex_unlock(&bootstrap_lock);
+  if (data)
+    return luaL_loadbufferx(L, data, len, "=bootstrap", "b") == LUA_OK;
+
+  pthread_once(&bootstrap_once, find_bootstrap);
+  if (!bootstrap_src)
+  {
     lua_pushstring(L, "Failed to load bootstrap ROM!");
+    return 0;
+  }
+  if (luaL_loadbufferx(L, bootstrap_src, bootstrap_src_len, "=bootstrap", "t") != LUA_OK)
+    return 0;
 
-  free((void*)rom);
-  if (!ok)
+  /* keep the first bytecode dumped; it is never released. */
+  bytecode.data = 0;
+  bytecode.len = 0;
+  if (lua_dump(L, write_bytecode, &bytecode, 0) == 0)
+  {
+    pthread_mutex_lock(&bootstrap_lock);
+    if (!bootstrap_bytecode)
+    {
+      bootstrap_bytecode = bytecode.data;
+      bootstrap_bytecode_len = bytecode.len;
+      bytecode.data = 0;
+    }
+    pthread_mutex_unlock(&bootstrap_lock);
+  }
+  free(bytecode.data);
+
+  return 1;
+}
+
+/* lua module entry. */
+__attribute__((visibility ("default")))
+int luaopen_luaromfs(lua_State *L)
+{
+  ROMTable **table;
+
+  /* register the metatable of mounted ROM objects. */
+  if (luaL_newmetatable(L, ROM_METATABLE))
+  {
+    lua_pushcclosure(L, c_gc_rom, 0);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_pop(L, 1);
+
+  if (luaL_newmetatable(L, TABLE_METATABLE))
+  {
+    lua_pushcclosure(L, c_gc_table, 0);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_pop(L, 1);
+
+  if (luaL_newmetatable(L, FILE_METATABLE))
+  {
+    static const luaL_Reg methods[] = {
+      { "read", c_file_read },
+      { "lines", c_file_lines },
+      { "seek", c_file_seek },
+      { "close", c_file_close },
+      { 0, 0 }
+    };
+
+    lua_pushcclosure(L, c_gc_file, 0);
+    lua_setfield(L, -2, "__gc");
+    luaL_newlib(L, methods);
+    lua_setfield(L, -2, "__index");
+  }
+  lua_pop(L, 1);
+
+  /* the ROM table of the Lua state, shared by the closures that use it. */
+  table = (ROMTable**)lua_newuserdata(L, sizeof(ROMTable*));
+  *table = create_rom_table();
+  luaL_setmetatable(L, TABLE_METATABLE);
+  if (!*table)
+  {
+    lua_pushstring(L, "Failed to create ROM table!");
     lua_error(L);
+  }
+
+  /* load and run the bootstrap. */
+  if (!load_bootstrap(L))
+    lua_error(L);
+
+  lua_pushcclosure(L, c_mount_rom, 0);
+  lua_pushcclosure(L, c_extract_romfile, 0);
+  lua_pushcclosure(L, c_mount_romfile, 0);
+  lua_pushcclosure(L, c_cache_stats, 0);
+  lua_pushcclosure(L, c_bytecode_tag, 0);
+  lua_pushvalue(L, -7);
+  lua_pushcclosure(L, c_stats, 1);
+  lua_pushcclosure(L, c_lookup_timing, 0);
+  lua_pushvalue(L, -9);
+  lua_pushcclosure(L, c_table_add, 1);
+  lua_pushvalue(L, -10);
+  lua_pushcclosure(L, c_table_extract, 1);
+  lua_pushvalue(L, -11);
+  lua_pushcclosure(L, c_table_list, 1);
+  lua_pushvalue(L, -12);
+  lua_pushcclosure(L, c_table_stat, 1);
+  lua_pushvalue(L, -13);
+  lua_pushcclosure(L, c_table_open, 1);
+  lua_call(L, 12, 1);
+  lua_remove(L, -2);
 
   return 1;
 }
@@ -101,6 +882,31 @@ void luaromfs_require(lua_State *L)
   lua_pop(L, 1);
 }
 
+/* attach a ROM mounted by the host to the Lua state, with its files under the
+ * given mount point and searched for modules with the given search path, either
+ * of which may be NULL.  The ROM is shared rather than copied: the state holds a
+ * reference to it, released when the state is closed, so the same ROM may be
+ * attached to any number of states in any threads.
+ * return zero on failure.
+ */
+int luaromfs_attach(lua_State *L, const char *romfs, const char *mount_point, const char *searchpath)
+{
+  static const char *script = "local romfs = require'luaromfs'; return romfs.attach(...) ~= nil";
+  int ok;
+
+  if (!romfs || luaL_loadstring(L, script) != LUA_OK)
+    return 0;
+
+  push_rom(L, retain_rom(romfs));
+  lua_pushstring(L, mount_point);
+  lua_pushstring(L, searchpath);
+  lua_call(L, 3, 1);
+  ok = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+
+  return ok;
+}
+
 /* mount the given rom blob inside the Lua state. */
 void luaromfs_mount(lua_State *L, const char *rom, const size_t rom_len, const char *passphrase)
 {
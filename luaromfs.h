@@ -13,4 +13,13 @@ void luaromfs_require(lua_State *L);
 /* mount the given rom blob inside the Lua state. */
 void luaromfs_mount(lua_State *L, const char *rom, const size_t rom_len, const char *passphrase);
 
+/* attach a ROM mounted by the host to the Lua state, with its files under the
+ * given mount point and searched for modules with the given search path, either
+ * of which may be NULL.  The ROM is shared rather than copied: the state holds a
+ * reference to it, released when the state is closed, so the same ROM may be
+ * attached to any number of states in any threads.
+ * return zero on failure.
+ */
+int luaromfs_attach(lua_State *L, const char *romfs, const char *mount_point, const char *searchpath);
+
 #endif
@@ -14,12 +14,59 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
 #include <zlib.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+#ifdef WITH_LZ4
+#include <lz4.h>
+#include <lz4hc.h>
+#include <lz4frame.h>
+#endif
+#include <lua.h>
+#include <lauxlib.h>
 #include "sha256.h"
 #include "aes.h"
 
 #define DEBUG(...) fprintf(stderr, __VA_ARGS__)
 
+/* a file to be archived.  Files are read and encoded independently, possibly on
+ * several threads, and then appended to the archive in the order they were found.
+ */
+typedef struct _ArchiveFile
+{
+  char *path;       /* path of the file to read. */
+  const char *name; /* archived path, within path. */
+  int fd;           /* descriptor to read instead of opening path, or -1. */
+  size_t file_len;  /* length of the file as read. */
+  size_t source_len; /* length of the file on disk, before any compile. */
+  unsigned long long mtime; /* modification time of the file on disk. */
+  int compiled;     /* non-zero if the file was compiled to bytecode. */
+  char *data;       /* entry data. */
+  size_t data_len;
+  uint8_t hash[SHA256_BLOCK_SIZE]; /* SHA-256 of the content as archived. */
+  size_t link;      /* earlier file with the same content plus one, or zero. */
+  int cached;       /* non-zero if the file was encoded from the cache. */
+}
+  ArchiveFile;
+
+/* a file compressed by an earlier run, held in the cache. */
+typedef struct _CacheEntry
+{
+  const char *name;
+  size_t name_len;
+  size_t source_len;
+  unsigned long long mtime;
+  const unsigned char *hash;
+  int method;
+  const char *data; /* compressed content, without the RFS header. */
+  size_t data_len;
+}
+  CacheEntry;
+
 typedef struct _Archive
 {
   enum {
@@ -30,7 +77,24 @@ typedef struct _Archive
 
   const char *c_var;
   int compress;
+  int codec;           /* RFS method used to compress the archive. */
+  int level;           /* codec specific compression level. */
+  int per_file;
+  int version;         /* RFS version of the file entries and index, see choose_version. */
+  int train_dict;      /* non-zero to compress files with a dictionary trained from them. */
+  char *dict;          /* trained dictionary, or zero. */
+  size_t dict_len;
+  int dict_cached;     /* non-zero if the dictionary, or its absence, was taken from the cache. */
+#ifdef WITH_ZSTD
+  ZSTD_CDict *cdict;   /* digested zstd dictionary, or zero. */
+  ZSTD_CCtx **cctx;    /* per thread contexts used to compress files with zstd. */
+#endif
+  int bytecode;
+  int threads;
+  lua_State **lua;     /* per thread states used to compile .lua files to bytecode. */
   FILE *output;
+  const char *output_path; /* path of the archive file, or zero to write to stdout. */
+  char temp_path[PATH_MAX]; /* the archive is written here and then renamed to output_path. */
   int line_length;
 
   char *passphrase;
@@ -40,363 +104,1915 @@ typedef struct _Archive
   char *buffer;
   size_t buffer_end;
   size_t buffer_len;
+
+  size_t *entries; /* offset of each file entry in the buffer. */
+  size_t entry_count;
+
+  ArchiveFile *files;
+  size_t file_count;
+
+  const char *cache_path; /* cache of compressed files to reuse and update, or zero. */
+  char *cache;
+  CacheEntry *cache_entries; /* sorted by name. */
+  size_t cache_count;
 }
   Archive;
 
-static int compress_buffer(Archive *archive)
+/* work shared by the threads of run_parallel. */
+typedef struct _Work
 {
-  z_stream strm;
-  char *compressed;
-  size_t compressed_len;
+  int (*fn)(void *ctx, int thread, size_t item);
+  void *ctx;
+  size_t items;
+  size_t next;
+  int ok;
+  pthread_mutex_t lock;
+}
+  Work;
 
-  compressed_len = compressBound(archive->buffer_len);
-  compressed = (char*)malloc(compressed_len);
-  if (!compressed)
+typedef struct _Worker
+{
+  Work *work;
+  int thread;
+  pthread_t id;
+}
+  Worker;
+
+static void* run_worker(void *arg)
+{
+  Worker *worker;
+  Work *work;
+  size_t item;
+
+  worker = (Worker*)arg;
+  work = worker->work;
+  for (;;)
   {
-    DEBUG("Unable to allocate memory.\n");
+    /* take the next item, or stop if all are taken or one has failed. */
+    pthread_mutex_lock(&work->lock);
+    item = work->ok ? work->next++ : work->items;
+    pthread_mutex_unlock(&work->lock);
+    if (item >= work->items)
+      break;
+
+    if (!work->fn(work->ctx, worker->thread, item))
+    {
+      pthread_mutex_lock(&work->lock);
+      work->ok = 0;
+      pthread_mutex_unlock(&work->lock);
+    }
+  }
+
+  return 0;
+}
+
+/* call fn for each of the given number of items, using up to the given number
+ * of threads, including the calling thread.  fn is passed the index of the
+ * thread it runs on, which is less than threads.
+ * return zero if any call fails.
+ */
+static int run_parallel(int threads, size_t items, int (*fn)(void *ctx, int thread, size_t item), void *ctx)
+{
+  Work work;
+  Worker *workers, worker;
+  int i, started;
+
+  work.fn = fn;
+  work.ctx = ctx;
+  work.items = items;
+  work.next = 0;
+  work.ok = 1;
+  pthread_mutex_init(&work.lock, 0);
+
+  if ((size_t)threads > items)
+    threads = items;
+  workers = threads > 1 ? (Worker*)calloc(threads, sizeof(Worker)) : 0;
+  if (!workers)
+    threads = 1;
+
+  /* start the extra threads, falling back to fewer if they cannot be created. */
+  for (started = 1; started < threads; ++started)
+  {
+    workers[started].work = &work;
+    workers[started].thread = started;
+    if (pthread_create(&workers[started].id, 0, run_worker, workers + started) != 0)
+      break;
+  }
+
+  worker.work = &work;
+  worker.thread = 0;
+  run_worker(&worker);
+
+  for (i = 1; i < started; ++i)
+    pthread_join(workers[i].id, 0);
+
+  free(workers);
+  pthread_mutex_destroy(&work.lock);
+
+  return work.ok;
+}
+
+/* return the FNV-1a hash of the given path. */
+static uint32_t hash_path(const char *path, size_t path_len)
+{
+  uint32_t hash;
+
+  for (hash = 2166136261UL; path_len; --path_len)
+  {
+    hash ^= (unsigned char)*path++;
+    hash *= 16777619UL;
+  }
+
+  return hash;
+}
+
+static void write_u32(char *p, size_t value)
+{
+  p[0] = (value >> 24) & 0x000000FF;
+  p[1] = (value >> 16) & 0x000000FF;
+  p[2] = (value >>  8) & 0x000000FF;
+  p[3] =  value        & 0x000000FF;
+}
+
+static void write_u64(char *p, size_t value)
+{
+  int i;
+
+  for (i = 7; i >= 0; --i, value >>= 8)
+    p[i] = value & 0x000000FF;
+}
+
+static unsigned long long read_u64(const char *p)
+{
+  unsigned long long value;
+  int i;
+
+  for (value = 0, i = 0; i != 8; ++i)
+    value = (value << 8) | (unsigned char)p[i];
+
+  return value;
+}
+
+/* write value as an unsigned LEB128 varint, of at most 10 bytes, and return
+ * its length.
+ */
+static size_t write_varint(char *p, size_t value)
+{
+  size_t len;
+
+  for (len = 0; value > 0x7F; value >>= 7)
+    p[len++] = (value & 0x7F) | 0x80;
+  p[len++] = value;
+
+  return len;
+}
+
+/* write the length of a file entry, or of the file held by its data, in the
+ * format of the archive version and return the length written.
+ */
+static size_t write_len(Archive *archive, char *p, size_t value)
+{
+  if (archive->version == 1)
+  {
+    write_u32(p, value);
+    return 4;
+  }
+
+  return write_varint(p, value);
+}
+
+/* append the path index footer to the archive buffer:
+ *   index_slots x slot, index_slots as a 4-byte value, "IDX".
+ * Each slot holds the offset of a file entry plus one, or zero if empty, as a
+ * 4-byte value in version 1 and an 8-byte value in version 2, and is addressed
+ * by the hash of the entry path using linear probing.  The index is kept at
+ * most half full.
+ */
+static int index_buffer(Archive *archive)
+{
+  size_t index_slots, index_len, slot_len, i, j, offset;
+  unsigned char *slot;
+  const char *path;
+
+  slot_len = archive->version == 1 ? 4 : 8;
+  for (index_slots = 2; index_slots < archive->entry_count * 2; index_slots <<= 1)
+    ;
+  index_len = index_slots * slot_len + 7;
+
+  archive->buffer = realloc(archive->buffer, archive->buffer_len + index_len);
+  if (!archive->buffer)
+  {
+    DEBUG("Error allocating memory.\n");
     return 0;
   }
+  memset(archive->buffer + archive->buffer_end, 0, index_slots * slot_len);
+
+  /* the entries were appended in the order of the files. */
+  for (i = 0; i != archive->entry_count; ++i)
+  {
+    offset = archive->entries[i];
+    path = archive->files[i].name;
+    for (j = hash_path(path, strlen(path)); ; ++j)
+    {
+      slot = (unsigned char*)archive->buffer + archive->buffer_end + (j & (index_slots - 1)) * slot_len;
+      if (memcmp(slot, "\0\0\0\0\0\0\0\0", slot_len) == 0)
+      {
+        if (slot_len == 4)
+          write_u32((char*)slot, offset + 1);
+        else
+          write_u64((char*)slot, offset + 1);
+        break;
+      }
+    }
+  }
+
+  write_u32(archive->buffer + archive->buffer_end + index_slots * slot_len, index_slots);
+  memcpy(archive->buffer + archive->buffer_end + index_slots * slot_len + 4, "IDX", 3);
+  archive->buffer_end += index_len;
+  archive->buffer_len += index_len;
+
+  return 1;
+}
+
+/* RFS archives hold a ROM image, either compressed as a whole or with its files
+ * compressed individually:
+ *   "RFS", 1-byte version, header records, image.
+ * Each header record is a 1-byte type, a 4-byte length and that many bytes of
+ * data, and the records end with a record of type RFS_END.
+ * An image compressed as a whole is a single zlib stream, zstd frame or LZ4 frame,
+ * and its length is given by an RFS_IMAGE record.  Otherwise, the data of each
+ * file entry is a 1-byte method, the file length and the file content, either
+ * stored with a null terminator or compressed as a zlib stream, zstd frame or
+ * LZ4 block.  Archives compressed with a codec other than zlib have an
+ * RFS_CODEC record holding its 1-byte method.  Files compressed individually with
+ * a trained dictionary have an RFS_DICT record holding the dictionary.
+ *
+ * In version 1, each file entry starts with its 4-byte length and 1-byte path
+ * length, file lengths are 4-byte values and the image length and index slots
+ * are 4-byte values.  In version 2, the entry, path and file lengths are
+ * varints and the image length and index slots are 8-byte values, so that files
+ * and images may be larger than 4 GiB and paths longer than 254 bytes.
+ * Version 3 adds links, which store the content of identical files once: a link
+ * is an entry of zero length whose path is followed by the varint offset of an
+ * earlier entry holding the data.
+ */
+#define RFS_VERSION 3
+
+#define RFS_END 0x00
+#define RFS_IMAGE 0x01
+#define RFS_CODEC 0x02
+#define RFS_DICT 0x03
+#define RFS_BYTECODE 0x81
+#define RFS_FILES 0x82
+
+#define RFS_STORED 0
+#define RFS_ZLIB 1
+#define RFS_ZSTD 2
+#define RFS_LZ4 3
+
+/* a growable buffer receiving bytecode from lua_dump. */
+typedef struct _Dump
+{
+  char *buffer;
+  size_t len;
+}
+  Dump;
 
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-  strm.avail_in = archive->buffer_len;
-  strm.next_in = (unsigned char*)archive->buffer;
-  strm.avail_out = compressed_len;
-  strm.next_out = (unsigned char*)compressed;
+static int dump_writer(lua_State *L, const void *p, size_t sz, void *ud)
+{
+  Dump *dump;
+  char *buffer;
+
+  dump = (Dump*)ud;
+  buffer = realloc(dump->buffer, dump->len + sz);
+  if (!buffer)
+    return 1;
+
+  memcpy(buffer + dump->len, p, sz);
+  dump->buffer = buffer;
+  dump->len += sz;
+
+  return 0;
+}
+
+/* compile a Lua chunk and return its stripped bytecode, which must be free'd by
+ * the caller.  Store the bytecode length in dump_len.
+ * return zero on failure.
+ */
+static char* compile_chunk(lua_State *L, const char *chunk, size_t chunk_len, const char *name, size_t *dump_len)
+{
+  Dump dump;
 
-  if (deflateInit(&strm, Z_DEFAULT_COMPRESSION) != Z_OK)
+  dump.buffer = 0;
+  dump.len = 0;
+  if (luaL_loadbufferx(L, chunk, chunk_len, name, "t") != LUA_OK)
   {
-    DEBUG("deflateInit error.\n");
-    free(compressed);
+    DEBUG("\nError compiling %s\n", lua_tostring(L, -1));
+    lua_pop(L, 1);
     return 0;
   }
 
-  if (deflate(&strm, Z_FINISH) != Z_STREAM_END)
+  if (lua_dump(L, dump_writer, &dump, 1) != 0 || !dump.buffer)
   {
-    deflateEnd(&strm);
-    free(compressed);
-    DEBUG("deflate error.\n");
+    DEBUG("\nError dumping bytecode of %s.\n", name);
+    free(dump.buffer);
+    dump.buffer = 0;
+  }
+  lua_pop(L, 1);
+
+  *dump_len = dump.len;
+  return dump.buffer;
+}
+
+/* replace the content of a .lua file with its stripped bytecode, compiled with
+ * the Lua state of the given thread.
+ */
+static int compile_file(Archive *archive, int thread, ArchiveFile *file)
+{
+  char *bytecode, name[PATH_MAX + 1];
+  size_t bytecode_len;
+
+  snprintf(name, sizeof(name), "@%s", file->name);
+  bytecode = compile_chunk(archive->lua[thread], file->data, file->file_len, name, &bytecode_len);
+  if (!bytecode)
+    return 0;
+
+  /* null terminate the bytecode. */
+  free(file->data);
+  file->data = bytecode;
+  bytecode = realloc(bytecode, bytecode_len + 1);
+  if (!bytecode)
+  {
+    DEBUG("Error allocating memory.\n");
     return 0;
   }
+  file->data = bytecode;
 
-  archive->buffer_len = compressed_len - strm.avail_out;
-  free(archive->buffer);
-  archive->buffer = compressed;
-  deflateEnd(&strm);
+  file->data[bytecode_len] = 0;
+  file->file_len = bytecode_len;
+  file->data_len = bytecode_len + 1;
+  file->compiled = 1;
 
   return 1;
 }
 
-/* initialisation vector for AES. */
-static const uint8_t iv[]  = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+/* return the magic identifying the archive format. */
+static const char* archive_magic(Archive *archive)
+{
+  if (archive->passphrase)
+    return "ENC";
+  else if (archive->per_file || archive->compress)
+    return "RFS";
+  return "ASC";
+}
 
-static int encrypt_buffer(Archive *archive)
+/* insert the RFS header at the start of the archive buffer.  The magic is
+ * included only if the archive is encrypted, otherwise it is written as the
+ * archive magic.  image_len is the length of the image if it has been compressed
+ * as a whole, or zero.  Archives of bytecode record the stripped bytecode of an
+ * empty chunk, which identifies the Lua VM that can load them.
+ */
+static int header_buffer(Archive *archive, size_t image_len)
 {
-  uint8_t key[SHA256_BLOCK_SIZE];
-  SHA256_CTX sha_ctx;
-  struct AES_ctx aes_ctx;
-  size_t encrypted_len;
-  uint8_t *encrypted, pad_byte;
+  char *header, *tag;
+  size_t header_len, tag_len;
 
-  /* generate the AES key from the passphrase. */
-  sha256_init(&sha_ctx);
-  sha256_update(&sha_ctx, (uint8_t*)archive->passphrase, strlen(archive->passphrase));
-  sha256_final(&sha_ctx, key);
+  tag = 0;
+  tag_len = 0;
+  if (archive->bytecode && !(tag = compile_chunk(archive->lua[0], "", 0, "=tag", &tag_len)))
+    return 0;
 
-  /* add 16 bytes of guff to the start of the buffer to make it IV independent and
-   * pad the buffer to a 16 byte boundary.
-   */
-  encrypted_len = archive->buffer_len + 16;
-  pad_byte = 0x10 - (encrypted_len & 0x0F);
-  encrypted_len += pad_byte;
-  DEBUG("Archive length: %lu, encrypted length: %lu\n", archive->buffer_len, encrypted_len);
+  header = (char*)malloc(3 + 1 + 13 + 6 + 5 + archive->dict_len + 9 + 5 + tag_len + 5);
+  if (!header)
+  {
+    DEBUG("Error allocating memory.\n");
+    free(tag);
+    return 0;
+  }
 
-  encrypted = (uint8_t*)malloc(encrypted_len);
-  if (!encrypted)
+  header_len = 0;
+  if (archive->passphrase)
   {
-    DEBUG("encrypt_buffer: failed to allocate memory.\n");
+    memcpy(header, "RFS", 3);
+    header_len += 3;
+  }
+  header[header_len++] = archive->version;
+  if (image_len && archive->version == 1)
+  {
+    header[header_len++] = RFS_IMAGE;
+    write_u32(header + header_len, 4);
+    write_u32(header + header_len + 4, image_len);
+    header_len += 8;
+  }
+  else if (image_len)
+  {
+    header[header_len++] = RFS_IMAGE;
+    write_u32(header + header_len, 8);
+    write_u64(header + header_len + 4, image_len);
+    header_len += 12;
+  }
+  if (archive->compress && archive->codec != RFS_ZLIB)
+  {
+    header[header_len++] = RFS_CODEC;
+    write_u32(header + header_len, 1);
+    header[header_len + 4] = archive->codec;
+    header_len += 5;
+  }
+  if (archive->dict)
+  {
+    header[header_len++] = RFS_DICT;
+    write_u32(header + header_len, archive->dict_len);
+    memcpy(header + header_len + 4, archive->dict, archive->dict_len);
+    header_len += 4 + archive->dict_len;
+  }
+  header[header_len++] = RFS_FILES;
+  write_u32(header + header_len, 4);
+  write_u32(header + header_len + 4, archive->entry_count);
+  header_len += 8;
+  if (tag)
+  {
+    header[header_len++] = RFS_BYTECODE;
+    write_u32(header + header_len, tag_len);
+    memcpy(header + header_len + 4, tag, tag_len);
+    header_len += 4 + tag_len;
+    free(tag);
+  }
+  header[header_len++] = RFS_END;
+  write_u32(header + header_len, 0);
+  header_len += 4;
+
+  archive->buffer = realloc(archive->buffer, archive->buffer_len + header_len);
+  if (!archive->buffer)
+  {
+    DEBUG("Error allocating memory.\n");
+    free(header);
     return 0;
   }
-  memset(encrypted, pad_byte, encrypted_len);
 
-  /* copy the archive to the encrypt buffer and encrypt it. */
-  memcpy(encrypted + 16, archive->buffer, archive->buffer_len);
-  AES_init_ctx_iv(&aes_ctx, key, iv);
-  AES_CBC_encrypt_buffer(&aes_ctx, encrypted, encrypted_len);
+  memmove(archive->buffer + header_len, archive->buffer, archive->buffer_len);
+  memcpy(archive->buffer, header, header_len);
+  archive->buffer_end += header_len;
+  archive->buffer_len += header_len;
+  free(header);
 
-  /* replace the original archive buffer. */
-  free(archive->buffer);
-  archive->buffer = (char*)encrypted;
-  archive->buffer_len = encrypted_len;
+  return 1;
+}
+
+/* zlib lengths are 32-bit, so larger buffers are passed to it ZLIB_MAX_LEN
+ * bytes at a time.
+ */
+#define ZLIB_MAX_LEN 0x40000000UL
+
+/* return the maximum length of len bytes compressed individually with the
+ * archive codec.
+ */
+static size_t compress_bound(Archive *archive, size_t len)
+{
+#ifdef WITH_ZSTD
+  if (archive->codec == RFS_ZSTD)
+    return ZSTD_compressBound(len);
+#endif
+#ifdef WITH_LZ4
+  if (archive->codec == RFS_LZ4)
+    return len > LZ4_MAX_INPUT_SIZE ? 0 : LZ4_compressBound(len);
+#endif
+  return compressBound(len);
+}
+
+/* compress len bytes of data as a zlib stream primed with the archive dictionary.
+ * return the compressed length, or zero on failure.
+ */
+static size_t deflate_data(Archive *archive, unsigned char *dest, size_t dest_len, const char *data, size_t len)
+{
+  z_stream strm;
+  size_t out_len;
+  int ret;
+
+  memset(&strm, 0, sizeof(strm));
+  if (deflateInit(&strm, archive->level) != Z_OK)
+    return 0;
+
+  /* zlib lengths are 32-bit, so large files are passed to it in parts. */
+  ret = deflateSetDictionary(&strm, (const Bytef*)archive->dict, archive->dict_len);
+  strm.next_in = (Bytef*)data;
+  strm.next_out = dest;
+  out_len = dest_len;
+  while (ret == Z_OK)
+  {
+    if (strm.avail_in == 0)
+    {
+      strm.avail_in = len > ZLIB_MAX_LEN ? ZLIB_MAX_LEN : len;
+      len -= strm.avail_in;
+    }
+    if (strm.avail_out == 0)
+    {
+      strm.avail_out = out_len > ZLIB_MAX_LEN ? ZLIB_MAX_LEN : out_len;
+      out_len -= strm.avail_out;
+    }
+    ret = deflate(&strm, len ? Z_NO_FLUSH : Z_FINISH);
+  }
+  deflateEnd(&strm);
+
+  return ret == Z_STREAM_END ? (size_t)(strm.next_out - dest) : 0;
+}
+
+/* compress len bytes of data individually with the archive codec and any
+ * dictionary, using the zstd context of the given thread.
+ * return the compressed length, or zero on failure.
+ */
+static size_t compress_data(Archive *archive, int thread, unsigned char *dest, size_t dest_len, const char *data, size_t len)
+{
+  uLongf compressed_len;
+  size_t ret;
+
+#ifdef WITH_ZSTD
+  if (archive->codec == RFS_ZSTD)
+  {
+    if (archive->cdict)
+      ret = ZSTD_compress_usingCDict(archive->cctx[thread], dest, dest_len, data, len, archive->cdict);
+    else
+      ret = ZSTD_compressCCtx(archive->cctx[thread], dest, dest_len, data, len, archive->level);
+    return ZSTD_isError(ret) ? 0 : ret;
+  }
+#endif
+#ifdef WITH_LZ4
+  if (archive->codec == RFS_LZ4)
+  {
+    if (archive->level > 0)
+      ret = LZ4_compress_HC(data, (char*)dest, len, dest_len, archive->level);
+    else
+      ret = LZ4_compress_default(data, (char*)dest, len, dest_len);
+    return ret;
+  }
+#endif
+  if (archive->dict)
+    return deflate_data(archive, dest, dest_len, data, len);
+
+  compressed_len = dest_len;
+  ret = compress2(dest, &compressed_len, (const Bytef*)data, len, archive->level) == Z_OK ? compressed_len : 0;
+  return ret;
+}
+
+/* replace the null terminated content of a file with its RFS representation.  The
+ * content is compressed unless compression is disabled or does not reduce its size.
+ */
+static int encode_rfs_file(Archive *archive, int thread, ArchiveFile *file)
+{
+  unsigned char *data;
+  size_t file_len, compressed_len, header_len;
+
+  file_len = file->file_len;
+  compressed_len = compress_bound(archive, file_len);
+  data = (unsigned char*)malloc(11 + (compressed_len > file_len + 1 ? compressed_len : file_len + 1));
+  if (!data)
+  {
+    DEBUG("Error allocating memory.\n");
+    return 0;
+  }
+
+  header_len = 1 + write_len(archive, (char*)data + 1, file_len);
+  if (archive->compress && compressed_len &&
+      (compressed_len = compress_data(archive, thread, data + header_len, compressed_len, file->data, file_len)) != 0 &&
+      compressed_len < file_len + 1)
+  {
+    data[0] = archive->codec;
+    file->data_len = header_len + compressed_len;
+  }
+  else
+  {
+    data[0] = RFS_STORED;
+    memcpy(data + header_len, file->data, file_len + 1);
+    file->data_len = header_len + file_len + 1;
+  }
+
+  free(file->data);
+  file->data = (char*)data;
+
+  return 1;
+}
+
+/* With zlib, the archive buffer is compressed as a stream made of independently
+ * deflated blocks, each primed with the end of the previous block as its
+ * dictionary and ended with a sync flush, so that the blocks can be compressed
+ * in parallel and the output is the same whatever the number of threads.
+ */
+#define DEFLATE_BLOCK_LEN (1024UL * 1024UL)
+#define DEFLATE_WINDOW_LEN 32768UL
+
+typedef struct _DeflateBlock
+{
+  unsigned char *data;
+  size_t len;
+}
+  DeflateBlock;
+
+typedef struct _Deflate
+{
+  Archive *archive;
+  DeflateBlock *blocks;
+  size_t block_count;
+}
+  Deflate;
+
+static int deflate_block(void *ctx, int thread, size_t item)
+{
+  Deflate *d;
+  DeflateBlock *block;
+  z_stream strm;
+  const unsigned char *in;
+  size_t in_len, dict_len, out_len;
+  int last, ret;
+
+  d = (Deflate*)ctx;
+  block = d->blocks + item;
+  last = (item + 1 == d->block_count);
+  in = (const unsigned char*)d->archive->buffer + item * DEFLATE_BLOCK_LEN;
+  in_len = last ? d->archive->buffer_len - item * DEFLATE_BLOCK_LEN : DEFLATE_BLOCK_LEN;
+
+  memset(&strm, 0, sizeof(strm));
+  if (deflateInit2(&strm, d->archive->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+  {
+    DEBUG("deflateInit error.\n");
+    return 0;
+  }
+
+  if (item)
+  {
+    dict_len = item * DEFLATE_BLOCK_LEN < DEFLATE_WINDOW_LEN ? item * DEFLATE_BLOCK_LEN : DEFLATE_WINDOW_LEN;
+    deflateSetDictionary(&strm, in - dict_len, dict_len);
+  }
+
+  out_len = deflateBound(&strm, in_len) + 16;
+  block->data = (unsigned char*)malloc(out_len);
+  if (!block->data)
+  {
+    DEBUG("Unable to allocate memory.\n");
+    deflateEnd(&strm);
+    return 0;
+  }
+
+  strm.next_in = (unsigned char*)in;
+  strm.avail_in = in_len;
+  strm.next_out = block->data;
+  strm.avail_out = out_len;
+  ret = deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+  deflateEnd(&strm);
+  if (ret != (last ? Z_STREAM_END : Z_OK) || strm.avail_in != 0)
+  {
+    DEBUG("deflate error.\n");
+    return 0;
+  }
+
+  block->len = out_len - strm.avail_out;
+
+  return 1;
+}
+
+static int deflate_buffer(Archive *archive)
+{
+  Deflate d;
+  char *compressed;
+  size_t compressed_len, i;
+  uLong adler;
+  int ok;
+
+  d.archive = archive;
+  d.block_count = (archive->buffer_len + DEFLATE_BLOCK_LEN - 1) / DEFLATE_BLOCK_LEN;
+  d.blocks = (DeflateBlock*)calloc(d.block_count, sizeof(DeflateBlock));
+  if (!d.blocks)
+  {
+    DEBUG("Unable to allocate memory.\n");
+    return 0;
+  }
+
+  ok = run_parallel(archive->threads, d.block_count, deflate_block, &d);
+
+  /* join the blocks between the zlib header and the adler32 checksum. */
+  compressed = 0;
+  if (ok)
+  {
+    for (compressed_len = 2 + 4, i = 0; i != d.block_count; ++i)
+      compressed_len += d.blocks[i].len;
+
+    compressed = (char*)malloc(compressed_len);
+    if (compressed)
+    {
+      compressed[0] = 0x78;
+      compressed[1] = 0x9C;
+      for (compressed_len = 2, i = 0; i != d.block_count; ++i)
+      {
+        memcpy(compressed + compressed_len, d.blocks[i].data, d.blocks[i].len);
+        compressed_len += d.blocks[i].len;
+      }
+
+      for (adler = adler32(0L, Z_NULL, 0), i = 0; i != d.block_count; ++i)
+      {
+        adler = adler32(adler, (const Bytef*)archive->buffer + i * DEFLATE_BLOCK_LEN,
+            i + 1 == d.block_count ? archive->buffer_len - i * DEFLATE_BLOCK_LEN : DEFLATE_BLOCK_LEN);
+      }
+      write_u32(compressed + compressed_len, adler);
+      compressed_len += 4;
+
+      free(archive->buffer);
+      archive->buffer = compressed;
+      archive->buffer_len = compressed_len;
+    }
+    else
+      DEBUG("Unable to allocate memory.\n");
+  }
+
+  for (i = 0; i != d.block_count; ++i)
+    free(d.blocks[i].data);
+  free(d.blocks);
+
+  return compressed != 0;
+}
+
+#ifdef WITH_ZSTD
+/* compress the archive buffer as a single zstd frame. */
+static int zstd_buffer(Archive *archive)
+{
+  char *compressed;
+  size_t compressed_len;
+
+  compressed_len = ZSTD_compressBound(archive->buffer_len);
+  compressed = (char*)malloc(compressed_len);
+  if (!compressed)
+  {
+    DEBUG("Unable to allocate memory.\n");
+    return 0;
+  }
+
+  compressed_len = ZSTD_compress(compressed, compressed_len, archive->buffer, archive->buffer_len, archive->level);
+  if (ZSTD_isError(compressed_len))
+  {
+    DEBUG("zstd error: %s.\n", ZSTD_getErrorName(compressed_len));
+    free(compressed);
+    return 0;
+  }
+
+  free(archive->buffer);
+  archive->buffer = compressed;
+  archive->buffer_len = compressed_len;
+
+  return 1;
+}
+#endif
+
+#ifdef WITH_LZ4
+/* compress the archive buffer as a single LZ4 frame. */
+static int lz4_buffer(Archive *archive)
+{
+  LZ4F_preferences_t prefs;
+  char *compressed;
+  size_t compressed_len;
+
+  memset(&prefs, 0, sizeof(prefs));
+  prefs.compressionLevel = archive->level;
+  prefs.frameInfo.contentSize = archive->buffer_len;
+
+  compressed_len = LZ4F_compressFrameBound(archive->buffer_len, &prefs);
+  compressed = (char*)malloc(compressed_len);
+  if (!compressed)
+  {
+    DEBUG("Unable to allocate memory.\n");
+    return 0;
+  }
+
+  compressed_len = LZ4F_compressFrame(compressed, compressed_len, archive->buffer, archive->buffer_len, &prefs);
+  if (LZ4F_isError(compressed_len))
+  {
+    DEBUG("LZ4 error: %s.\n", LZ4F_getErrorName(compressed_len));
+    free(compressed);
+    return 0;
+  }
+
+  free(archive->buffer);
+  archive->buffer = compressed;
+  archive->buffer_len = compressed_len;
+
+  return 1;
+}
+#endif
+
+/* compress the archive buffer with the archive codec. */
+static int compress_buffer(Archive *archive)
+{
+#ifdef WITH_ZSTD
+  if (archive->codec == RFS_ZSTD)
+    return zstd_buffer(archive);
+#endif
+#ifdef WITH_LZ4
+  if (archive->codec == RFS_LZ4)
+    return lz4_buffer(archive);
+#endif
+  return deflate_buffer(archive);
+}
+
+/* initialisation vector for AES. */
+static const uint8_t iv[]  = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+
+static int encrypt_buffer(Archive *archive)
+{
+  uint8_t key[SHA256_BLOCK_SIZE];
+  SHA256_CTX sha_ctx;
+  struct AES_ctx aes_ctx;
+  size_t encrypted_len;
+  uint8_t *encrypted, pad_byte;
+
+  /* generate the AES key from the passphrase. */
+  sha256_init(&sha_ctx);
+  sha256_update(&sha_ctx, (uint8_t*)archive->passphrase, strlen(archive->passphrase));
+  sha256_final(&sha_ctx, key);
+
+  /* add 16 bytes of guff to the start of the buffer to make it IV independent and
+   * pad the buffer to a 16 byte boundary.
+   */
+  encrypted_len = archive->buffer_len + 16;
+  pad_byte = 0x10 - (encrypted_len & 0x0F);
+  encrypted_len += pad_byte;
+  DEBUG("Archive length: %lu, encrypted length: %lu\n", archive->buffer_len, encrypted_len);
+
+  encrypted = (uint8_t*)malloc(encrypted_len);
+  if (!encrypted)
+  {
+    DEBUG("encrypt_buffer: failed to allocate memory.\n");
+    return 0;
+  }
+  memset(encrypted, pad_byte, encrypted_len);
+
+  /* copy the archive to the encrypt buffer and encrypt it. */
+  memcpy(encrypted + 16, archive->buffer, archive->buffer_len);
+  AES_init_ctx_iv(&aes_ctx, key, iv);
+  AES_CBC_encrypt_buffer(&aes_ctx, encrypted, encrypted_len);
+
+  /* replace the original archive buffer. */
+  free(archive->buffer);
+  archive->buffer = (char*)encrypted;
+  archive->buffer_len = encrypted_len;
+
+  return 1;
+}
+
+/* create and open a temporary file next to the archive file, unless the
+ * archive is written to stdout.
+ */
+static int open_archive(Archive *archive)
+{
+  if (!archive->output_path)
+  {
+    archive->output = stdout;
+    return 1;
+  }
+
+  if (snprintf(archive->temp_path, sizeof(archive->temp_path), "%s.tmp", archive->output_path) >= sizeof(archive->temp_path))
+  {
+    DEBUG("Error: path of archive file %s too long.\n", archive->output_path);
+    return 0;
+  }
+
+  archive->output = fopen(archive->temp_path, "w");
+  if (!archive->output)
+  {
+    perror("open_archive: error opening archive file");
+    return 0;
+  }
+
+  return 1;
+}
+
+/* close the archive file and, if it was written in full, rename it into place,
+ * otherwise remove it.
+ * return zero on failure.
+ */
+static int close_archive(Archive *archive, int ok)
+{
+  if (!archive->output_path)
+    return fflush(archive->output) == 0 && ok;
+
+  if (fclose(archive->output) != 0)
+    ok = 0;
+  if (ok && rename(archive->temp_path, archive->output_path) != 0)
+    ok = 0;
+  if (!ok)
+  {
+    DEBUG("Error: unable to write archive file %s: %s\n", archive->output_path, strerror(errno));
+    unlink(archive->temp_path);
+  }
+
+  return ok;
+}
+
+static int c_encode_buffer(Archive *archive)
+{
+  unsigned char c;
+  int i, line_length, last_was_hex;
+  const char *static_decl = "";
+
+  fprintf(archive->output,
+    "/* Auto-generated ROM file, created by mkrom. */\n\n"
+    "#include <stddef.h>\n");
+
+  if (archive->declare_static)
+    static_decl = "static ";
+
+  if (archive->include_passphrase)
+    fprintf(archive->output,
+      "%sconst char %s_passphrase[] = \"%s\";\n",
+      static_decl, archive->c_var, archive->passphrase);
+
+  fprintf(archive->output,
+    "%sconst size_t %s_len = %lu;\n"
+    "%sconst char %s[] = ",
+    static_decl, archive->c_var, archive->buffer_len + 3,
+    static_decl, archive->c_var);
+
+  fprintf(archive->output, "\"%s\"", archive_magic(archive));
+
+  last_was_hex = 0;
+  line_length = 0;
+  for (i = 0; i != archive->buffer_len; ++i)
+  {
+    c = archive->buffer[i];
+
+    if (line_length == 0)
+    {
+      fwrite("\n\"", 2, 1, archive->output);
+      line_length = 1;
+    }
+
+    if (c == '\\')
+    {
+      fwrite("\\\\", 2, 1, archive->output);
+      line_length += 2;
+      last_was_hex = 0;
+    }
+    else if (c == '\t')
+    {
+      fwrite("\\t", 2, 1, archive->output);
+      line_length += 2;
+      last_was_hex = 0;
+    }
+    else if (c == '"')
+    {
+      fwrite("\\\"", 2, 1, archive->output);
+      line_length += 2;
+      last_was_hex = 0;
+    }
+    else if (isprint(c))
+    {
+      if (last_was_hex)
+      {
+        fwrite("\"\"", 2, 1, archive->output);
+        line_length += 2;
+      }
+      fwrite(&c, 1, 1, archive->output);
+      ++line_length;
+      last_was_hex = 0;
+    }
+    else
+    {
+      fprintf(archive->output, "\\x%02X", c);
+      line_length += 4;
+      last_was_hex = 1;
+    }
+
+    if (line_length >= 79)
+    {
+      fwrite("\"", 1, 1, archive->output);
+      line_length = 0;
+      last_was_hex = 0;
+    }
+  }
+
+  if (line_length)
+    fwrite("\"", 1, 1, archive->output);
+  fwrite(";", 1, 1, archive->output);
+
+  return !ferror(archive->output);
+}
+
+/* terminate the archive buffer, optionally compress it and encode it as a C
+ * array and write it to disk.  Compressed archives are RFS archives, whose
+ * header records the length of the image so that it can be inflated into a
+ * single buffer, unless their files have already been compressed individually.
+ * The archive file is replaced only once the whole archive has been written.
+ * return zero on failure.
+ */
+static int write_archive(Archive *archive)
+{
+  size_t image_len;
+  int ok;
+
+  /* reallocate memory and write the null header. */
+  archive->buffer_len += 5; /* header size */
+  archive->buffer = realloc(archive->buffer, archive->buffer_len);
+  if (!archive->buffer)
+  {
+    DEBUG("Error allocating memory.\n");
+    return 0;
+  }
+
+  memset(archive->buffer + archive->buffer_end, 0, 5);
+  archive->buffer_end += 5;
+
+  if (!index_buffer(archive))
+  {
+    DEBUG("Error indexing buffer.\n");
+    return 0;
+  }
+
+  image_len = 0;
+  if (!archive->per_file && archive->compress)
+  {
+    image_len = archive->buffer_len;
+    if (archive->version == 1 && image_len > 0xFFFFFFFFUL)
+    {
+      DEBUG("Archive too large: %lu bytes.\n", image_len);
+      return 0;
+    }
+
+    if (!compress_buffer(archive))
+    {
+      DEBUG("Error compressing buffer.\n");
+      return 0;
+    }
+  }
+
+  if (archive->per_file || archive->compress)
+  {
+    if (!header_buffer(archive, image_len))
+    {
+      DEBUG("Error writing RFS header.\n");
+      return 0;
+    }
+  }
+
+  if (archive->passphrase)
+  {
+    if (!encrypt_buffer(archive))
+    {
+      DEBUG("Error encrypting buffer.\n");
+      return 0;
+    }
+  }
+
+  if (!open_archive(archive))
+    return 0;
+
+  if (archive->type == CArchive)
+    ok = c_encode_buffer(archive);
+  else
+    ok = fwrite(archive_magic(archive), 3, 1, archive->output) == 1 &&
+      fwrite(archive->buffer, archive->buffer_len, 1, archive->output) == 1;
+
+  return close_archive(archive, ok);
+}
+
+/* read the whole of a file into a dynamically allocated, null terminated buffer. */
+static int read_file(ArchiveFile *file)
+{
+  struct stat st;
+  size_t alloc_len;
+  ssize_t read_len;
+  char *data;
+  int fd;
+
+  fd = file->fd;
+  if (fd == -1 && (fd = open(file->path, O_RDONLY)) == -1)
+  {
+    DEBUG("Error: unable to open file %s: %s\n", file->path, strerror(errno));
+    return 0;
+  }
+
+  /* size the buffer to read regular files in one call. */
+  alloc_len = 64 * 1024;
+  file->mtime = 0;
+  if (fstat(fd, &st) == 0)
+  {
+    file->mtime = st.st_mtime;
+    if (S_ISREG(st.st_mode))
+      alloc_len = st.st_size + 1;
+  }
+
+  file->file_len = 0;
+  file->data = 0;
+  data = 0;
+  do
+  {
+    if (!data || file->file_len + 1 == alloc_len)
+    {
+      if (data)
+        alloc_len *= 2;
+      data = realloc(file->data, alloc_len);
+      if (!data)
+      {
+        DEBUG("Error allocating memory.\n");
+        break;
+      }
+      file->data = data;
+    }
+
+    read_len = read(fd, data + file->file_len, alloc_len - file->file_len - 1);
+    if (read_len > 0)
+      file->file_len += read_len;
+  }
+  while (read_len > 0 || (read_len < 0 && errno == EINTR));
+
+  if (fd != file->fd)
+    close(fd);
+
+  if (!data)
+    return 0;
+
+  if (read_len < 0)
+  {
+    DEBUG("Error: unable to read file %s: %s\n", file->path, strerror(errno));
+    return 0;
+  }
+
+  data[file->file_len] = 0;
+  file->data_len = file->file_len + 1;
+  file->source_len = file->file_len;
+
+  return 1;
+}
+
+/* read a listed file and compile it if it is a Lua source file. */
+static int load_file(void *ctx, int thread, size_t item)
+{
+  Archive *archive;
+  ArchiveFile *file;
+  SHA256_CTX sha_ctx;
+  size_t name_len;
+
+  archive = (Archive*)ctx;
+  file = archive->files + item;
+  if (!read_file(file))
+    return 0;
+
+  /* compile Lua source files to bytecode. */
+  name_len = strlen(file->name);
+  if (archive->bytecode && name_len > 4 && strcmp(file->name + name_len - 4, ".lua") == 0)
+  {
+    if (!compile_file(archive, thread, file))
+      return 0;
+  }
+
+  sha256_init(&sha_ctx);
+  sha256_update(&sha_ctx, (const uint8_t*)file->data, file->file_len);
+  sha256_final(&sha_ctx, file->hash);
+
+  return 1;
+}
+
+#ifdef WITH_ZSTD
+/* digest the dictionary of the archive for zstd.
+ * return zero on failure.
+ */
+static int digest_zstd_dict(Archive *archive)
+{
+  archive->cdict = ZSTD_createCDict(archive->dict, archive->dict_len, archive->level);
+  if (!archive->cdict)
+  {
+    DEBUG("Error allocating memory.\n");
+    return 0;
+  }
+
+  return 1;
+}
+
+#endif
+
+/* compress the files with a copy of the given dictionary.
+ * return zero on failure.
+ */
+static int use_dict(Archive *archive, const char *dict, size_t dict_len)
+{
+  archive->dict = (char*)malloc(dict_len);
+  if (!archive->dict)
+  {
+    DEBUG("Error allocating memory.\n");
+    return 0;
+  }
+  memcpy(archive->dict, dict, dict_len);
+  archive->dict_len = dict_len;
+
+#ifdef WITH_ZSTD
+  if (archive->codec == RFS_ZSTD)
+    return digest_zstd_dict(archive);
+#endif
+  return 1;
+}
+
+/* With -f, the compressed content of each file may be kept in a cache file
+ * (-i), so that a later run compresses only the files that have changed:
+ *   "MKC", u8 version, SHA-256 of the compression settings, u64 dict_len,
+ *   dictionary, then for each file u64 name_len, name, u64 source_len,
+ *   u64 mtime, SHA-256 of the content as archived, u8 method, u64 data_len, data.
+ * A file is taken from the cache if its path, length and modification time on
+ * disk and the hash of its content all match.  The data is held without the
+ * RFS file header, which depends on the archive version.  With -d, the
+ * dictionary the files were compressed with is kept in the cache and used in
+ * place of training a new one, so that the cached files remain valid; it is
+ * trained again only if the cache is removed.  A cache built with other
+ * settings is ignored, and the cache is rewritten with the files of each run.
+ */
+#define CACHE_VERSION 2
+#define CACHE_HEADER_LEN (4 + SHA256_BLOCK_SIZE + 8)
+#define CACHE_ENTRY_LEN (8 + 8 + 8 + SHA256_BLOCK_SIZE + 1 + 8)
+
+/* hash the settings that the compressed content of the files depends on. */
+static void cache_settings(Archive *archive, uint8_t *digest)
+{
+  SHA256_CTX sha_ctx;
+  char settings[64];
+
+  snprintf(settings, sizeof(settings), "%d %d %d %d", archive->compress, archive->codec, archive->level,
+      archive->train_dict);
+  sha256_init(&sha_ctx);
+  sha256_update(&sha_ctx, (const uint8_t*)settings, strlen(settings) + 1);
+  sha256_final(&sha_ctx, digest);
+}
+
+static int compare_cache_entries(const void *a, const void *b)
+{
+  const CacheEntry *entry_a, *entry_b;
+  int ret;
+
+  entry_a = (const CacheEntry*)a;
+  entry_b = (const CacheEntry*)b;
+  ret = memcmp(entry_a->name, entry_b->name, entry_a->name_len < entry_b->name_len ? entry_a->name_len : entry_b->name_len);
+  if (ret == 0)
+    ret = entry_a->name_len < entry_b->name_len ? -1 : entry_a->name_len > entry_b->name_len;
+
+  return ret;
+}
+
+/* parse the entries of a cache, which start at the given position, into the
+ * given array, or only count them if it is zero.
+ * return the number of entries, or (size_t)-1 if the cache is corrupt.
+ */
+static size_t parse_cache(const char *cache, size_t len, size_t pos, CacheEntry *entries)
+{
+  CacheEntry entry;
+  const char *p;
+  size_t count;
+
+  for (count = 0; pos != len; ++count)
+  {
+    p = cache + pos;
+    if (len - pos < CACHE_ENTRY_LEN || read_u64(p) > len - pos - CACHE_ENTRY_LEN)
+      return (size_t)-1;
+    entry.name_len = read_u64(p);
+    entry.name = p + 8;
+    p += 8 + entry.name_len;
+    entry.source_len = read_u64(p);
+    entry.mtime = read_u64(p + 8);
+    entry.hash = (const unsigned char*)p + 16;
+    p += 16 + SHA256_BLOCK_SIZE;
+    entry.method = (unsigned char)p[0];
+    entry.data = p + 9;
+    pos = entry.data - cache;
+    if (read_u64(p + 1) > len - pos)
+      return (size_t)-1;
+    entry.data_len = read_u64(p + 1);
+    pos += entry.data_len;
+
+    if (entries)
+      entries[count] = entry;
+  }
+
+  return count;
+}
+
+/* read the cache file, if there is one and it was built with the settings of
+ * the archive, and take its dictionary if the files are compressed with one.
+ * return zero on failure.
+ */
+static int read_cache(Archive *archive)
+{
+  uint8_t settings[SHA256_BLOCK_SIZE];
+  struct stat st;
+  FILE *f;
+  size_t len, dict_len, count;
+
+  f = fopen(archive->cache_path, "rb");
+  if (!f)
+  {
+    if (errno == ENOENT)
+      return 1;
+    DEBUG("Error: unable to open cache %s: %s\n", archive->cache_path, strerror(errno));
+    return 0;
+  }
+
+  len = 0;
+  if (fstat(fileno(f), &st) == 0)
+  {
+    len = st.st_size;
+    archive->cache = (char*)malloc(len ? len : 1);
+  }
+  if (!archive->cache || fread(archive->cache, 1, len, f) != len)
+  {
+    DEBUG("Error: unable to read cache %s\n", archive->cache_path);
+    fclose(f);
+    return 0;
+  }
+  fclose(f);
+
+  if (len < CACHE_HEADER_LEN || memcmp(archive->cache, "MKC", 3) != 0 || archive->cache[3] != CACHE_VERSION ||
+      (dict_len = read_u64(archive->cache + CACHE_HEADER_LEN - 8)) > len - CACHE_HEADER_LEN ||
+      (count = parse_cache(archive->cache, len, CACHE_HEADER_LEN + dict_len, 0)) == (size_t)-1)
+  {
+    DEBUG("Ignoring cache %s, which is corrupt or of another version.\n", archive->cache_path);
+    return 1;
+  }
+
+  cache_settings(archive, settings);
+  if (memcmp(archive->cache + 4, settings, SHA256_BLOCK_SIZE) != 0)
+  {
+    DEBUG("Ignoring cache %s, which was built with other settings.\n", archive->cache_path);
+    return 1;
+  }
+
+  archive->cache_entries = (CacheEntry*)malloc((count ? count : 1) * sizeof(CacheEntry));
+  if (!archive->cache_entries)
+  {
+    DEBUG("Error allocating memory.\n");
+    return 0;
+  }
+  archive->cache_count = parse_cache(archive->cache, len, CACHE_HEADER_LEN + dict_len, archive->cache_entries);
+  qsort(archive->cache_entries, archive->cache_count, sizeof(CacheEntry), compare_cache_entries);
+
+  if (archive->train_dict)
+  {
+    archive->dict_cached = 1;
+    if (dict_len && !use_dict(archive, archive->cache + CACHE_HEADER_LEN, dict_len))
+      return 0;
+    DEBUG("Reused a %lu byte dictionary from cache %s.\n", dict_len, archive->cache_path);
+  }
+
+  return 1;
+}
+
+/* return the cache entry holding the content of a file, or zero. */
+static const CacheEntry* find_cache_entry(Archive *archive, ArchiveFile *file)
+{
+  CacheEntry key;
+  const CacheEntry *entry;
+
+  if (!archive->cache_count)
+    return 0;
+
+  key.name = file->name;
+  key.name_len = strlen(file->name);
+  entry = (const CacheEntry*)bsearch(&key, archive->cache_entries, archive->cache_count, sizeof(CacheEntry), compare_cache_entries);
+  if (!entry || entry->source_len != file->source_len || entry->mtime != file->mtime ||
+      memcmp(entry->hash, file->hash, SHA256_BLOCK_SIZE) != 0)
+    return 0;
+
+  return entry;
+}
+
+/* replace the content of a file with its RFS representation from the cache. */
+static int decode_cached_file(Archive *archive, ArchiveFile *file, const CacheEntry *entry)
+{
+  char *data;
+  size_t header_len;
+
+  data = (char*)malloc(11 + entry->data_len);
+  if (!data)
+  {
+    DEBUG("Error allocating memory.\n");
+    return 0;
+  }
+
+  data[0] = entry->method;
+  header_len = 1 + write_len(archive, data + 1, file->file_len);
+  memcpy(data + header_len, entry->data, entry->data_len);
+
+  free(file->data);
+  file->data = data;
+  file->data_len = header_len + entry->data_len;
+  file->cached = 1;
+
+  return 1;
+}
+
+/* write the encoded files to a new cache, replacing the old one once it is
+ * complete.
+ * return zero on failure.
+ */
+static int write_cache(Archive *archive)
+{
+  char path[PATH_MAX], header[CACHE_ENTRY_LEN > CACHE_HEADER_LEN ? CACHE_ENTRY_LEN : CACHE_HEADER_LEN];
+  uint8_t settings[SHA256_BLOCK_SIZE];
+  ArchiveFile *file;
+  size_t cached, header_len, name_len, i;
+  FILE *f;
+  int ok;
+
+  if (snprintf(path, sizeof(path), "%s.tmp", archive->cache_path) >= sizeof(path))
+  {
+    DEBUG("Error: path of cache %s too long.\n", archive->cache_path);
+    return 0;
+  }
+
+  f = fopen(path, "wb");
+  if (!f)
+  {
+    DEBUG("Error: unable to write cache %s: %s\n", path, strerror(errno));
+    return 0;
+  }
+
+  cache_settings(archive, settings);
+  memcpy(header, "MKC", 3);
+  header[3] = CACHE_VERSION;
+  memcpy(header + 4, settings, SHA256_BLOCK_SIZE);
+  write_u64(header + CACHE_HEADER_LEN - 8, archive->dict_len);
+  ok = fwrite(header, CACHE_HEADER_LEN, 1, f) == 1 &&
+    (!archive->dict_len || fwrite(archive->dict, archive->dict_len, 1, f) == 1);
+
+  for (cached = 0, i = 0; ok && i != archive->file_count; ++i)
+  {
+    file = archive->files + i;
+    if (file->link)
+      continue;
+    if (file->cached)
+      ++cached;
+
+    /* skip the RFS file header. */
+    header_len = 1 + write_len(archive, header, file->file_len);
+
+    name_len = strlen(file->name);
+    write_u64(header, name_len);
+    ok = fwrite(header, 8, 1, f) == 1 && fwrite(file->name, name_len, 1, f) == 1;
+
+    write_u64(header, file->source_len);
+    write_u64(header + 8, file->mtime);
+    memcpy(header + 16, file->hash, SHA256_BLOCK_SIZE);
+    header[16 + SHA256_BLOCK_SIZE] = file->data[0];
+    write_u64(header + 17 + SHA256_BLOCK_SIZE, file->data_len - header_len);
+    ok = ok && fwrite(header, CACHE_ENTRY_LEN - 8, 1, f) == 1 &&
+      fwrite(file->data + header_len, file->data_len - header_len, 1, f) == 1;
+  }
+
+  if (fclose(f) != 0)
+    ok = 0;
+  if (ok && rename(path, archive->cache_path) != 0)
+    ok = 0;
+  if (!ok)
+  {
+    DEBUG("Error: unable to write cache %s: %s\n", archive->cache_path, strerror(errno));
+    unlink(path);
+    return 0;
+  }
+
+  DEBUG("Reused %lu compressed files from cache %s.\n", cached, archive->cache_path);
+
+  return 1;
+}
+
+/* replace the content of a loaded file with its RFS representation, from the
+ * cache if it holds the file.  Links have no data of their own.
+ */
+static int encode_file(void *ctx, int thread, size_t item)
+{
+  Archive *archive;
+  ArchiveFile *file;
+  const CacheEntry *entry;
+
+  archive = (Archive*)ctx;
+  file = archive->files + item;
+  if (file->link)
+    return 1;
+  if ((entry = find_cache_entry(archive, file)) != 0)
+    return decode_cached_file(archive, file, entry);
+  return encode_rfs_file(archive, thread, file);
+}
 
-  return 1;
+static int compare_file_hashes(const void *a, const void *b)
+{
+  const ArchiveFile *file_a, *file_b;
+  int ret;
+
+  file_a = *(const ArchiveFile* const*)a;
+  file_b = *(const ArchiveFile* const*)b;
+  ret = memcmp(file_a->hash, file_b->hash, SHA256_BLOCK_SIZE);
+  if (ret == 0)
+    ret = file_a < file_b ? -1 : file_a > file_b;
+
+  return ret;
 }
 
-/* create and open the archive file and write the file header. */
-static int open_archive(Archive *archive, const char *file)
+/* link each file to the first file listed with the same content, so that the
+ * content is stored once.  Files are grouped by the hash of their content,
+ * which is then compared in full.  Uncompressed archives have no RFS header to
+ * record the version that links need in, and are not deduplicated.
+ * return zero on failure.
+ */
+static int link_files(Archive *archive)
 {
-  if (!archive || !file)
+  ArchiveFile **sorted, *first, *file;
+  size_t links, saved, i;
+
+  if ((!archive->per_file && !archive->compress) || archive->file_count < 2)
+    return 1;
+
+  sorted = (ArchiveFile**)malloc(archive->file_count * sizeof(ArchiveFile*));
+  if (!sorted)
   {
-    DEBUG("open_archive: internal error.\n");
+    DEBUG("Error allocating memory.\n");
     return 0;
   }
+  for (i = 0; i != archive->file_count; ++i)
+    sorted[i] = archive->files + i;
+  qsort(sorted, archive->file_count, sizeof(ArchiveFile*), compare_file_hashes);
 
-  archive->output = fopen(file, "w");
-  if (!archive->output)
+  links = 0;
+  saved = 0;
+  for (first = sorted[0], i = 1; i != archive->file_count; ++i)
   {
-    perror("open_archive: error opening archive file");
-    return 0;
+    file = sorted[i];
+    if (memcmp(file->hash, first->hash, SHA256_BLOCK_SIZE) != 0 || file->file_len != first->file_len ||
+        memcmp(file->data, first->data, file->file_len) != 0)
+    {
+      first = file;
+      continue;
+    }
+
+    file->link = first - archive->files + 1;
+    free(file->data);
+    file->data = 0;
+    ++links;
+    saved += file->file_len;
   }
+  free(sorted);
+
+  if (links)
+    DEBUG("Linked %lu files to identical files, saving %lu bytes.\n", links, saved);
 
   return 1;
 }
 
-static int c_encode_buffer(Archive *archive)
+/* zlib dictionaries are trained by a simple form of the COVER algorithm.
+ * Each DICT_SEGMENT_LEN byte segment of the files is scored by the number of
+ * other files that share each of its DICT_K byte substrings.  The segments are
+ * then taken in order of score, and each is added to the dictionary if it still
+ * scores at least half as well once the substrings of the segments already
+ * added are discounted.  The best segments are placed at the end of the
+ * dictionary, where they are cheapest to reference.
+ */
+#define DICT_LEN 32768UL
+#define DICT_K 8
+#define DICT_SEGMENT_LEN 128
+#define DICT_HASH_BITS 20
+#define DICT_HASH(p) (hash_path((const char*)(p), DICT_K) & ((1UL << DICT_HASH_BITS) - 1))
+
+typedef struct _DictSegment
 {
-  unsigned char c;
-  int i, line_length, last_was_hex;
-  const char *static_decl = "";
+  size_t file;
+  size_t offset;
+  size_t score;
+}
+  DictSegment;
 
-  fprintf(archive->output,
-    "/* Auto-generated ROM file, created by mkrom. */\n\n"
-    "#include <stddef.h>\n");
+/* return the score of a segment, given the number of files sharing each substring. */
+static size_t score_segment(const uint32_t *counts, const unsigned char *segment)
+{
+  size_t score, i;
+  uint32_t count;
 
-  if (archive->declare_static)
-    static_decl = "static ";
+  for (score = 0, i = 0; i + DICT_K <= DICT_SEGMENT_LEN; ++i)
+  {
+    count = counts[DICT_HASH(segment + i)];
+    if (count > 1)
+      score += count - 1;
+  }
 
-  if (archive->include_passphrase)
-    fprintf(archive->output,
-      "%sconst char %s_passphrase[] = \"%s\";\n",
-      static_decl, archive->c_var, archive->passphrase);
+  return score;
+}
 
-  fprintf(archive->output,
-    "%sconst size_t %s_len = %lu;\n"
-    "%sconst char %s[] = ",
-    static_decl, archive->c_var, archive->buffer_len + 3,
-    static_decl, archive->c_var);
+/* order segments by descending score, then by position. */
+static int compare_segments(const void *a, const void *b)
+{
+  const DictSegment *x, *y;
+
+  x = (const DictSegment*)a;
+  y = (const DictSegment*)b;
+  if (x->score != y->score)
+    return x->score > y->score ? -1 : 1;
+  if (x->file != y->file)
+    return x->file < y->file ? -1 : 1;
+  return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
 
-  if (archive->passphrase)
-    fwrite("\"ENC\"", 5, 1, archive->output);
-  else if (archive->compress)
-    fwrite("\"BIN\"", 5, 1, archive->output);
-  else
-    fwrite("\"ASC\"", 5, 1, archive->output);
+static int train_zlib_dict(Archive *archive)
+{
+  uint32_t *counts, *seen;
+  DictSegment *segments;
+  ArchiveFile *file;
+  const unsigned char *data;
+  size_t segment_count, i, j, h, score, dict_len;
+  int ok;
 
-  last_was_hex = 0;
-  line_length = 0;
-  for (i = 0; i != archive->buffer_len; ++i)
-  {
-    c = archive->buffer[i];
+  counts = (uint32_t*)calloc(1UL << DICT_HASH_BITS, sizeof(uint32_t));
+  seen = (uint32_t*)calloc(1UL << DICT_HASH_BITS, sizeof(uint32_t));
+  for (segment_count = 0, i = 0; i != archive->file_count; ++i)
+    segment_count += archive->files[i].file_len / DICT_SEGMENT_LEN;
+  segments = (DictSegment*)malloc((segment_count + 1) * sizeof(DictSegment));
+  archive->dict = (char*)malloc(DICT_LEN);
 
-    if (line_length == 0)
+  ok = counts && seen && segments && archive->dict;
+  if (ok)
+  {
+    /* count the files containing each substring. */
+    for (i = 0; i != archive->file_count; ++i)
     {
-      fwrite("\n\"", 2, 1, archive->output);
-      line_length = 1;
+      file = archive->files + i;
+      data = (const unsigned char*)file->data;
+      for (j = 0; j + DICT_K <= file->file_len; ++j)
+      {
+        h = DICT_HASH(data + j);
+        if (seen[h] != i + 1)
+        {
+          seen[h] = i + 1;
+          ++counts[h];
+        }
+      }
     }
 
-    if (c == '\\')
-    {
-      fwrite("\\\\", 2, 1, archive->output);
-      line_length += 2;
-      last_was_hex = 0;
-    }
-    else if (c == '\t')
-    {
-      fwrite("\\t", 2, 1, archive->output);
-      line_length += 2;
-      last_was_hex = 0;
-    }
-    else if (c == '"')
-    {
-      fwrite("\\\"", 2, 1, archive->output);
-      line_length += 2;
-      last_was_hex = 0;
-    }
-    else if (isprint(c))
+    /* score and sort the segments. */
+    for (segment_count = 0, i = 0; i != archive->file_count; ++i)
     {
-      if (last_was_hex)
+      file = archive->files + i;
+      for (j = 0; j + DICT_SEGMENT_LEN <= file->file_len; j += DICT_SEGMENT_LEN, ++segment_count)
       {
-        fwrite("\"\"", 2, 1, archive->output);
-        line_length += 2;
+        segments[segment_count].file = i;
+        segments[segment_count].offset = j;
+        segments[segment_count].score = score_segment(counts, (const unsigned char*)file->data + j);
       }
-      fwrite(&c, 1, 1, archive->output);
-      ++line_length;
-      last_was_hex = 0;
-    }
-    else
-    {
-      fprintf(archive->output, "\\x%02X", c);
-      line_length += 4;
-      last_was_hex = 1;
     }
+    qsort(segments, segment_count, sizeof(DictSegment), compare_segments);
 
-    if (line_length >= 79)
+    /* fill the dictionary from the end. */
+    for (dict_len = 0, i = 0; i != segment_count && dict_len + DICT_SEGMENT_LEN <= DICT_LEN; ++i)
     {
-      fwrite("\"", 1, 1, archive->output);
-      line_length = 0;
-      last_was_hex = 0;
+      data = (const unsigned char*)archive->files[segments[i].file].data + segments[i].offset;
+      score = score_segment(counts, data);
+      if (score == 0 || score * 2 < segments[i].score)
+        continue;
+
+      dict_len += DICT_SEGMENT_LEN;
+      memcpy(archive->dict + DICT_LEN - dict_len, data, DICT_SEGMENT_LEN);
+      for (j = 0; j + DICT_K <= DICT_SEGMENT_LEN; ++j)
+        counts[DICT_HASH(data + j)] = 0;
     }
+
+    memmove(archive->dict, archive->dict + DICT_LEN - dict_len, dict_len);
+    archive->dict_len = dict_len;
   }
+  else
+    DEBUG("Error allocating memory.\n");
 
-  if (line_length)
-    fwrite("\"", 1, 1, archive->output);
-  fwrite(";", 1, 1, archive->output);
+  free(counts);
+  free(seen);
+  free(segments);
 
-  return 1;
+  return ok;
 }
 
-/* terminate the archive buffer, optionally compress it and encode it as a C
- * array and write it to disk.
- */
-static void write_archive(Archive *archive)
+#ifdef WITH_ZSTD
+#define ZSTD_DICT_LEN 65536UL
+
+static int train_zstd_dict(Archive *archive)
 {
-  /* reallocate memory and write the null header. */
-  archive->buffer_len += 5; /* header size */
-  archive->buffer = realloc(archive->buffer, archive->buffer_len);
-  if (!archive->buffer)
+  char *samples;
+  size_t *sample_lens, samples_len, ret, i;
+
+  for (samples_len = 0, i = 0; i != archive->file_count; ++i)
+    samples_len += archive->files[i].file_len;
+
+  samples = (char*)malloc(samples_len + 1);
+  sample_lens = (size_t*)malloc((archive->file_count + 1) * sizeof(size_t));
+  archive->dict = (char*)malloc(ZSTD_DICT_LEN);
+  if (!samples || !sample_lens || !archive->dict)
   {
     DEBUG("Error allocating memory.\n");
-    return;
+    free(samples);
+    free(sample_lens);
+    return 0;
   }
 
-  memset(archive->buffer + archive->buffer_end, 0, 5);
-  archive->buffer_end += 5;
-
-  if (archive->compress)
+  for (samples_len = 0, i = 0; i != archive->file_count; ++i)
   {
-    if (!compress_buffer(archive))
-    {
-      DEBUG("Error compressing buffer.\n");
-      return;
-    }
+    memcpy(samples + samples_len, archive->files[i].data, archive->files[i].file_len);
+    samples_len += archive->files[i].file_len;
+    sample_lens[i] = archive->files[i].file_len;
   }
 
-  if (archive->passphrase)
+  ret = ZDICT_trainFromBuffer(archive->dict, ZSTD_DICT_LEN, samples, sample_lens, archive->file_count);
+  free(samples);
+  free(sample_lens);
+
+  /* too few or too small files cannot train a dictionary. */
+  if (ZDICT_isError(ret))
   {
-    if (!encrypt_buffer(archive))
-    {
-      DEBUG("Error encrypting buffer.\n");
-      return;
-    }
+    DEBUG("Unable to train a zstd dictionary: %s.\n", ZDICT_getErrorName(ret));
+    return 1;
   }
 
-  if (archive->type == CArchive)
-    c_encode_buffer(archive);
-  else
-  {
-    if (archive->passphrase)
-      fwrite("ENC", 3, 1, archive->output);
-    else if (archive->compress)
-      fwrite("BIN", 3, 1, archive->output);
-    else
-      fwrite("ASC", 3, 1, archive->output);
+  archive->dict_len = ret;
+  return digest_zstd_dict(archive);
+}
+#endif
+
+/* train a dictionary from the loaded files for the archive codec.  The archive
+ * is compressed without a dictionary if none can be trained.
+ */
+static int train_dict(Archive *archive)
+{
+  int ok;
+
+  ok = 0;
+#ifdef WITH_ZSTD
+  if (archive->codec == RFS_ZSTD)
+    ok = train_zstd_dict(archive);
+#endif
+  if (archive->codec == RFS_ZLIB)
+    ok = train_zlib_dict(archive);
 
-    fwrite(archive->buffer, archive->buffer_len, 1, archive->output);
+  if (ok && archive->dict_len == 0)
+  {
+    free(archive->dict);
+    archive->dict = 0;
   }
 
-  fclose(archive->output);
+  if (ok)
+    DEBUG("Trained a %lu byte dictionary from %lu files.\n", archive->dict_len, archive->file_count);
+
+  return ok;
 }
 
-static int encode_file(Archive *archive, int fd, const char *path, unsigned int path_len, unsigned int prefix_len)
+/* append an encoded file to the archive buffer and release its data. */
+static int append_file(Archive *archive, ArchiveFile *file)
 {
-  int read_len;
-  size_t file_size_pos, file_size;
+  char header[20], target[10];
+  size_t path_len, header_len;
+
+  DEBUG("Archiving file: %s as %s (%lu bytes%s%s%s).\n", file->path, file->name, file->file_len,
+      file->compiled ? " compiled" : "", file->link ? ", same as " : "",
+      file->link ? archive->files[file->link - 1].name : "");
+
+  path_len = strlen(file->name) + 1; /* allow for null terminator. */
+
+  /* a link holds the offset of the entry of the earlier file as its data. */
+  if (file->link)
+    file->data_len = write_varint(target, archive->entries[file->link - 1]);
 
-  /* adjust the path and path_len to ignore the prefix. */
-  path += prefix_len;
-  path_len = path_len - prefix_len + 1; /* allow for null terminator. */
+  /* the file size, or zero for a link, and path length. */
+  header_len = write_len(archive, header, file->link ? 0 : file->data_len);
+  if (archive->version == 1)
+    header[header_len++] = path_len;
+  else
+    header_len += write_varint(header + header_len, path_len);
 
   /* reallocate memory and write the header. */
-  archive->buffer_len += path_len + 5; /* header size */
-  archive->buffer = realloc(archive->buffer, archive->buffer_len);
+  archive->buffer = realloc(archive->buffer, archive->buffer_len + header_len + path_len + file->data_len);
   if (!archive->buffer)
   {
-    DEBUG("\nError allocating memory.\n");
+    DEBUG("Error allocating memory.\n");
     return 0;
   }
 
-  /* store the file size pointer and increment the buffer end. */
-  file_size_pos = archive->buffer_end;
-  archive->buffer_end += 4;
+  /* record the entry for the path index. */
+  archive->entries = realloc(archive->entries, (archive->entry_count + 1) * sizeof(size_t));
+  if (!archive->entries)
+  {
+    DEBUG("Error allocating memory.\n");
+    return 0;
+  }
+  archive->entries[archive->entry_count++] = archive->buffer_end;
 
-  /* store the path and path length. */
-  archive->buffer[archive->buffer_end++] =  path_len & 0x00FF;
-  memcpy(archive->buffer + archive->buffer_end, path, path_len);
+  /* store the header, path and data. */
+  memcpy(archive->buffer + archive->buffer_end, header, header_len);
+  archive->buffer_end += header_len;
+  memcpy(archive->buffer + archive->buffer_end, file->name, path_len);
   archive->buffer_end += path_len;
+  memcpy(archive->buffer + archive->buffer_end, file->link ? target : file->data, file->data_len);
+  archive->buffer_end += file->data_len;
+  archive->buffer_len = archive->buffer_end;
 
-  /* read the file in 512 byte chunks until EOF. */
-  read_len = 0;
-  file_size = 0;
-  do
+  free(file->data);
+  file->data = 0;
+
+  return 1;
+}
+
+/* add a file to the list of files to archive.  fd may be -1 to open the path. */
+static int add_file(Archive *archive, const char *path, unsigned int prefix_len, int fd)
+{
+  ArchiveFile *file;
+
+  archive->files = realloc(archive->files, (archive->file_count + 1) * sizeof(ArchiveFile));
+  if (!archive->files)
   {
-    file_size += read_len;
-    archive->buffer = realloc(archive->buffer, archive->buffer_len + file_size + 512);
-    if (!archive->buffer)
-    {
-      DEBUG("\nError allocating memory.\n");
-      return 0;
-    }
-    read_len = read(fd, archive->buffer + archive->buffer_end + file_size, 512);
+    DEBUG("Error allocating memory.\n");
+    return 0;
   }
-  while (read_len > 0);
 
-  if (read_len < 0)
+  file = archive->files + archive->file_count;
+  memset(file, 0, sizeof(ArchiveFile));
+  file->path = strdup(path);
+  if (!file->path)
   {
-    perror("\nencode_file: error reading file");
+    DEBUG("Error allocating memory.\n");
     return 0;
   }
+  file->name = file->path + prefix_len;
+  file->fd = fd;
+  ++archive->file_count;
 
-  DEBUG(" (%lu bytes).\n", file_size);
+  return 1;
+}
 
-  /* terminate the file, store the file size and release unused memory. */
-  archive->buffer[archive->buffer_end + file_size++] = 0;
+/* choose the version of the file entries and index: version 1, which older
+ * readers can mount, unless a path is longer than 254 bytes or the image could
+ * reach 4 GiB, which is estimated from the files before they are compressed,
+ * or version 3 if any file is a link.
+ * Uncompressed archives have no RFS header to record the version in and must
+ * fit version 1.
+ * return zero if they do not.
+ */
+static int choose_version(Archive *archive)
+{
+  unsigned long long image_len;
+  size_t slots, path_len, links, i;
 
-  archive->buffer[file_size_pos++] = (file_size >> 24) & 0x000000FF;
-  archive->buffer[file_size_pos++] = (file_size >> 16) & 0x000000FF;
-  archive->buffer[file_size_pos++] = (file_size >>  8) & 0x000000FF;
-  archive->buffer[file_size_pos++] =  file_size        & 0x000000FF;
+  for (slots = 2; slots < archive->file_count * 2; slots <<= 1)
+    ;
+  image_len = 5 + slots * 4 + 7;
 
-  archive->buffer_end += file_size;
-  archive->buffer_len += file_size;
-  archive->buffer = realloc(archive->buffer, archive->buffer_len);
-  if (!archive->buffer)
+  archive->version = 1;
+  for (links = 0, i = 0; i != archive->file_count; ++i)
   {
-    DEBUG("Error allocating memory.\n");
+    path_len = strlen(archive->files[i].name) + 1;
+    if (path_len > 0xFF)
+      archive->version = 2;
+    if (archive->files[i].link)
+      ++links;
+    else
+      image_len += 5 + path_len + (archive->per_file ? 5 : 0) + archive->files[i].file_len + 1;
+  }
+  if (image_len > 0xFFFFFFFFULL)
+    archive->version = 2;
+  if (links)
+    archive->version = 3;
+
+  if (archive->version != 1 && !archive->per_file && !archive->compress)
+  {
+    DEBUG("Error: the files are too large or their paths too long for an uncompressed rom file, use -f -u.\n");
     return 0;
   }
 
   return 1;
 }
 
-static int archive_file(Archive *archive, char *path, int prefix_len)
+/* read and encode the listed files, in parallel, and append them to the archive
+ * buffer in the order they were listed.  Any dictionary is taken from the cache
+ * or trained from all of the files, and then files identical to an earlier file
+ * are linked to it, before they are compressed or taken from the cache.
+ */
+static int archive_files(Archive *archive)
 {
-  struct stat st;
-  int fd;
+  size_t i;
 
-  fd = open(path, O_RDONLY);
-  if (fd == -1)
-  {
-    perror("archive_file: error opening file");
+  if (!run_parallel(archive->threads, archive->file_count, load_file, archive))
     return 0;
-  }
 
-  if (fstat(fd, &st) == -1)
-  {
-    perror("archive_file: unable to stat file");
+  if (archive->cache_path && !read_cache(archive))
     return 0;
-  }
 
-  if (st.st_size > 0x0FFFFFFFFUL)
-  {
-    DEBUG("archive_file: file %s too big\n", path);
+  if (archive->train_dict && !archive->dict_cached && !train_dict(archive))
+    return 0;
+
+  if (!link_files(archive))
+    return 0;
+
+  if (!choose_version(archive))
+    return 0;
+
+  if (archive->per_file && !run_parallel(archive->threads, archive->file_count, encode_file, archive))
     return 0;
-  }
 
-  DEBUG("Archiving file: %s as %s", path, path + prefix_len);
-  encode_file(archive, fd, path, strlen(path), prefix_len);
+  if (archive->cache_path && !write_cache(archive))
+    return 0;
 
-  close(fd);
+  for (i = 0; i != archive->file_count; ++i)
+  {
+    if (!append_file(archive, archive->files + i))
+      return 0;
+  }
 
   return 1;
 }
@@ -423,7 +2039,7 @@ static int archive_dir(Archive *archive, char *root, unsigned int prefix_len)
     if ((strcmp(ent->d_name, ".") == 0) || (strcmp(ent->d_name, "..") == 0))
       continue;
 
-    /* generate the path of the directory entry and archive it. */
+    /* generate the path of the directory entry and list it. */
     path_len = snprintf(path, sizeof(path), "%s/%s", root, ent->d_name);
     if (path_len >= sizeof(path))
     {
@@ -433,7 +2049,7 @@ static int archive_dir(Archive *archive, char *root, unsigned int prefix_len)
     else if (ent->d_type == DT_DIR)
       ok = archive_dir(archive, path, prefix_len);
     else if (ent->d_type == DT_REG)
-      ok = archive_file(archive, path, prefix_len);
+      ok = add_file(archive, path, prefix_len, -1);
   }
 
   if (dir)
@@ -442,11 +2058,78 @@ static int archive_dir(Archive *archive, char *root, unsigned int prefix_len)
   return ok;
 }
 
+/* set the archive codec from an option of the form name[:level].
+ * return zero if the codec is unknown or not supported by this build, or the
+ * level is out of range.
+ */
+static int parse_codec(Archive *archive, const char *option)
+{
+  const char *level;
+  size_t name_len;
+  int min_level, max_level;
+
+  level = strchr(option, ':');
+  name_len = level ? (size_t)(level - option) : strlen(option);
+
+  if (name_len == 4 && strncmp(option, "zlib", 4) == 0)
+  {
+    archive->codec = RFS_ZLIB;
+    archive->level = Z_DEFAULT_COMPRESSION;
+    min_level = Z_DEFAULT_COMPRESSION;
+    max_level = Z_BEST_COMPRESSION;
+  }
+#ifdef WITH_ZSTD
+  else if (name_len == 4 && strncmp(option, "zstd", 4) == 0)
+  {
+    archive->codec = RFS_ZSTD;
+    archive->level = ZSTD_CLEVEL_DEFAULT;
+    min_level = ZSTD_minCLevel();
+    max_level = ZSTD_maxCLevel();
+  }
+#endif
+#ifdef WITH_LZ4
+  else if (name_len == 3 && strncmp(option, "lz4", 3) == 0)
+  {
+    archive->codec = RFS_LZ4;
+    archive->level = 0;
+    min_level = 0;
+    max_level = LZ4HC_CLEVEL_MAX;
+  }
+#endif
+  else
+  {
+    DEBUG("Error: unsupported codec (%s)\n", option);
+    return 0;
+  }
+
+  if (level)
+  {
+    archive->level = atoi(level + 1);
+    if (archive->level < min_level || archive->level > max_level)
+    {
+      DEBUG("Error: level %d is out of range for %.*s (%d to %d)\n", archive->level, (int)name_len, option, min_level, max_level);
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
 static int usage(const char *name)
 {
-  DEBUG("%s [-c var_name [-s] [-p]] [-e passphrase] [-x prefix] <source_dir> <output_file>\nArchive the contents of source_dir as a rom file.  The rom file "
-      "may be optionally encrypted (-e) and optionally formatted as a C source file containing a constant array (-c var_name), which may be\n"
-      "declared static (-s) and may optionally (-p) declare the passphrase string <var_name>_passphrase.\n", name);
+  DEBUG("%s [-c var_name [-s] [-p]] [-f [-b] [-d] [-i cache_file]] [-e passphrase] [-u | -z codec[:level]] [-x prefix] [-j threads] <source_dir> <output_file>\nArchive the contents of source_dir as a rom file.  The rom file "
+      "may be optionally encrypted (-e) or left uncompressed (-u) and optionally formatted as a C source file containing a constant array (-c var_name), which may be\n"
+      "declared static (-s) and may optionally (-p) declare the passphrase string <var_name>_passphrase.\n"
+      "The rom file is compressed with zlib, or with the given codec (-z), which may be zstd or lz4 if mkrom was built with support for them, at an optional codec specific level.\n"
+      "Files may be compressed individually (-f) so that they are inflated only when first extracted.  An uncompressed rom file may be encrypted only if -f is given.\n"
+      "With -f, the files may be compressed with a dictionary trained from them (-d), which is stored once in the rom file.  This is not supported with lz4.\n"
+      "With -f, .lua files may be compiled to stripped bytecode (-b), which can be loaded only by a Lua VM of the same version and build as mkrom.\n"
+      "With -f, the compressed files may be kept in a cache file (-i), which is created if need be and updated on each run, so that only files that have changed are compressed again.  "
+      "With -d, the dictionary is kept in the cache file and reused, and is trained again only if the cache file is removed.\n"
+      "Unencrypted rom files that are uncompressed or compressed with -f are served directly from a memory mapping when mounted from disk.\n"
+      "Identical files are stored once, unless the rom file is left uncompressed (-u) without -f.\n"
+      "Rom files holding paths longer than 254 bytes or of 4 GiB or more, or identical files, are written in a newer format, which older versions of the library cannot mount.  Those that are too large cannot be left uncompressed (-u) without -f.\n"
+      "Files are read, compiled and compressed using the given number of threads (-j), without changing the rom file produced.\n", name);
   return 1;
 }
 
@@ -455,6 +2138,7 @@ int main(int argc, char **argv)
   Archive archive;
   unsigned int dir_len, prefix_len, i;
   char *input, *output, *prefix;
+  int ok;
 
   /* strip off the input and output. */
   if (argc < 3)
@@ -465,14 +2149,17 @@ int main(int argc, char **argv)
 
   memset(&archive, 0, sizeof(archive));
   archive.compress = 1;
+  archive.codec = RFS_ZLIB;
+  archive.level = Z_DEFAULT_COMPRESSION;
+  archive.threads = 1;
   archive.type = BinaryArchive;
   prefix_len = 0;
 
   /* parse the options. */
-  if (argc > 8)
+  if (argc > 18)
     return usage(argv[0]);
 
-  for (i = 1; i < argc; ++i)
+  for (i = 1; i <= argc; ++i)
   {
     if (strcmp("-c", argv[i]) == 0 && i + 1 <= argc)
     {
@@ -485,6 +2172,23 @@ int main(int argc, char **argv)
       archive.include_passphrase = 1;
     else if (strcmp("-e", argv[i]) == 0 && i + 1 <= argc)
       archive.passphrase = argv[++i];
+    else if (strcmp("-u", argv[i]) == 0)
+      archive.compress = 0;
+    else if (strcmp("-z", argv[i]) == 0 && i + 1 <= argc)
+    {
+      if (!parse_codec(&archive, argv[++i]))
+        return usage(argv[0]);
+    }
+    else if (strcmp("-f", argv[i]) == 0)
+      archive.per_file = 1;
+    else if (strcmp("-d", argv[i]) == 0)
+      archive.train_dict = 1;
+    else if (strcmp("-b", argv[i]) == 0)
+      archive.bytecode = 1;
+    else if (strcmp("-j", argv[i]) == 0 && i + 1 <= argc && atoi(argv[i + 1]) > 0)
+      archive.threads = atoi(argv[++i]);
+    else if (strcmp("-i", argv[i]) == 0 && i + 1 <= argc)
+      archive.cache_path = argv[++i];
     else if (strcmp("-x", argv[i]) == 0 && i + 1 <= argc)
     {
       prefix = argv[++i];
@@ -497,6 +2201,52 @@ int main(int argc, char **argv)
   if (archive.type != CArchive && (archive.declare_static || archive.include_passphrase))
     return usage(argv[0]);
 
+  if (archive.passphrase && !archive.compress && !archive.per_file)
+    return usage(argv[0]);
+
+  if (archive.bytecode && !archive.per_file)
+    return usage(argv[0]);
+
+  if (archive.train_dict && (!archive.per_file || !archive.compress || archive.codec == RFS_LZ4))
+    return usage(argv[0]);
+
+  if (archive.cache_path && !archive.per_file)
+    return usage(argv[0]);
+
+  /* create a Lua state for each thread to compile with. */
+  if (archive.bytecode)
+  {
+    archive.lua = (lua_State**)calloc(archive.threads, sizeof(lua_State*));
+    for (i = 0; archive.lua && i != archive.threads; ++i)
+    {
+      if (!(archive.lua[i] = luaL_newstate()))
+        break;
+    }
+    if (!archive.lua || i != archive.threads)
+    {
+      DEBUG("Error: unable to create a Lua state.\n");
+      return 1;
+    }
+  }
+
+#ifdef WITH_ZSTD
+  /* create a zstd context for each thread to compress files with. */
+  if (archive.per_file && archive.compress && archive.codec == RFS_ZSTD)
+  {
+    archive.cctx = (ZSTD_CCtx**)calloc(archive.threads, sizeof(ZSTD_CCtx*));
+    for (i = 0; archive.cctx && i != archive.threads; ++i)
+    {
+      if (!(archive.cctx[i] = ZSTD_createCCtx()))
+        break;
+    }
+    if (!archive.cctx || i != archive.threads)
+    {
+      DEBUG("Error: unable to create a zstd context.\n");
+      return 1;
+    }
+  }
+#endif
+
   /* if the input is '-' then read a single file from stdin and encode to stdout
    * using the output as the encoded filename.
    */
@@ -507,9 +2257,7 @@ int main(int argc, char **argv)
       DEBUG("Error: prefix (%s) is longer than filename (%s)\n", prefix, output);
       return 1;
     }
-    archive.output = stdout;
-    DEBUG("Archiving file: %s as %s", output, output + prefix_len);
-    encode_file(&archive, STDIN_FILENO, output, strlen(output), prefix_len);
+    ok = add_file(&archive, output, prefix_len, STDIN_FILENO);
   }
   else
   {
@@ -524,12 +2272,44 @@ int main(int argc, char **argv)
     if (input[dir_len - 1] == '/')
       input[dir_len - 1] = 0;
 
-    if (!open_archive(&archive, output))
-      return 1;
-
-    archive_dir(&archive, input, prefix_len);
+    archive.output_path = output;
+    ok = archive_dir(&archive, input, prefix_len);
   }
-  write_archive(&archive);
+
+  if (ok)
+    ok = archive_files(&archive);
+  if (ok)
+    ok = write_archive(&archive);
+
   free(archive.buffer);
-}
+  free(archive.entries);
+  free(archive.dict);
+  free(archive.cache);
+  free(archive.cache_entries);
+#ifdef WITH_ZSTD
+  ZSTD_freeCDict(archive.cdict);
+  if (archive.cctx)
+  {
+    for (i = 0; i != archive.threads; ++i)
+      ZSTD_freeCCtx(archive.cctx[i]);
+    free(archive.cctx);
+  }
+#endif
+  for (i = 0; i != archive.file_count; ++i)
+  {
+    free(archive.files[i].path);
+    free(archive.files[i].data);
+  }
+  free(archive.files);
+  if (archive.lua)
+  {
+    for (i = 0; i != archive.threads; ++i)
+    {
+      if (archive.lua[i])
+        lua_close(archive.lua[i]);
+    }
+    free(archive.lua);
+  }
 
+  return ok ? 0 : 1;
+}
@@ -7,58 +7,461 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
 #include <zlib.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef WITH_LZ4
+#include <lz4.h>
+#include <lz4frame.h>
+#endif
 #include "romfs.h"
 #include "sha256.h"
 #include "aes.h"
 
 #define CHUNK_SIZE (1024UL * 1024UL)
 
-/* Return a dynamically allocated, decompressed ROM filesystem image.
+/* zlib lengths are 32-bit, so larger buffers are passed to it ZLIB_MAX_LEN
+ * bytes at a time.
+ */
+#define ZLIB_MAX_LEN 0x40000000UL
+#define ZLIB_LEN(len) ((len) > ZLIB_MAX_LEN ? ZLIB_MAX_LEN : (unsigned int)(len))
+
+/* initialisation vector for AES. */
+static const uint8_t iv[]  = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+
+/* Encrypted blobs of at least PARALLEL_DECRYPT_LEN bytes are split into chunks
+ * that are decrypted on up to DECRYPT_THREADS threads.  CBC decryption of each
+ * chunk needs only the ciphertext block before it as its IV.
+ */
+#define PARALLEL_DECRYPT_LEN (1024UL * 1024UL)
+#define DECRYPT_THREADS 16
+
+/* Compressed encrypted blobs are decrypted DECRYPT_WINDOW_LEN bytes at a time
+ * and fed straight to zlib rather than decrypted as a whole.
+ */
+#define DECRYPT_WINDOW_LEN (4UL * PARALLEL_DECRYPT_LEN)
+
+/* return a monotonic time in nanoseconds, for the statistics. */
+static unsigned long long now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+typedef struct _DecryptChunk {
+  const uint8_t *key;
+  const uint8_t *iv;
+  uint8_t *buffer;
+  size_t len;
+  struct _DecryptPool *pool;
+  pthread_t thread;
+}
+  DecryptChunk;
+
+/* Each encrypted payload has a pool of threads, started when it is first
+ * decrypted in chunks and stopped when it is closed, so that the windows of a
+ * large payload do not each start threads of their own.  Every worker decrypts
+ * one chunk of each buffer handed to the pool, and the calling thread the first.
+ */
+typedef struct _DecryptPool {
+  pthread_mutex_t lock;
+  pthread_cond_t work;      /* signalled when a buffer is handed to the workers or they are stopped. */
+  pthread_cond_t done;      /* signalled when the workers have decrypted their chunks. */
+  DecryptChunk chunks[DECRYPT_THREADS];
+  int workers;              /* threads started, which decrypt chunks 1 to workers. */
+  int pending;              /* chunks of the current buffer not yet decrypted by the workers. */
+  unsigned long generation; /* buffers handed to the workers. */
+  int stop;
+}
+  DecryptPool;
+
+/* Encrypted ROM blobs consist of 16 bytes of guff, the payload and between 1
+ * and 16 bytes of padding, each byte of which holds the padding length.
+ */
+typedef struct _Payload {
+  const unsigned char *blob;
+  size_t blob_len;
+  size_t start;
+  size_t end;
+  uint8_t key[SHA256_BLOCK_SIZE];
+  int encrypted;
+  size_t offset;
+  uint8_t *window;
+  DecryptPool *pool;    /* threads decrypting the payload, or zero until needed. */
+  ROMStats stats;       /* bytes decrypted and inflated from the payload. */
+}
+  Payload;
+
+static void decrypt_chunk(DecryptChunk *chunk)
+{
+  struct AES_ctx aes_ctx;
+
+  AES_init_ctx_iv(&aes_ctx, chunk->key, chunk->iv);
+  AES_CBC_decrypt_buffer(&aes_ctx, chunk->buffer, chunk->len);
+}
+
+/* decrypt the chunk of each buffer handed to the pool, until it is stopped. */
+static void* run_decrypt_worker(void *arg)
+{
+  DecryptChunk *chunk;
+  DecryptPool *pool;
+  unsigned long generation;
+
+  chunk = (DecryptChunk*)arg;
+  pool = chunk->pool;
+  generation = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;)
+  {
+    while (!pool->stop && pool->generation == generation)
+      pthread_cond_wait(&pool->work, &pool->lock);
+    if (pool->stop)
+      break;
+
+    generation = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+    decrypt_chunk(chunk);
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->pending == 0)
+      pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return 0;
+}
+
+/* start and return a pool of up to one thread fewer than DECRYPT_THREADS or the
+ * number of processors, which may have no workers if none could be started.
+ * return zero if memory could not be allocated.
+ */
+static DecryptPool* start_decrypt_pool(void)
+{
+  DecryptPool *pool;
+  long cpus;
+  int threads, i;
+
+  pool = (DecryptPool*)calloc(1, sizeof(DecryptPool));
+  if (!pool)
+    return 0;
+
+  pthread_mutex_init(&pool->lock, 0);
+  pthread_cond_init(&pool->work, 0);
+  pthread_cond_init(&pool->done, 0);
+
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  threads = cpus < 1 ? 1 : cpus > DECRYPT_THREADS ? DECRYPT_THREADS : (int)cpus;
+  for (i = 1; i < threads; ++i)
+  {
+    pool->chunks[i].pool = pool;
+    if (pthread_create(&pool->chunks[i].thread, 0, run_decrypt_worker, pool->chunks + i) != 0)
+      break;
+  }
+  pool->workers = i - 1;
+
+  return pool;
+}
+
+static void stop_decrypt_pool(DecryptPool *pool)
+{
+  int i;
+
+  if (!pool)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (i = 1; i <= pool->workers; ++i)
+    pthread_join(pool->chunks[i].thread, 0);
+
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->work);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+/* decrypt a copy of the given ciphertext of a payload in place, using the
+ * threads of its pool for large buffers and falling back to the calling
+ * thread.  chain is the IV for the first block, and len must be a multiple of
+ * the AES block length.
+ */
+static void decrypt_buffer(Payload *payload, const uint8_t *chain, const uint8_t *ciphertext, uint8_t *buffer, size_t len)
+{
+  DecryptPool *pool;
+  DecryptChunk single, *chunks;
+  size_t chunk_len;
+  int threads, i;
+
+  pool = 0;
+  if (len >= PARALLEL_DECRYPT_LEN)
+  {
+    if (!payload->pool)
+      payload->pool = start_decrypt_pool();
+    pool = payload->pool;
+  }
+  chunks = pool ? pool->chunks : &single;
+  threads = pool ? pool->workers + 1 : 1;
+
+  chunk_len = (len / threads) & ~(size_t)(AES_BLOCKLEN - 1);
+  for (i = 0; i != threads; ++i)
+  {
+    chunks[i].key = payload->key;
+    chunks[i].iv = i ? ciphertext + i * chunk_len - AES_BLOCKLEN : chain;
+    chunks[i].buffer = buffer + i * chunk_len;
+    chunks[i].len = i + 1 == threads ? len - i * chunk_len : chunk_len;
+  }
+
+  if (threads > 1)
+  {
+    pthread_mutex_lock(&pool->lock);
+    ++pool->generation;
+    pool->pending = pool->workers;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  decrypt_chunk(chunks);
+
+  if (threads > 1)
+  {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending)
+      pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+/* decrypt the single block of an encrypted blob at the given offset. */
+static void decrypt_block(Payload *payload, size_t offset, uint8_t *block)
+{
+  memcpy(block, payload->blob + offset, AES_BLOCKLEN);
+  decrypt_buffer(payload, offset ? payload->blob + offset - AES_BLOCKLEN : iv,
+      payload->blob + offset, block, AES_BLOCKLEN);
+}
+
+/* prepare to read the payload of a ROM blob, which is encrypted if passphrase
+ * is not NULL.  Only the last block of an encrypted blob is decrypted, to find
+ * the length of the payload.
+ * return zero if the blob is not validly encrypted.
+ */
+static int open_payload(const char *rom_blob, size_t rom_blob_len, const char *passphrase, Payload *payload)
+{
+  SHA256_CTX sha_ctx;
+  uint8_t block[AES_BLOCKLEN];
+
+  memset(payload, 0, sizeof(Payload));
+  payload->blob = (const unsigned char*)rom_blob;
+  payload->blob_len = rom_blob_len;
+  payload->end = rom_blob_len;
+  if (!passphrase)
+    return 1;
+
+  if (rom_blob_len < 32 || rom_blob_len % 16 != 0)
+    return 0;
+
+  /* generate the AES key from the passphrase. */
+  sha256_init(&sha_ctx);
+  sha256_update(&sha_ctx, (uint8_t*)passphrase, strlen(passphrase));
+  sha256_final(&sha_ctx, payload->key);
+  payload->encrypted = 1;
+
+  /* truncate the padding and ignore the first 16 bytes. */
+  decrypt_block(payload, rom_blob_len - AES_BLOCKLEN, block);
+  if (block[AES_BLOCKLEN - 1] == 0 || block[AES_BLOCKLEN - 1] > 16)
+    return 0;
+
+  payload->start = 16;
+  payload->end = rom_blob_len - block[AES_BLOCKLEN - 1];
+
+  return 1;
+}
+
+/* return non-zero if the payload starts with the given magic. */
+static int payload_has_magic(Payload *payload, const char *magic)
+{
+  uint8_t block[AES_BLOCKLEN];
+
+  if (payload->end - payload->start < 3)
+    return 0;
+  if (!payload->encrypted)
+    return memcmp(payload->blob + payload->start, magic, 3) == 0;
+
+  decrypt_block(payload, payload->start, block);
+  return memcmp(block, magic, 3) == 0;
+}
+
+/* Return the next part of the payload, decrypting the blob a window at a time.
+ * return zero at the end of the payload or if memory could not be allocated.
+ */
+static const unsigned char* read_payload(Payload *payload, size_t *len)
+{
+  size_t window_len, skip;
+  unsigned long long start;
+
+  if (payload->offset >= payload->end)
+    return 0;
+
+  if (!payload->encrypted)
+  {
+    payload->offset = payload->end;
+    *len = payload->end - payload->start;
+    return payload->blob + payload->start;
+  }
+
+  if (!payload->window)
+  {
+    payload->window = (uint8_t*)malloc(DECRYPT_WINDOW_LEN);
+    if (!payload->window)
+      return 0;
+  }
+
+  window_len = payload->blob_len - payload->offset;
+  if (window_len > DECRYPT_WINDOW_LEN)
+    window_len = DECRYPT_WINDOW_LEN;
+
+  start = now_ns();
+  memcpy(payload->window, payload->blob + payload->offset, window_len);
+  decrypt_buffer(payload, payload->offset ? payload->blob + payload->offset - AES_BLOCKLEN : iv,
+      payload->blob + payload->offset, payload->window, window_len);
+  payload->stats.decrypt_ns += now_ns() - start;
+  payload->stats.bytes_decrypted += window_len;
+
+  /* exclude the guff and padding. */
+  skip = payload->offset < payload->start ? payload->start - payload->offset : 0;
+  if (window_len > payload->end - payload->offset)
+    window_len = payload->end - payload->offset;
+  payload->offset += window_len;
+
+  *len = window_len - skip;
+  return payload->window + skip;
+}
+
+/* Decrypt the whole payload and return the dynamically allocated plaintext,
+ * which must be free'd by the caller.  The payload starts payload->start bytes
+ * into the plaintext.
+ * return zero on failure.
+ */
+static uint8_t* decrypt_payload(Payload *payload)
+{
+  uint8_t *decrypted;
+  unsigned long long start;
+
+  decrypted = (uint8_t*)malloc(payload->blob_len);
+  if (!decrypted)
+    return 0;
+
+  start = now_ns();
+  memcpy(decrypted, payload->blob, payload->blob_len);
+  decrypt_buffer(payload, iv, payload->blob, decrypted, payload->blob_len);
+  payload->stats.decrypt_ns += now_ns() - start;
+  payload->stats.bytes_decrypted += payload->blob_len;
+
+  return decrypted;
+}
+
+static void close_payload(Payload *payload)
+{
+  free(payload->window);
+  payload->window = 0;
+  stop_decrypt_pool(payload->pool);
+  payload->pool = 0;
+}
+
+/* Return a dynamically allocated, decompressed ROM filesystem image.  If
+ * image_len is not zero, the image is inflated into a single buffer of that
+ * length and must fill it exactly.
  * return zero on failure.
  */
-static const char* inflate_rom(const char *rom_blob, size_t rom_blob_len, size_t *romfs_len)
+static const char* inflate_rom(Payload *payload, size_t image_len, size_t *romfs_len)
 {
   z_stream strm;
   char *romfs;
+  const unsigned char *input;
+  size_t input_len, out_len;
   int ret;
 
   romfs = 0;
+  input = 0;
+  input_len = 0;
   *romfs_len = 0;
 
   /* initialise the z_stream for inflation. */
   strm.zalloc = Z_NULL;
   strm.zfree = Z_NULL;
   strm.opaque = Z_NULL;
-  strm.avail_in = rom_blob_len;
-  strm.next_in = (unsigned char*)rom_blob;
+  strm.avail_in = 0;
+  strm.next_in = Z_NULL;
+  strm.avail_out = 0;
+  strm.next_out = Z_NULL;
   if (inflateInit(&strm) != Z_OK)
     return 0;
 
-  /* inflate the blob until the stream ends. */
-  do
+  if (image_len)
   {
-    /* allocate a new chunk. */
-    *romfs_len += CHUNK_SIZE;
-    strm.next_out = realloc(romfs, *romfs_len);
-    if (!strm.next_out)
+    romfs = (char*)malloc(image_len);
+    if (!romfs)
     {
       inflateEnd(&strm);
       return 0;
     }
-    /* adjust the pointers. */
-    romfs = (char*)strm.next_out;
-    strm.next_out += (*romfs_len - CHUNK_SIZE);
-    strm.avail_out = CHUNK_SIZE;
+    *romfs_len = image_len;
+    strm.next_out = (unsigned char*)romfs;
+  }
+
+  /* inflate the payload until the stream ends. */
+  do
+  {
+    out_len = strm.next_out ? (size_t)((char*)strm.next_out - romfs) : 0;
+    if (strm.avail_out == 0 && out_len == *romfs_len && !image_len)
+    {
+      /* allocate a new chunk. */
+      *romfs_len += CHUNK_SIZE;
+      strm.next_out = realloc(romfs, *romfs_len);
+      if (!strm.next_out)
+      {
+        inflateEnd(&strm);
+        return 0;
+      }
+      /* adjust the pointers. */
+      romfs = (char*)strm.next_out;
+      strm.next_out += out_len;
+    }
+    if (strm.avail_out == 0)
+      strm.avail_out = ZLIB_LEN(*romfs_len - out_len);
+
+    if (strm.avail_in == 0)
+    {
+      if (input_len == 0 && !(input = read_payload(payload, &input_len)))
+        input_len = 0;
+      strm.next_in = (unsigned char*)input;
+      strm.avail_in = ZLIB_LEN(input_len);
+      input += strm.avail_in;
+      input_len -= strm.avail_in;
+    }
 
     ret = inflate(&strm, Z_NO_FLUSH);
   }
-  while (strm.avail_out == 0 && ret == Z_OK);
+  while (ret == Z_OK);
 
-  if (ret == Z_STREAM_END)
+  out_len = strm.next_out ? (size_t)((char*)strm.next_out - romfs) : 0;
+  if (ret == Z_STREAM_END && image_len)
+    strm.next_out = out_len == image_len ? (unsigned char*)romfs : 0;
+  else if (ret == Z_STREAM_END)
   {
     /* release any unused memory. */
-    *romfs_len -= strm.avail_out;
+    *romfs_len = out_len;
     strm.next_out = realloc(romfs, *romfs_len);
   }
   else
@@ -72,145 +475,2413 @@ static const char* inflate_rom(const char *rom_blob, size_t rom_blob_len, size_t
   return romfs;
 }
 
-/* initialisation vector for AES. */
-static const uint8_t iv[]  = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+#ifdef WITH_ZSTD
+/* Return a dynamically allocated ROM filesystem image of image_len bytes,
+ * decompressed from a zstd frame.
+ * return zero on failure.
+ */
+static const char* unzstd_rom(Payload *payload, size_t image_len, size_t *romfs_len)
+{
+  ZSTD_DStream *strm;
+  ZSTD_inBuffer in;
+  ZSTD_outBuffer out;
+  size_t ret, in_pos, out_pos;
+  char *romfs;
+
+  romfs = (char*)malloc(image_len);
+  strm = ZSTD_createDStream();
+  if (!romfs || !strm)
+  {
+    free(romfs);
+    ZSTD_freeDStream(strm);
+    return 0;
+  }
+
+  out.dst = romfs;
+  out.size = image_len;
+  out.pos = 0;
+  in.size = in.pos = 0;
+  ret = 0;
+
+  /* decompress the payload until the frame ends. */
+  do
+  {
+    if (in.pos == in.size)
+    {
+      in.pos = 0;
+      if (!(in.src = read_payload(payload, &in.size)))
+        break;
+    }
+
+    in_pos = in.pos;
+    out_pos = out.pos;
+    ret = ZSTD_decompressStream(strm, &out, &in);
+  }
+  while (!ZSTD_isError(ret) && ret != 0 && (in.pos != in_pos || out.pos != out_pos));
+
+  ZSTD_freeDStream(strm);
+  if (!in.src || ZSTD_isError(ret) || ret != 0 || out.pos != image_len)
+  {
+    free(romfs);
+    return 0;
+  }
+
+  *romfs_len = image_len;
+  return romfs;
+}
+#endif
 
-/* Return a dynamically allocated, decrypted ROM filesystem image.
+#ifdef WITH_LZ4
+/* Return a dynamically allocated ROM filesystem image of image_len bytes,
+ * decompressed from an LZ4 frame.
  * return zero on failure.
  */
-static const char* decrypt_rom(const char *rom_blob, size_t rom_blob_len, size_t *romfs_len, const char *passphrase)
+static const char* unlz4_rom(Payload *payload, size_t image_len, size_t *romfs_len)
 {
-  uint8_t key[SHA256_BLOCK_SIZE];
-  SHA256_CTX sha_ctx;
-  struct AES_ctx aes_ctx;
-  uint8_t *decrypted;
+  LZ4F_dctx *ctx;
+  const unsigned char *in;
+  size_t in_len, in_used, out_len, out_used, ret;
+  char *romfs;
 
-  /* generate the AES key from the passphrase. */
-  sha256_init(&sha_ctx);
-  sha256_update(&sha_ctx, (uint8_t*)passphrase, strlen(passphrase));
-  sha256_final(&sha_ctx, key);
+  romfs = (char*)malloc(image_len);
+  if (!romfs)
+    return 0;
+  if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION)))
+  {
+    free(romfs);
+    return 0;
+  }
 
-  /* make a modifiable copy of the encrypted content and decrypt it. */
-  decrypted = (uint8_t*)malloc(rom_blob_len);
-  if (!decrypted)
+  in = 0;
+  in_len = 0;
+  out_len = 0;
+  ret = 1;
+
+  /* decompress the payload until the frame ends. */
+  do
+  {
+    if (in_len == 0 && !(in = read_payload(payload, &in_len)))
+      break;
+
+    in_used = in_len;
+    out_used = image_len - out_len;
+    ret = LZ4F_decompress(ctx, romfs + out_len, &out_used, in, &in_used, 0);
+    in += in_used;
+    in_len -= in_used;
+    out_len += out_used;
+  }
+  while (!LZ4F_isError(ret) && ret != 0 && (in_used || out_used));
+
+  LZ4F_freeDecompressionContext(ctx);
+  if (LZ4F_isError(ret) || ret != 0 || out_len != image_len)
+  {
+    free(romfs);
     return 0;
+  }
+
+  *romfs_len = image_len;
+  return romfs;
+}
+#endif
+
+/* the lookup statistics of a ROM may be counted by several threads at once,
+ * without holding its lock, so they are read atomically too.
+ */
+#define STATS_ADD(counter, n) __atomic_add_fetch(&(counter), (n), __ATOMIC_RELAXED)
+#define STATS_LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
 
-  memcpy(decrypted, rom_blob, rom_blob_len);
-  AES_init_ctx_iv(&aes_ctx, key, iv);
-  AES_CBC_decrypt_buffer(&aes_ctx, decrypted, rom_blob_len);
+/* A ROM image is a list of file entries, ended by an entry of zero length.  In
+ * version 1 images, which include every image that is not held in an RFS blob,
+ * each entry is:
+ *   4-byte big-endian data length, 1-byte path length, path, data.
+ * In later versions the lengths are unsigned LEB128 varints, so that files
+ * may be larger than 4 GiB and paths longer than 254 bytes:
+ *   varint data length, varint path length, path, data.
+ * The path length includes the null terminator of the path.
+ * Version 3 images may also hold links, written by mkrom for files identical
+ * to an earlier file, whose data is that of the earlier entry:
+ *   varint zero, varint path length, path, varint offset of the earlier entry.
+ */
+typedef struct _ROMEntry {
+  const char *path;
+  size_t path_len;
+  const unsigned char *data;
+  size_t data_len;
+  size_t data_entry;    /* offset of the entry holding the data. */
+}
+  ROMEntry;
 
-  /* truncate the padding. */
-  rom_blob_len -= decrypted[rom_blob_len - 1];
+/* Each ROM image may end with a path index footer, written by mkrom:
+ *   index_slots x slot, index_slots as a 4-byte big-endian value, "IDX".
+ * A slot holds the offset of a file entry plus one, or zero if the slot is empty,
+ * as a 4-byte big-endian value in version 1 images and an 8-byte one otherwise.
+ * Slots are addressed by the FNV-1a hash of the path, using linear probing.
+ */
+#define INDEX_FOOTER_LEN 7
+#define SLOT_LEN(version) ((version) == 1 ? 4 : 8)
 
-  /* ignore the first 16 bytes and decompress the rest of the decrypted content. */
-  rom_blob = inflate_rom((const char*)decrypted + 16, rom_blob_len - 16, romfs_len);
+/* version 1 images are limited to 4 GiB by their 4-byte offsets. */
+#define MAX_V1_IMAGE_LEN 0xFFFFFFFFULL
 
-  /* free the decrypted buffer and return. */
-  free(decrypted);
+/* a file inflated from an RFS ROM, held in a least recently used list. */
+typedef struct _ROMFile {
+  char *content;
+  size_t len;
+  size_t prev, next; /* index slots of the neighbouring files, or index_slots if none. */
+}
+  ROMFile;
 
-  return rom_blob;
+/* a file of a ROM listed in path order. */
+typedef struct _ROMListEntry {
+  const char *path;
+  size_t slot;
 }
+  ROMListEntry;
 
 typedef struct _ROMHeader {
   char magic[3];
+  const unsigned char *content;
   size_t content_len;
-  unsigned char content[];
+  int version;          /* version of the format of the file entries and index. */
+  size_t entries_len;   /* length of the file entries, excluding any index footer. */
+  unsigned char *index; /* index slots, within content or data. */
+  size_t index_slots;   /* number of index slots, always a power of two. */
+  void *map;            /* mapped ROM file, or zero. */
+  size_t map_len;
+  void *owned;          /* dynamically allocated buffer holding the content, or zero. */
+  size_t owned_len;
+  ROMFile *files;       /* files inflated on first access, by index slot, or zero
+                           if the files are not compressed individually. */
+  size_t lru_head;      /* most recently used inflated file. */
+  size_t lru_tail;      /* least recently used inflated file. */
+  size_t cache_len;     /* bytes held by inflated files. */
+  size_t cache_limit;   /* bytes of inflated files to keep, or zero for no limit. */
+  size_t cache_hits;
+  size_t cache_misses;
+  char *bytecode_tag;   /* tag of the Lua VM that compiled the .lua files, or zero. */
+  size_t bytecode_tag_len;
+  char *dict;           /* dictionary the files were compressed with, or zero. */
+  size_t dict_len;
+#ifdef WITH_ZSTD
+  ZSTD_DDict *ddict;    /* digested zstd dictionary, or zero. */
+  ZSTD_DCtx *dctx;      /* zstd context reused for each file, created on first use. */
+#endif
+  ROMStats stats;
+  struct _ROMHeader *prev, *next; /* neighbouring ROMs in the list of mounted ROMs. */
+  ROMListEntry *sorted; /* files sorted by path, built on first use, or zero. */
+  size_t sorted_len;
+  size_t refs;          /* references held by retain_rom, plus one for the mount. */
+  pthread_mutex_t lock; /* recursive lock of the inflated files, the zstd context and the statistics. */
+  unsigned char data[]; /* copied content followed by any index built at mount. */
 }
   ROMHeader;
 
-/* create and return a dynamically allocated ROM object using the given content. */
-static ROMHeader* create_rom(const char *content, size_t len)
+static size_t read_u32(const unsigned char *p)
 {
-  ROMHeader *hdr;
+  return ((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | (size_t)p[3];
+}
 
-  hdr = (ROMHeader*)malloc(sizeof(ROMHeader) + len);
-  if (hdr)
-  {
-    strncpy(hdr->magic, "ROM", 3);
-    hdr->content_len = len;
-    memcpy(hdr->content, content, len);
-  }
+static void write_u32(unsigned char *p, size_t value)
+{
+  p[0] = (value >> 24) & 0x000000FF;
+  p[1] = (value >> 16) & 0x000000FF;
+  p[2] = (value >>  8) & 0x000000FF;
+  p[3] =  value        & 0x000000FF;
+}
 
-  return hdr;
+/* read a 64-bit big-endian value, saturated to the range of a size_t. */
+static size_t read_u64(const unsigned char *p)
+{
+  unsigned long long value;
+  int i;
+
+  for (value = 0, i = 0; i != 8; ++i)
+    value = (value << 8) | p[i];
+
+  return value > (size_t)-1 ? (size_t)-1 : (size_t)value;
 }
 
-/* mount and return the filesystem content of a ROM blob.  This must be
- * called on a ROM blob before trying to extract files from it.
- * Store the length of the mounted filesystem in romfs_len.
- * The returned pointer is dynamically allocated and must be free'd by the caller
- * when the ROM is nolonger needed.
- *
- * passphrase may be NULL.
- *
- * return zero on failure.
- */
-const char* mount_rom(const char *rom_blob, size_t rom_blob_len, size_t *romfs_len, const char *passphrase)
+static void write_u64(unsigned char *p, size_t value)
 {
-  ROMHeader *romfs;
-  const char *rom_content;
+  int i;
 
-  if (!rom_blob || rom_blob_len < 4 || !romfs_len)
-    return 0;
+  for (i = 7; i >= 0; --i, value >>= 8)
+    p[i] = value & 0x000000FF;
+}
 
-  rom_content = 0;
-  if (strncmp("ENC", rom_blob, 3) == 0 && passphrase)
-    rom_content = decrypt_rom(rom_blob + 3, rom_blob_len - 3, &rom_blob_len, passphrase);
-  else if (strncmp("BIN", rom_blob, 3) == 0)
-    rom_content = inflate_rom(rom_blob + 3, rom_blob_len - 3, &rom_blob_len);
+/* read an unsigned LEB128 varint of at most len bytes into value.
+ * return the number of bytes read, or zero if the varint is incomplete or does
+ * not fit in a size_t.
+ */
+static size_t read_varint(const unsigned char *p, size_t len, size_t *value)
+{
+  size_t i, shift;
 
-  romfs = 0;
-  if (rom_content)
+  *value = 0;
+  for (i = 0, shift = 0; i != len && shift < sizeof(size_t) * 8; ++i, shift += 7)
   {
-    romfs = create_rom(rom_content, rom_blob_len);
-    free((void*)rom_content);
+    if ((size_t)(p[i] & 0x7F) > ((size_t)-1 >> shift))
+      return 0;
+    *value |= (size_t)(p[i] & 0x7F) << shift;
+    if (!(p[i] & 0x80))
+      return i + 1;
   }
-  else if (strncmp("ASC", rom_blob, 3) == 0)
-    romfs = create_rom(rom_blob + 3, rom_blob_len - 3);
 
-  if (romfs)
-    *romfs_len = sizeof(ROMHeader) + romfs->content_len;
-
-  return (const char*)romfs;
+  return 0;
 }
 
-/* find and return a pointer to the string containing the contents of the file
- * matching the given path.  Store the file length in file_len if given.
- * return zero if the file is not found.
+/* parse the lengths and path of the entry at the given offset of the entries
+ * of a ROM image.
+ * return the offset of the data of the entry, or zero if its header or path
+ * is incomplete.
  */
-const char* extract_rom_file(const char *romfs, const char *path, size_t *file_len)
+static size_t read_entry_header(const unsigned char *content, size_t entries_len, int version, size_t offset, ROMEntry *entry)
 {
-  ROMHeader *rom;
-  size_t file_size, offset;
-  size_t path_len;
-  const char *content;
-
-  if (!romfs || !path)
-    return 0;
+  size_t header_len, n;
 
-  rom = (ROMHeader*)romfs;
-  if (strncmp("ROM", rom->magic, 3) != 0)
+  if (offset >= entries_len)
     return 0;
 
-  for (content = 0, file_size = 1, offset = 0;
-      file_size != 0 && !content;
-      offset += file_size + path_len)
+  if (version == 1)
   {
-    file_size = (size_t)rom->content[offset++];
-    file_size <<= 8;
-    file_size += (size_t)rom->content[offset++];
-    file_size <<= 8;
-    file_size += (size_t)rom->content[offset++];
-    file_size <<= 8;
-    file_size += (size_t)rom->content[offset++];
-    path_len = (size_t)rom->content[offset++];
-    if (path_len && strncmp((const char*)rom->content + offset, path, path_len) == 0)
-    {
-      content = (const char*)rom->content + offset + path_len;
-      if (file_len)
-        *file_len = file_size - 1; /* exclude null terminator. */
-    }
+    if (entries_len - offset < 5)
+      return 0;
+    entry->data_len = read_u32(content + offset);
+    entry->path_len = content[offset + 4];
+    header_len = 5;
+  }
+  else
+  {
+    header_len = read_varint(content + offset, entries_len - offset, &entry->data_len);
+    n = header_len ? read_varint(content + offset + header_len, entries_len - offset - header_len, &entry->path_len) : 0;
+    if (!n)
+      return 0;
+    header_len += n;
   }
 
-  return content;
+  if (entry->path_len > entries_len - offset - header_len)
+    return 0;
+
+  entry->path = (const char*)content + offset + header_len;
+  entry->data_entry = offset;
+  return offset + header_len + entry->path_len;
 }
 
+/* parse the file entry at the given offset of the entries of a ROM image,
+ * following a link to the entry holding its data.
+ * return the offset of the following entry, or zero if there is no complete
+ * file entry at the offset.
+ */
+static size_t read_entry(const unsigned char *content, size_t entries_len, int version, size_t offset, ROMEntry *entry)
+{
+  ROMEntry target;
+  size_t data_offset, next, n;
+
+  data_offset = read_entry_header(content, entries_len, version, offset, entry);
+  if (!data_offset)
+    return 0;
+
+  next = 0;
+  if (entry->data_len == 0 && entry->path_len && version >= 3)
+  {
+    /* a link refers back to an entry that is not a link, so links cannot loop. */
+    n = read_varint(content + data_offset, entries_len - data_offset, &entry->data_entry);
+    if (!n || entry->data_entry >= offset)
+      return 0;
+    next = data_offset + n;
+
+    data_offset = read_entry_header(content, entries_len, version, entry->data_entry, &target);
+    if (!data_offset)
+      return 0;
+    entry->data_len = target.data_len;
+  }
+
+  if (entry->data_len == 0 || entry->data_len > entries_len - data_offset)
+    return 0;
+
+  entry->data = content + data_offset;
+  return next ? next : data_offset + entry->data_len;
+}
+
+/* return the entry offset plus one held by an index slot, or zero if it is empty. */
+static size_t read_slot(const ROMHeader *rom, size_t slot)
+{
+  if (rom->version == 1)
+    return read_u32(rom->index + slot * 4);
+  return read_u64(rom->index + slot * 8);
+}
+
+static void write_slot(ROMHeader *rom, size_t slot, size_t value)
+{
+  if (rom->version == 1)
+    write_u32(rom->index + slot * 4, value);
+  else
+    write_u64(rom->index + slot * 8, value);
+}
+
+/* parse the file entry referenced by an index slot.
+ * return zero if the slot is empty or does not reference a complete entry.
+ */
+static int read_slot_entry(const ROMHeader *rom, size_t slot, ROMEntry *entry)
+{
+  size_t offset;
+
+  offset = read_slot(rom, slot);
+  return offset && read_entry(rom->content, rom->entries_len, rom->version, offset - 1, entry);
+}
+
+#define FNV_OFFSET_BASIS 2166136261UL
+
+/* continue the FNV-1a hash of a path with the given bytes. */
+static uint32_t hash_bytes(uint32_t hash, const char *bytes, size_t len)
+{
+  for (; len; --len)
+  {
+    hash ^= (unsigned char)*bytes++;
+    hash *= 16777619UL;
+  }
+
+  return hash;
+}
+
+/* return the FNV-1a hash of the given path. */
+static uint32_t hash_path(const char *path, size_t path_len)
+{
+  return hash_bytes(FNV_OFFSET_BASIS, path, path_len);
+}
+
+/* find the index slot of a ROM for the given path.  Return the slot holding the
+ * matching entry, the empty slot at which the path would be inserted, or
+ * index_slots if the index is full and does not contain the path.  If probes is
+ * not NULL, the number of entries examined is added to it.
+ * path_len includes the null terminator.
+ */
+static size_t find_index_slot(const ROMHeader *rom, const char *path, size_t path_len, size_t *probes)
+{
+  ROMEntry entry;
+  size_t i, n, slot;
+
+  i = hash_path(path, path_len - 1);
+  for (n = 0; n != rom->index_slots; ++n, ++i)
+  {
+    slot = i & (rom->index_slots - 1);
+    if (read_slot(rom, slot) == 0)
+      return slot;
+
+    if (probes)
+      ++*probes;
+
+    /* skip slots that do not reference a complete entry. */
+    if (!read_slot_entry(rom, slot, &entry))
+      continue;
+
+    if (entry.path_len == path_len && memcmp(entry.path, path, path_len) == 0)
+      return slot;
+  }
+
+  return rom->index_slots;
+}
+
+/* build a path index for a ROM image that does not include one, in the index
+ * slots of the ROM.  Duplicate paths resolve to the first entry, as a linear
+ * search would.
+ */
+static void build_rom_index(ROMHeader *rom)
+{
+  ROMEntry entry;
+  size_t offset, next, slot;
+
+  memset(rom->index, 0, rom->index_slots * SLOT_LEN(rom->version));
+  for (offset = 0; (next = read_entry(rom->content, rom->entries_len, rom->version, offset, &entry)) != 0; offset = next)
+  {
+    if (entry.path_len)
+    {
+      slot = find_index_slot(rom, entry.path, entry.path_len, 0);
+      if (slot != rom->index_slots && read_slot(rom, slot) == 0)
+        write_slot(rom, slot, offset + 1);
+    }
+  }
+}
+
+/* return the number of slots needed to index a ROM image, keeping the index at
+ * most half full.  files is the number of files in the image if known, or zero
+ * to count them.
+ */
+static size_t count_index_slots(const unsigned char *content, size_t content_len, int version, size_t files)
+{
+  ROMEntry entry;
+  size_t offset, slots;
+
+  if (!files)
+  {
+    for (offset = 0; (offset = read_entry(content, content_len, version, offset, &entry)) != 0; ++files)
+      ;
+  }
+
+  for (slots = 2; slots < files * 2; slots <<= 1)
+    ;
+
+  return slots;
+}
+
+/* locate the path index footer written by mkrom.  return zero if the image does
+ * not have a valid footer.
+ */
+static int find_rom_index(const unsigned char *content, size_t content_len, int version,
+    size_t *index_offset, size_t *index_slots)
+{
+  size_t slots;
+
+  if (content_len < INDEX_FOOTER_LEN || memcmp(content + content_len - 3, "IDX", 3) != 0)
+    return 0;
+
+  slots = read_u32(content + content_len - INDEX_FOOTER_LEN);
+  if (slots == 0 || (slots & (slots - 1)) != 0 || slots > (content_len - INDEX_FOOTER_LEN) / SLOT_LEN(version))
+    return 0;
+
+  *index_slots = slots;
+  *index_offset = content_len - INDEX_FOOTER_LEN - slots * SLOT_LEN(version);
+  return 1;
+}
+
+/* create and return a dynamically allocated ROM object using the given content,
+ * whose entries and index are in the format of the given version.
+ * The content is copied into the object unless copy is zero, in which case it must
+ * outlive the object or be handed to it by setting owned.  If the content does not
+ * include a path index, one is built and stored in the object, sized for the given
+ * number of files if it is not zero.
+ * return zero on failure, or if a version 1 image is too large for its format.
+ */
+static ROMHeader* create_rom(const char *content, size_t len, int version, size_t files, int copy)
+{
+  ROMHeader *hdr;
+  pthread_mutexattr_t attr;
+  size_t index_offset, index_slots, index_len, copy_len;
+
+  if (version == 1 && (unsigned long long)len > MAX_V1_IMAGE_LEN)
+    return 0;
+
+  index_len = 0;
+  index_offset = 0;
+  if (!find_rom_index((const unsigned char*)content, len, version, &index_offset, &index_slots))
+  {
+    index_slots = count_index_slots((const unsigned char*)content, len, version, files);
+    index_len = index_slots * SLOT_LEN(version);
+  }
+
+  copy_len = copy ? len : 0;
+  hdr = (ROMHeader*)malloc(sizeof(ROMHeader) + copy_len + index_len);
+  if (hdr)
+  {
+    strncpy(hdr->magic, "ROM", 3);
+    hdr->content = copy ? hdr->data : (const unsigned char*)content;
+    hdr->content_len = len;
+    hdr->version = version;
+    hdr->map = 0;
+    hdr->map_len = 0;
+    hdr->owned = 0;
+    hdr->owned_len = 0;
+    hdr->files = 0;
+    hdr->sorted = 0;
+    hdr->sorted_len = 0;
+    hdr->cache_len = 0;
+    hdr->cache_limit = 0;
+    hdr->cache_hits = 0;
+    hdr->cache_misses = 0;
+    hdr->bytecode_tag = 0;
+    hdr->bytecode_tag_len = 0;
+    hdr->dict = 0;
+    hdr->dict_len = 0;
+#ifdef WITH_ZSTD
+    hdr->ddict = 0;
+    hdr->dctx = 0;
+#endif
+    memset(&hdr->stats, 0, sizeof(ROMStats));
+    hdr->prev = 0;
+    hdr->next = 0;
+    hdr->refs = 1;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&hdr->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    memcpy(hdr->data, content, copy_len);
+    if (index_len)
+    {
+      hdr->entries_len = len;
+      hdr->index = hdr->data + copy_len;
+      hdr->index_slots = index_slots;
+      build_rom_index(hdr);
+    }
+    else
+    {
+      hdr->entries_len = index_offset;
+      hdr->index = (unsigned char*)hdr->content + index_offset;
+      hdr->index_slots = index_slots;
+    }
+  }
+
+  return hdr;
+}
+
+/* return the number of bytes allocated for the given ROM object. */
+static size_t rom_size(const ROMHeader *rom)
+{
+  size_t len;
+
+  len = sizeof(ROMHeader) + rom->owned_len + rom->dict_len;
+  if (rom->content == rom->data)
+    len += rom->content_len;
+  if (rom->entries_len == rom->content_len)
+    len += rom->index_slots * SLOT_LEN(rom->version); /* index built at mount. */
+  len += rom->sorted_len * sizeof(*rom->sorted);
+
+  return len;
+}
+
+/* An RFS blob holds a ROM image, either compressed as a whole or with its files
+ * compressed individually:
+ *   "RFS", 1-byte version, header records, image.
+ * Each header record is a 1-byte type, a 4-byte big-endian length and that many
+ * bytes of data, and the records end with a record of type RFS_END.  Records of
+ * an unknown type are skipped if the RFS_OPTIONAL bit is set and rejected
+ * otherwise.
+ *
+ * An RFS_IMAGE record holds the 4-byte or 8-byte big-endian length of the image,
+ * which is then compressed as a whole.  Otherwise, the data of each file entry in
+ * the image is a 1-byte method, the file length and the file content, either
+ * stored with a null terminator (RFS_STORED) or compressed.  The file length is
+ * 4-byte big-endian in version 1 and a varint in later versions.
+ *
+ * The version of the blob is that of its image, as described above.  mkrom
+ * writes version 1 blobs unless their files or paths are too large for them or
+ * they hold links.
+ *
+ * The image or files are compressed with the method given by an RFS_CODEC record,
+ * or with zlib if there is none: as a zlib stream (RFS_ZLIB), a zstd frame
+ * (RFS_ZSTD), or an LZ4 frame for an image and an LZ4 block for a file (RFS_LZ4).
+ * ROMs compressed with a codec that is not built in are rejected.
+ *
+ * Files compressed individually with zlib or zstd may share a dictionary, held
+ * by an RFS_DICT record: a preset dictionary for zlib or a zstd dictionary.
+ */
+#define RFS_VERSION 3
+
+#define RFS_END 0x00
+#define RFS_IMAGE 0x01    /* length of the image, compressed as a whole. */
+#define RFS_CODEC 0x02    /* method used to compress the image or files. */
+#define RFS_DICT 0x03     /* dictionary the files were compressed with. */
+#define RFS_BYTECODE 0x81 /* tag identifying the Lua VM that compiled the .lua files. */
+#define RFS_FILES 0x82    /* number of files in the image. */
+#define RFS_OPTIONAL 0x80
+
+#define RFS_STORED 0
+#define RFS_ZLIB 1
+#define RFS_ZSTD 2
+#define RFS_LZ4 3
+
+/* return non-zero if ROMs compressed with the given method can be mounted. */
+static int codec_supported(int codec)
+{
+#ifdef WITH_ZSTD
+  if (codec == RFS_ZSTD)
+    return 1;
+#endif
+#ifdef WITH_LZ4
+  if (codec == RFS_LZ4)
+    return 1;
+#endif
+  return codec == RFS_ZLIB;
+}
+
+/* Return a dynamically allocated ROM filesystem image of image_len bytes,
+ * decompressed with the given method.
+ * return zero on failure.
+ */
+static const char* decompress_rom(Payload *payload, int codec, size_t image_len, size_t *romfs_len)
+{
+  const char *romfs;
+  unsigned long long start, decrypt_ns;
+
+  /* the time spent decrypting the payload as it is read is not counted twice. */
+  start = now_ns();
+  decrypt_ns = payload->stats.decrypt_ns;
+  romfs = 0;
+#ifdef WITH_ZSTD
+  if (codec == RFS_ZSTD)
+    romfs = unzstd_rom(payload, image_len, romfs_len);
+#endif
+#ifdef WITH_LZ4
+  if (codec == RFS_LZ4)
+    romfs = unlz4_rom(payload, image_len, romfs_len);
+#endif
+  if (codec == RFS_ZLIB)
+    romfs = inflate_rom(payload, image_len, romfs_len);
+  payload->stats.inflate_ns += now_ns() - start - (payload->stats.decrypt_ns - decrypt_ns);
+  if (romfs)
+    payload->stats.bytes_inflated += *romfs_len;
+
+  return romfs;
+}
+
+/* inflate a zlib stream of len bytes, which may need the given preset dictionary.
+ * return zero on failure.
+ */
+static int inflate_file(char *file, size_t len, const unsigned char *data, size_t data_len,
+    const char *dict, size_t dict_len)
+{
+  z_stream strm;
+  int ret;
+
+  memset(&strm, 0, sizeof(strm));
+  if (inflateInit(&strm) != Z_OK)
+    return 0;
+
+  strm.next_in = (unsigned char*)data;
+  strm.next_out = (unsigned char*)file;
+  do
+  {
+    if (strm.avail_in == 0)
+    {
+      strm.avail_in = ZLIB_LEN(data_len);
+      data_len -= strm.avail_in;
+    }
+    if (strm.avail_out == 0)
+    {
+      strm.avail_out = ZLIB_LEN(len);
+      len -= strm.avail_out;
+    }
+
+    ret = inflate(&strm, Z_NO_FLUSH);
+    if (ret == Z_NEED_DICT && dict &&
+        inflateSetDictionary(&strm, (const unsigned char*)dict, dict_len) == Z_OK)
+      ret = Z_OK;
+  }
+  while (ret == Z_OK);
+  inflateEnd(&strm);
+
+  return ret == Z_STREAM_END && strm.avail_out == 0 && len == 0;
+}
+
+/* decompress a file of len bytes compressed with the given method, using the
+ * dictionary of the ROM if it has one.
+ * return zero on failure.
+ */
+static int decompress_file(ROMHeader *rom, int codec, char *file, size_t len, const unsigned char *data, size_t data_len)
+{
+#ifdef WITH_ZSTD
+  if (codec == RFS_ZSTD)
+  {
+    if (!rom->dctx && !(rom->dctx = ZSTD_createDCtx()))
+      return 0;
+    if (rom->ddict)
+      return ZSTD_decompress_usingDDict(rom->dctx, file, len, data, data_len, rom->ddict) == len;
+    return ZSTD_decompressDCtx(rom->dctx, file, len, data, data_len) == len;
+  }
+#endif
+#ifdef WITH_LZ4
+  if (codec == RFS_LZ4)
+    return data_len <= LZ4_MAX_INPUT_SIZE && len <= LZ4_MAX_INPUT_SIZE &&
+        LZ4_decompress_safe((const char*)data, file, data_len, len) == (int)len;
+#endif
+  if (codec != RFS_ZLIB)
+    return 0;
+
+  return inflate_file(file, len, data, data_len, rom->dict, rom->dict_len);
+}
+
+/* the header records of an RFS blob. */
+typedef struct _RFSHeader {
+  int version;
+  size_t image_offset;
+  size_t image_len; /* length of the inflated image, or zero if its files are compressed individually. */
+  size_t files;     /* number of files in the image, or zero if unknown. */
+  int codec;        /* method used to compress the image or files. */
+  const unsigned char *bytecode_tag;
+  size_t bytecode_tag_len;
+  const unsigned char *dict;
+  size_t dict_len;
+}
+  RFSHeader;
+
+/* parse the header of an RFS blob.  return zero if the header is invalid or
+ * unsupported.
+ */
+static int parse_rfs_header(const unsigned char *rom_blob, size_t rom_blob_len, RFSHeader *header)
+{
+  size_t offset, record_len;
+  unsigned char type;
+
+  if (rom_blob_len < 4 || memcmp(rom_blob, "RFS", 3) != 0 || rom_blob[3] == 0 || rom_blob[3] > RFS_VERSION)
+    return 0;
+
+  memset(header, 0, sizeof(RFSHeader));
+  header->version = rom_blob[3];
+  header->codec = RFS_ZLIB;
+  for (offset = 4; offset + 5 <= rom_blob_len; offset += 5 + record_len)
+  {
+    type = rom_blob[offset];
+    record_len = read_u32(rom_blob + offset + 1);
+    if (type == RFS_END)
+    {
+      header->image_offset = offset + 5;
+      return codec_supported(header->codec);
+    }
+
+    if (record_len > rom_blob_len - offset - 5)
+      break;
+
+    if (type == RFS_IMAGE)
+    {
+      if (record_len == 4)
+        header->image_len = read_u32(rom_blob + offset + 5);
+      else if (record_len == 8)
+        header->image_len = read_u64(rom_blob + offset + 5);
+      if (header->image_len == 0 || header->image_len == (size_t)-1)
+        break;
+    }
+    else if (type == RFS_CODEC)
+    {
+      if (record_len != 1)
+        break;
+      header->codec = rom_blob[offset + 5];
+    }
+    else if (type == RFS_DICT)
+    {
+      header->dict = rom_blob + offset + 5;
+      header->dict_len = record_len;
+    }
+    else if (type == RFS_BYTECODE)
+    {
+      header->bytecode_tag = rom_blob + offset + 5;
+      header->bytecode_tag_len = record_len;
+    }
+    else if (type == RFS_FILES && record_len == 4)
+      header->files = read_u32(rom_blob + offset + 5);
+    else if (type == RFS_FILES && record_len == 8)
+      header->files = read_u64(rom_blob + offset + 5);
+    else if (!(type & RFS_OPTIONAL))
+      break;
+  }
+
+  return 0;
+}
+
+/* create and return a ROM object for an RFS image whose files are compressed
+ * individually.  The image is copied into the object unless copy is zero, in
+ * which case it must outlive the object.
+ * return zero on failure.
+ */
+static ROMHeader* create_rfs_rom(const char *image, size_t image_len, int version, size_t files, int copy)
+{
+  ROMHeader *rom;
+
+  rom = create_rom(image, image_len, version, files, copy);
+  if (!rom)
+    return 0;
+
+  rom->files = (ROMFile*)calloc(rom->index_slots, sizeof(ROMFile));
+  rom->lru_head = rom->lru_tail = rom->index_slots;
+  if (!rom->files)
+  {
+    /* release the partial ROM as unmount_rom does, which destroys its lock. */
+    unmount_rom((const char*)rom);
+    rom = 0;
+  }
+
+  return rom;
+}
+
+/* mount and return a ROM object for an RFS payload.  A compressed image is
+ * inflated into a single buffer of the length given in the header.  Otherwise
+ * the image of an unencrypted payload is used as per create_rfs_rom and that of
+ * an encrypted payload is decrypted as a whole.
+ * return zero on failure.
+ */
+static ROMHeader* mount_rfs(Payload *payload, int copy)
+{
+  ROMHeader *rom;
+  RFSHeader header;
+  const unsigned char *data;
+  const char *content;
+  uint8_t *decrypted;
+  char *tag, *dict;
+  size_t len;
+
+  /* the header of an encrypted payload must be within its first window. */
+  data = read_payload(payload, &len);
+  if (!data || !parse_rfs_header(data, len, &header))
+    return 0;
+
+  /* copy the tag and dictionary before the window is reused. */
+  tag = header.bytecode_tag ? (char*)malloc(header.bytecode_tag_len) : 0;
+  dict = header.dict ? (char*)malloc(header.dict_len) : 0;
+  if ((header.bytecode_tag && !tag) || (header.dict && !dict))
+  {
+    free(tag);
+    free(dict);
+    return 0;
+  }
+  if (tag)
+    memcpy(tag, header.bytecode_tag, header.bytecode_tag_len);
+  if (dict)
+    memcpy(dict, header.dict, header.dict_len);
+
+  rom = 0;
+  if (header.image_len)
+  {
+    /* read the payload again from the start of the image. */
+    payload->start += header.image_offset;
+    payload->offset = payload->start & ~(size_t)(AES_BLOCKLEN - 1);
+    content = decompress_rom(payload, header.codec, header.image_len, &len);
+    if (content)
+    {
+      rom = create_rom(content, len, header.version, header.files, 0);
+      if (rom)
+      {
+        rom->owned = (void*)content;
+        rom->owned_len = len;
+      }
+      else
+        free((void*)content);
+    }
+  }
+  else if (!payload->encrypted)
+    rom = create_rfs_rom((const char*)data + header.image_offset, len - header.image_offset,
+        header.version, header.files, copy);
+  else
+  {
+    decrypted = decrypt_payload(payload);
+    if (decrypted)
+    {
+      len = payload->end - payload->start - header.image_offset;
+      rom = create_rfs_rom((const char*)decrypted + payload->start + header.image_offset, len,
+          header.version, header.files, 0);
+    }
+    if (rom)
+    {
+      rom->owned = decrypted;
+      rom->owned_len = payload->blob_len;
+    }
+    else
+      free(decrypted);
+  }
+
+  if (!rom)
+  {
+    free(tag);
+    free(dict);
+    return 0;
+  }
+
+  rom->bytecode_tag = tag;
+  rom->bytecode_tag_len = header.bytecode_tag_len;
+  rom->dict = dict;
+  rom->dict_len = header.dict_len;
+#ifdef WITH_ZSTD
+  /* digest a zstd dictionary once for all of the files. */
+  if (dict && header.codec == RFS_ZSTD && !(rom->ddict = ZSTD_createDDict(dict, header.dict_len)))
+  {
+    unmount_rom((const char*)rom);
+    rom = 0;
+  }
+#endif
+
+  return rom;
+}
+
+/* The mounted ROMs are listed so that get_rom_stats can total their statistics,
+ * together with those of the ROMs already unmounted.
+ */
+static pthread_mutex_t mounted_lock = PTHREAD_MUTEX_INITIALIZER;
+static ROMHeader *mounted;
+static ROMStats unmounted;
+static int lookup_timing; /* read and written atomically, as lookups read it without a lock. */
+
+/* add the counters of one set of statistics to another. */
+static void add_rom_stats(ROMStats *total, const ROMStats *stats)
+{
+  total->mounts += STATS_LOAD(stats->mounts);
+  total->unmounts += STATS_LOAD(stats->unmounts);
+  total->lookups += STATS_LOAD(stats->lookups);
+  total->lookup_misses += STATS_LOAD(stats->lookup_misses);
+  total->entries_scanned += STATS_LOAD(stats->entries_scanned);
+  total->bytes_inflated += STATS_LOAD(stats->bytes_inflated);
+  total->bytes_decrypted += STATS_LOAD(stats->bytes_decrypted);
+  total->inflate_ns += STATS_LOAD(stats->inflate_ns);
+  total->decrypt_ns += STATS_LOAD(stats->decrypt_ns);
+  total->lookup_ns += STATS_LOAD(stats->lookup_ns);
+  total->resident_bytes += STATS_LOAD(stats->resident_bytes);
+}
+
+static void register_rom(ROMHeader *rom)
+{
+  rom->stats.mounts = 1;
+  pthread_mutex_lock(&mounted_lock);
+  rom->next = mounted;
+  if (mounted)
+    mounted->prev = rom;
+  mounted = rom;
+  pthread_mutex_unlock(&mounted_lock);
+}
+
+/* remove a ROM from the list of mounted ROMs, if it was added, and keep its statistics. */
+static void unregister_rom(ROMHeader *rom)
+{
+  pthread_mutex_lock(&mounted_lock);
+  if (rom->prev || mounted == rom)
+  {
+    if (rom->prev)
+      rom->prev->next = rom->next;
+    else
+      mounted = rom->next;
+    if (rom->next)
+      rom->next->prev = rom->prev;
+
+    ++rom->stats.unmounts;
+    add_rom_stats(&unmounted, &rom->stats);
+  }
+  pthread_mutex_unlock(&mounted_lock);
+}
+
+/* mount and return a ROM object for a ROM blob.  Uncompressed and RFS content is
+ * copied into the object unless copy is zero, in which case the blob must outlive
+ * the object.  Inflated and decrypted content is always held in a single buffer
+ * owned by the object.  The ROM is listed for get_rom_stats unless listed is
+ * zero.
+ * return zero on failure.
+ */
+static ROMHeader* mount_blob(const char *rom_blob, size_t rom_blob_len, const char *passphrase, int copy, int listed)
+{
+  ROMHeader *romfs;
+  const char *rom_content;
+  Payload payload;
+
+  if (!rom_blob || rom_blob_len < 4)
+    return 0;
+
+  romfs = 0;
+  rom_content = 0;
+  memset(&payload, 0, sizeof(payload));
+  if (strncmp("ENC", rom_blob, 3) == 0 && passphrase)
+  {
+    /* the payload is either an RFS blob or a compressed ROM image, which is
+     * decrypted as it is inflated.
+     */
+    if (open_payload(rom_blob + 3, rom_blob_len - 3, passphrase, &payload))
+    {
+      if (payload_has_magic(&payload, "RFS"))
+        romfs = mount_rfs(&payload, 0);
+      else
+        rom_content = decompress_rom(&payload, RFS_ZLIB, 0, &rom_blob_len);
+      close_payload(&payload);
+    }
+  }
+  else if (strncmp("BIN", rom_blob, 3) == 0)
+  {
+    open_payload(rom_blob + 3, rom_blob_len - 3, 0, &payload);
+    rom_content = decompress_rom(&payload, RFS_ZLIB, 0, &rom_blob_len);
+  }
+  else if (strncmp("RFS", rom_blob, 3) == 0)
+  {
+    open_payload(rom_blob, rom_blob_len, 0, &payload);
+    romfs = mount_rfs(&payload, copy);
+  }
+  else if (strncmp("ASC", rom_blob, 3) == 0)
+    romfs = create_rom(rom_blob + 3, rom_blob_len - 3, 1, 0, copy);
+
+  if (rom_content)
+  {
+    /* hand the inflated image to the ROM object rather than copying it. */
+    romfs = create_rom(rom_content, rom_blob_len, 1, 0, 0);
+    if (romfs)
+    {
+      romfs->owned = (void*)rom_content;
+      romfs->owned_len = rom_blob_len;
+    }
+    else
+      free((void*)rom_content);
+  }
+
+  if (romfs)
+  {
+    romfs->stats = payload.stats;
+    if (listed)
+      register_rom(romfs);
+  }
+
+  return romfs;
+}
+
+/* mount and return the filesystem content of a ROM blob.  This must be
+ * called on a ROM blob before trying to extract files from it.
+ * Store the number of bytes allocated for the mounted filesystem in romfs_len.
+ * The returned object must be released with unmount_rom when the ROM is
+ * nolonger needed.
+ *
+ * passphrase may be NULL.
+ *
+ * return zero on failure.
+ */
+const char* mount_rom(const char *rom_blob, size_t rom_blob_len, size_t *romfs_len, const char *passphrase)
+{
+  ROMHeader *romfs;
+
+  if (!romfs_len)
+    return 0;
+
+  romfs = mount_blob(rom_blob, rom_blob_len, passphrase, 1, 1);
+  if (romfs)
+    *romfs_len = rom_size(romfs);
+
+  return (const char*)romfs;
+}
+
+/* mount and return the filesystem content of a ROM blob as per mount_rom, except
+ * that uncompressed (ASC) and unencrypted RFS ROMs are used in place rather than
+ * copied.  The blob must not be changed or released until the ROM is unmounted.
+ */
+const char* mount_rom_in_place(const char *rom_blob, size_t rom_blob_len, size_t *romfs_len, const char *passphrase)
+{
+  ROMHeader *romfs;
+
+  if (!romfs_len)
+    return 0;
+
+  romfs = mount_blob(rom_blob, rom_blob_len, passphrase, 0, 1);
+  if (romfs)
+    *romfs_len = rom_size(romfs);
+
+  return (const char*)romfs;
+}
+
+/* mount and return the filesystem content of a ROM blob as per
+ * mount_rom_in_place, except that the ROM is not counted in the totals of
+ * get_rom_stats, for ROMs used internally such as the Lua library's bootstrap.
+ */
+const char* mount_rom_unlisted(const char *rom_blob, size_t rom_blob_len, size_t *romfs_len, const char *passphrase)
+{
+  ROMHeader *romfs;
+
+  if (!romfs_len)
+    return 0;
+
+  romfs = mount_blob(rom_blob, rom_blob_len, passphrase, 0, 0);
+  if (romfs)
+    *romfs_len = rom_size(romfs);
+
+  return (const char*)romfs;
+}
+
+/* mount and return the filesystem content of a ROM file.  Uncompressed (ASC)
+ * and unencrypted RFS ROMs are served directly from a read-only mapping of the
+ * file, so that their content is held in the page cache rather than copied to
+ * the heap.  Other ROMs are mounted from the mapping as per mount_rom.
+ * Store the number of bytes allocated for the mounted filesystem in romfs_len.
+ * The returned object must be released with unmount_rom when the ROM is
+ * nolonger needed.
+ *
+ * passphrase may be NULL.
+ *
+ * return zero on failure, with errno set if the file could not be read.
+ */
+const char* mount_rom_file(const char *path, size_t *romfs_len, const char *passphrase)
+{
+  ROMHeader *romfs;
+  struct stat st;
+  void *map;
+  int fd;
+
+  if (!path || !romfs_len)
+    return 0;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return 0;
+
+  map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= 4)
+    map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return 0;
+
+  if (strncmp("BIN", (const char*)map, 3) == 0 || strncmp("ENC", (const char*)map, 3) == 0)
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  /* keep the mapping only if the ROM content is served from it. */
+  romfs = mount_blob((const char*)map, st.st_size, passphrase, 0, 1);
+  if (romfs && !romfs->owned)
+  {
+    romfs->map = map;
+    romfs->map_len = st.st_size;
+  }
+  else
+    munmap(map, st.st_size);
+
+  if (romfs)
+    *romfs_len = rom_size(romfs);
+
+  return (const char*)romfs;
+}
+
+/* add a reference to a mounted ROM, so that it may be shared, for example by
+ * several Lua states or threads.  Each reference is released by a call to
+ * unmount_rom, and the ROM is released with the last reference.
+ * return the ROM, or zero if it is not valid.
+ */
+const char* retain_rom(const char *romfs)
+{
+  ROMHeader *rom;
+
+  rom = (ROMHeader*)romfs;
+  if (!rom || strncmp("ROM", rom->magic, 3) != 0)
+    return 0;
+
+  __atomic_add_fetch(&rom->refs, 1, __ATOMIC_RELAXED);
+  return romfs;
+}
+
+/* release a reference to a ROM filesystem returned by mount_rom, mount_rom_in_place,
+ * mount_rom_file or retain_rom, and release the ROM with its last reference.
+ */
+void unmount_rom(const char *romfs)
+{
+  ROMHeader *rom;
+  size_t i;
+
+  rom = (ROMHeader*)romfs;
+  if (!rom || strncmp("ROM", rom->magic, 3) != 0)
+    return;
+
+  if (__atomic_sub_fetch(&rom->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+
+  unregister_rom(rom);
+  if (rom->files)
+  {
+    for (i = 0; i != rom->index_slots; ++i)
+      free(rom->files[i].content);
+    free(rom->files);
+  }
+  if (rom->map)
+    munmap(rom->map, rom->map_len);
+  free(rom->bytecode_tag);
+  free(rom->dict);
+  free(rom->sorted);
+#ifdef WITH_ZSTD
+  ZSTD_freeDDict(rom->ddict);
+  ZSTD_freeDCtx(rom->dctx);
+#endif
+  pthread_mutex_destroy(&rom->lock);
+  free(rom->owned);
+  free(rom);
+}
+
+/* hold the lock of a ROM, which serialises access to the files inflated from
+ * it.  A thread must hold the lock while using a file extracted from a ROM that
+ * is shared with other threads and has a cache limit, since extraction by
+ * another thread may evict the file.  The lock may be held recursively.
+ */
+void lock_rom(const char *romfs)
+{
+  ROMHeader *rom;
+
+  rom = (ROMHeader*)romfs;
+  if (rom && strncmp("ROM", rom->magic, 3) == 0)
+    pthread_mutex_lock(&rom->lock);
+}
+
+/* release the lock of a ROM held by lock_rom. */
+void unlock_rom(const char *romfs)
+{
+  ROMHeader *rom;
+
+  rom = (ROMHeader*)romfs;
+  if (rom && strncmp("ROM", rom->magic, 3) == 0)
+    pthread_mutex_unlock(&rom->lock);
+}
+
+/* remove an inflated file from the least recently used list. */
+static void unlink_rom_file(ROMHeader *rom, size_t slot)
+{
+  ROMFile *file;
+
+  file = rom->files + slot;
+  if (file->prev == rom->index_slots)
+    rom->lru_head = file->next;
+  else
+    rom->files[file->prev].next = file->next;
+
+  if (file->next == rom->index_slots)
+    rom->lru_tail = file->prev;
+  else
+    rom->files[file->next].prev = file->prev;
+}
+
+/* add an inflated file to the head of the least recently used list. */
+static void link_rom_file(ROMHeader *rom, size_t slot)
+{
+  ROMFile *file;
+
+  file = rom->files + slot;
+  file->prev = rom->index_slots;
+  file->next = rom->lru_head;
+  if (rom->lru_head == rom->index_slots)
+    rom->lru_tail = slot;
+  else
+    rom->files[rom->lru_head].prev = slot;
+  rom->lru_head = slot;
+}
+
+/* release least recently used inflated files until the cache is within its
+ * limit, keeping the most recently used file regardless.
+ */
+static void trim_rom_cache(ROMHeader *rom)
+{
+  size_t slot;
+
+  while (rom->cache_limit && rom->cache_len > rom->cache_limit && rom->lru_tail != rom->lru_head)
+  {
+    slot = rom->lru_tail;
+    unlink_rom_file(rom, slot);
+    rom->cache_len -= rom->files[slot].len + 1;
+    free(rom->files[slot].content);
+    rom->files[slot].content = 0;
+  }
+}
+
+/* parse the method and length at the start of the data of a file that is
+ * compressed individually.
+ * return the length of the method and file length, or zero if they are incomplete.
+ */
+static size_t read_file_header(const ROMHeader *rom, const unsigned char *data, size_t data_len, size_t *file_len)
+{
+  size_t n;
+
+  if (rom->version == 1)
+  {
+    if (data_len < 5)
+      return 0;
+    *file_len = read_u32(data + 1);
+    return 5;
+  }
+
+  n = data_len ? read_varint(data + 1, data_len - 1, file_len) : 0;
+  return n ? n + 1 : 0;
+}
+
+/* return the content of a file that is compressed individually, inflating it
+ * if it is not already held.  The file data holds its method, length and content.
+ * return zero on failure.
+ */
+static const char* inflate_rom_file(ROMHeader *rom, size_t slot, const unsigned char *data, size_t data_len, size_t *file_len)
+{
+  size_t len, header_len;
+  char *file;
+  unsigned long long start;
+
+  header_len = read_file_header(rom, data, data_len, &len);
+  if (!header_len)
+    return 0;
+
+  if (file_len)
+    *file_len = len;
+
+  if (data[0] == RFS_STORED)
+    return data_len > header_len && data_len - header_len - 1 == len ? (const char*)data + header_len : 0;
+
+  if (rom->files[slot].content)
+  {
+    ++rom->cache_hits;
+    unlink_rom_file(rom, slot);
+    link_rom_file(rom, slot);
+    return rom->files[slot].content;
+  }
+
+  ++rom->cache_misses;
+  file = (char*)malloc(len + 1);
+  if (!file)
+    return 0;
+
+  start = now_ns();
+  if (!decompress_file(rom, data[0], file, len, data + header_len, data_len - header_len))
+  {
+    free(file);
+    return 0;
+  }
+  rom->stats.inflate_ns += now_ns() - start;
+  rom->stats.bytes_inflated += len;
+
+  file[len] = 0;
+  rom->files[slot].content = file;
+  rom->files[slot].len = len;
+  rom->cache_len += len + 1;
+  link_rom_file(rom, slot);
+  trim_rom_cache(rom);
+
+  return file;
+}
+
+/* return the index slot of the entry holding the data of the file referenced
+ * by an index slot, which differs for a link, so that the data of linked files
+ * is inflated once.
+ */
+static size_t data_slot(const ROMHeader *rom, size_t slot, const ROMEntry *entry)
+{
+  ROMEntry target;
+  size_t target_slot;
+
+  if (read_slot(rom, slot) == entry->data_entry + 1 ||
+      !read_entry(rom->content, rom->entries_len, rom->version, entry->data_entry, &target))
+    return slot;
+
+  target_slot = find_index_slot(rom, target.path, target.path_len, 0);
+  if (target_slot == rom->index_slots || read_slot(rom, target_slot) != entry->data_entry + 1)
+    return slot;
+
+  return target_slot;
+}
+
+/* return the content of the file referenced by an index slot, which must hold
+ * a complete entry, and store its length in file_len if given.
+ * return zero on failure.
+ */
+static const char* read_rom_entry(ROMHeader *rom, size_t slot, size_t *file_len)
+{
+  ROMEntry entry;
+  const char *file;
+
+  if (!read_slot_entry(rom, slot, &entry))
+    return 0;
+
+  if (rom->files)
+  {
+    pthread_mutex_lock(&rom->lock);
+    file = inflate_rom_file(rom, data_slot(rom, slot, &entry), entry.data, entry.data_len, file_len);
+    pthread_mutex_unlock(&rom->lock);
+    return file;
+  }
+
+  if (file_len)
+    *file_len = entry.data_len - 1; /* exclude null terminator. */
+
+  return (const char*)entry.data;
+}
+
+/* find and return a pointer to the string containing the contents of the file
+ * matching the given path.  Store the file length in file_len if given.
+ * Files in RFS ROMs are inflated on first access and held until the ROM is
+ * unmounted or, if the ROM has a cache limit, until they are evicted by a later
+ * call, which invalidates the returned pointer.
+ * return zero if the file is not found.
+ */
+const char* extract_rom_file(const char *romfs, const char *path, size_t *file_len)
+{
+  ROMHeader *rom;
+  size_t path_len, probes, slot;
+  unsigned long long start;
+
+  if (!romfs || !path)
+    return 0;
+
+  rom = (ROMHeader*)romfs;
+  if (strncmp("ROM", rom->magic, 3) != 0)
+    return 0;
+
+  STATS_ADD(rom->stats.lookups, 1);
+  path_len = strlen(path) + 1;
+  start = __atomic_load_n(&lookup_timing, __ATOMIC_RELAXED) ? now_ns() : 0;
+  probes = 0;
+  slot = find_index_slot(rom, path, path_len, &probes);
+  if (start)
+    STATS_ADD(rom->stats.lookup_ns, now_ns() - start);
+  STATS_ADD(rom->stats.entries_scanned, probes);
+  if (slot == rom->index_slots || read_slot(rom, slot) == 0)
+  {
+    STATS_ADD(rom->stats.lookup_misses, 1);
+    return 0;
+  }
+
+  return read_rom_entry(rom, slot, file_len);
+}
+
+/* limit the bytes held by files inflated from an RFS ROM.  When the limit is
+ * exceeded the least recently used files are released, apart from the one most
+ * recently extracted.  A limit of zero, the default, keeps every file.
+ */
+void set_rom_cache_limit(const char *romfs, size_t cache_limit)
+{
+  ROMHeader *rom;
+
+  rom = (ROMHeader*)romfs;
+  if (!rom || strncmp("ROM", rom->magic, 3) != 0)
+    return;
+
+  pthread_mutex_lock(&rom->lock);
+  rom->cache_limit = cache_limit;
+  if (rom->files)
+    trim_rom_cache(rom);
+  pthread_mutex_unlock(&rom->lock);
+}
+
+/* return the limit on the bytes held by files inflated from an RFS ROM, or zero
+ * if there is none.
+ */
+size_t get_rom_cache_limit(const char *romfs)
+{
+  ROMHeader *rom;
+  size_t cache_limit;
+
+  rom = (ROMHeader*)romfs;
+  if (!rom || strncmp("ROM", rom->magic, 3) != 0)
+    return 0;
+
+  pthread_mutex_lock(&rom->lock);
+  cache_limit = rom->cache_limit;
+  pthread_mutex_unlock(&rom->lock);
+
+  return cache_limit;
+}
+
+/* store the number of extractions served from and missing the cache of files
+ * inflated from an RFS ROM, and the bytes held by the cache.  Any pointer may
+ * be NULL.
+ */
+void get_rom_cache_stats(const char *romfs, size_t *hits, size_t *misses, size_t *cache_len)
+{
+  ROMHeader *rom;
+
+  rom = (ROMHeader*)romfs;
+  if (!rom || strncmp("ROM", rom->magic, 3) != 0)
+    return;
+
+  pthread_mutex_lock(&rom->lock);
+  if (hits)
+    *hits = rom->cache_hits;
+  if (misses)
+    *misses = rom->cache_misses;
+  if (cache_len)
+    *cache_len = rom->cache_len;
+  pthread_mutex_unlock(&rom->lock);
+}
+
+/* return the tag identifying the Lua VM that compiled the .lua files of a ROM to
+ * bytecode and store its length in tag_len.  The tag is the stripped bytecode of
+ * an empty chunk, which encodes the VM version, bytecode format and type sizes.
+ * return zero if the ROM does not hold bytecode.
+ */
+const char* get_rom_bytecode_tag(const char *romfs, size_t *tag_len)
+{
+  ROMHeader *rom;
+
+  rom = (ROMHeader*)romfs;
+  if (!rom || strncmp("ROM", rom->magic, 3) != 0 || !rom->bytecode_tag)
+    return 0;
+
+  if (tag_len)
+    *tag_len = rom->bytecode_tag_len;
+
+  return rom->bytecode_tag;
+}
+
+/* store the statistics of a ROM, or of every ROM mounted by the process if
+ * romfs is NULL.  The resident bytes are those currently held by mounted ROMs.
+ */
+void get_rom_stats(const char *romfs, ROMStats *stats)
+{
+  ROMHeader *rom;
+
+  if (!stats)
+    return;
+
+  memset(stats, 0, sizeof(ROMStats));
+  rom = (ROMHeader*)romfs;
+  if (rom)
+  {
+    if (strncmp("ROM", rom->magic, 3) != 0)
+      return;
+
+    pthread_mutex_lock(&rom->lock);
+    add_rom_stats(stats, &rom->stats);
+    stats->resident_bytes = rom_size(rom) + rom->cache_len;
+    pthread_mutex_unlock(&rom->lock);
+    return;
+  }
+
+  pthread_mutex_lock(&mounted_lock);
+  *stats = unmounted;
+  for (rom = mounted; rom; rom = rom->next)
+  {
+    pthread_mutex_lock(&rom->lock);
+    add_rom_stats(stats, &rom->stats);
+    stats->resident_bytes += rom_size(rom) + rom->cache_len;
+    pthread_mutex_unlock(&rom->lock);
+  }
+  pthread_mutex_unlock(&mounted_lock);
+}
+
+/* enable or disable timing lookups, which is disabled by default. */
+void set_rom_lookup_timing(int enabled)
+{
+  __atomic_store_n(&lookup_timing, enabled, __ATOMIC_RELAXED);
+}
+
+/* A ROM table overlays the files of several mounted ROMs, each under a mount
+ * point, in a single index mapping the full path of each file to the ROM and
+ * index slot holding it.  A path held by more than one ROM resolves to the ROM
+ * added to the table first, and the index is rebuilt whenever a ROM is added
+ * or removed.
+ */
+typedef struct _ROMMount {
+  ROMHeader *rom;
+  char *mount_point;
+  size_t mount_point_len;
+}
+  ROMMount;
+
+typedef struct _ROMTableEntry {
+  uint32_t hash;        /* hash of the full path. */
+  size_t mount;         /* mount holding the file plus one, or zero if the entry is empty. */
+  size_t slot;          /* index slot of the file in the ROM. */
+}
+  ROMTableEntry;
+
+struct _ROMTable {
+  ROMMount *mounts;     /* mounts in the order they were added. */
+  size_t mounts_len;
+  ROMTableEntry *index;
+  size_t index_slots;   /* number of index entries, always a power of two. */
+  ROMStats stats;       /* lookups that found no file, which no ROM counts. */
+};
+
+/* create and return an empty ROM table, which must be released with
+ * release_rom_table.
+ * return zero on failure.
+ */
+ROMTable* create_rom_table(void)
+{
+  ROMTable *table;
+
+  table = (ROMTable*)malloc(sizeof(ROMTable));
+  if (table)
+    memset(table, 0, sizeof(ROMTable));
+
+  return table;
+}
+
+/* release a ROM table.  The ROMs it holds are not unmounted. */
+void release_rom_table(ROMTable *table)
+{
+  size_t i;
+
+  if (!table)
+    return;
+
+  for (i = 0; i != table->mounts_len; ++i)
+    free(table->mounts[i].mount_point);
+  free(table->mounts);
+  free(table->index);
+  free(table);
+}
+
+/* return the path of the entry referenced by a ROM index slot, and store its
+ * length including the null terminator in path_len.
+ * return zero if the slot is empty or does not reference a complete entry.
+ */
+static const char* rom_entry_path(const ROMHeader *rom, size_t slot, size_t *path_len)
+{
+  ROMEntry entry;
+
+  if (!read_slot_entry(rom, slot, &entry) || entry.path_len == 0)
+    return 0;
+
+  *path_len = entry.path_len;
+  return entry.path;
+}
+
+/* return non-zero if an index entry holds the given path, of path_len bytes
+ * excluding the null terminator.
+ */
+static int table_entry_matches(const ROMTable *table, const ROMTableEntry *entry,
+    uint32_t hash, const char *path, size_t path_len)
+{
+  const ROMMount *mount;
+  const char *entry_path;
+  size_t entry_path_len;
+
+  if (entry->hash != hash)
+    return 0;
+
+  mount = table->mounts + entry->mount - 1;
+  entry_path = rom_entry_path(mount->rom, entry->slot, &entry_path_len);
+  if (!entry_path)
+    return 0;
+
+  return mount->mount_point_len + entry_path_len - 1 == path_len &&
+      memcmp(path, mount->mount_point, mount->mount_point_len) == 0 &&
+      memcmp(path + mount->mount_point_len, entry_path, entry_path_len - 1) == 0;
+}
+
+/* find the index entry for the given path.  Return the entry holding the path
+ * or the empty entry at which it would be inserted, or zero if the index is
+ * full and does not contain the path.  If probes is not NULL, the number of
+ * entries examined is added to it.
+ */
+static ROMTableEntry* find_table_entry(const ROMTable *table, uint32_t hash,
+    const char *path, size_t path_len, size_t *probes)
+{
+  ROMTableEntry *entry;
+  size_t i, n;
+
+  for (n = 0, i = hash; n != table->index_slots; ++n, ++i)
+  {
+    entry = table->index + (i & (table->index_slots - 1));
+    if (entry->mount == 0)
+      return entry;
+
+    if (probes)
+      ++*probes;
+    if (table_entry_matches(table, entry, hash, path, path_len))
+      return entry;
+  }
+
+  return 0;
+}
+
+/* rebuild the index of a ROM table, adding the files of each ROM in turn so
+ * that the ROMs added first shadow those added later.
+ * return zero on failure.
+ */
+static int build_table_index(ROMTable *table)
+{
+  ROMTableEntry *entry;
+  const ROMMount *mount;
+  const char *path;
+  char *full_path, *p;
+  size_t files, slots, m, i, path_len, full_path_len;
+  uint32_t hash;
+
+  for (files = 0, m = 0; m != table->mounts_len; ++m)
+    files += table->mounts[m].rom->index_slots;
+  for (slots = 2; slots < files; slots <<= 1)
+    ;
+
+  /* ROM indexes are at most half full, so the table index is too. */
+  free(table->index);
+  table->index = (ROMTableEntry*)calloc(slots, sizeof(ROMTableEntry));
+  table->index_slots = table->index ? slots : 0;
+  if (!table->index)
+    return 0;
+
+  full_path = 0;
+  full_path_len = 0;
+
+  for (m = 0; m != table->mounts_len; ++m)
+  {
+    mount = table->mounts + m;
+    hash = hash_bytes(FNV_OFFSET_BASIS, mount->mount_point, mount->mount_point_len);
+    for (i = 0; i != mount->rom->index_slots; ++i)
+    {
+      path = rom_entry_path(mount->rom, i, &path_len);
+      if (!path)
+        continue;
+
+      /* the path is compared as a whole when looking for a shadowing entry. */
+      if (mount->mount_point_len + path_len > full_path_len)
+      {
+        full_path_len = mount->mount_point_len + path_len;
+        p = (char*)realloc(full_path, full_path_len);
+        if (!p)
+        {
+          free(full_path);
+          return 0;
+        }
+        full_path = p;
+      }
+      memcpy(full_path, mount->mount_point, mount->mount_point_len);
+      memcpy(full_path + mount->mount_point_len, path, path_len - 1);
+      entry = find_table_entry(table, hash_bytes(hash, path, path_len - 1),
+          full_path, mount->mount_point_len + path_len - 1, 0);
+      if (entry && entry->mount == 0)
+      {
+        entry->hash = hash_bytes(hash, path, path_len - 1);
+        entry->mount = m + 1;
+        entry->slot = i;
+      }
+    }
+  }
+
+  free(full_path);
+  return 1;
+}
+
+/* add a mounted ROM to a table, with its files under the given mount point,
+ * which is prefixed to their paths as is and may be NULL.  The files of the
+ * ROM are shadowed by those of the ROMs already in the table.  The ROM must not
+ * be unmounted while it is in the table.
+ * return zero on failure.
+ */
+int add_rom_to_table(ROMTable *table, const char *romfs, const char *mount_point)
+{
+  ROMHeader *rom;
+  ROMMount *mounts, *mount;
+
+  rom = (ROMHeader*)romfs;
+  if (!table || !rom || strncmp("ROM", rom->magic, 3) != 0)
+    return 0;
+
+  mounts = (ROMMount*)realloc(table->mounts, (table->mounts_len + 1) * sizeof(ROMMount));
+  if (!mounts)
+    return 0;
+  table->mounts = mounts;
+
+  mount = mounts + table->mounts_len;
+  mount->rom = rom;
+  mount->mount_point_len = mount_point ? strlen(mount_point) : 0;
+  mount->mount_point = strdup(mount_point ? mount_point : "");
+  if (!mount->mount_point)
+    return 0;
+
+  ++table->mounts_len;
+  if (!build_table_index(table))
+  {
+    remove_rom_from_table(table, romfs);
+    return 0;
+  }
+
+  return 1;
+}
+
+/* remove a ROM from a table, uncovering any files it shadowed.
+ * return zero if the ROM is not in the table or the index could not be rebuilt,
+ * in which case the table is empty.
+ */
+int remove_rom_from_table(ROMTable *table, const char *romfs)
+{
+  size_t m;
+
+  if (!table)
+    return 0;
+
+  for (m = 0; m != table->mounts_len && table->mounts[m].rom != (ROMHeader*)romfs; ++m)
+    ;
+  if (m == table->mounts_len)
+    return 0;
+
+  free(table->mounts[m].mount_point);
+  memmove(table->mounts + m, table->mounts + m + 1, (table->mounts_len - m - 1) * sizeof(ROMMount));
+  --table->mounts_len;
+
+  if (!build_table_index(table))
+  {
+    table->mounts_len = 0;
+    return 0;
+  }
+
+  return 1;
+}
+
+/* find and return the contents of the file matching the given full path in any
+ * ROM of a table, as per extract_rom_file.  Store the position of the ROM
+ * holding the file, in the order the ROMs were added, in mount_index if given.
+ * return zero if the file is not found.
+ */
+const char* extract_table_file(ROMTable *table, const char *path, size_t *file_len, size_t *mount_index)
+{
+  ROMTableEntry *entry;
+  ROMHeader *rom;
+  ROMStats *stats;
+  size_t path_len, probes;
+  unsigned long long start, elapsed;
+  uint32_t hash;
+
+  if (!table || !path)
+    return 0;
+
+  /* a file found is counted by the ROM holding it, and a miss by the table. */
+  start = __atomic_load_n(&lookup_timing, __ATOMIC_RELAXED) ? now_ns() : 0;
+  probes = 0;
+  entry = 0;
+  if (table->index_slots)
+  {
+    path_len = strlen(path);
+    hash = hash_path(path, path_len);
+    entry = find_table_entry(table, hash, path, path_len, &probes);
+  }
+  elapsed = start ? now_ns() - start : 0;
+
+  rom = entry && entry->mount ? table->mounts[entry->mount - 1].rom : 0;
+  stats = rom ? &rom->stats : &table->stats;
+  STATS_ADD(stats->lookups, 1);
+  STATS_ADD(stats->entries_scanned, probes);
+  if (elapsed)
+    STATS_ADD(stats->lookup_ns, elapsed);
+  if (!rom)
+  {
+    STATS_ADD(stats->lookup_misses, 1);
+    return 0;
+  }
+
+  if (mount_index)
+    *mount_index = entry->mount - 1;
+
+  return read_rom_entry(rom, entry->slot, file_len);
+}
+
+/* store the counters of the lookups in a table that found no file.  Those that
+ * found a file are counted by the ROM holding it.
+ */
+void get_table_stats(ROMTable *table, ROMStats *stats)
+{
+  if (!stats)
+    return;
+
+  memset(stats, 0, sizeof(ROMStats));
+  if (!table)
+    return;
+
+  add_rom_stats(stats, &table->stats);
+}
+
+/* return the ROM at the given position in a table, in the order the ROMs were
+ * added, or zero if there is none.
+ */
+const char* get_table_rom(const ROMTable *table, size_t mount_index)
+{
+  if (!table || mount_index >= table->mounts_len)
+    return 0;
+
+  return (const char*)table->mounts[mount_index].rom;
+}
+
+/* return the length of the file referenced by an index slot, which must hold
+ * a complete entry, without inflating it.
+ */
+static size_t rom_entry_len(const ROMHeader *rom, size_t slot)
+{
+  ROMEntry entry;
+  size_t len;
+
+  if (!read_slot_entry(rom, slot, &entry))
+    return 0;
+  if (!rom->files)
+    return entry.data_len - 1; /* exclude null terminator. */
+
+  return read_file_header(rom, entry.data, entry.data_len, &len) ? len : 0;
+}
+
+static int compare_entry_paths(const void *a, const void *b)
+{
+  return strcmp(((const ROMListEntry*)a)->path, ((const ROMListEntry*)b)->path);
+}
+
+/* return the files of a ROM sorted by path, building the table on first use,
+ * and store their number in len.
+ * return zero if memory could not be allocated.
+ */
+static const ROMListEntry* sorted_rom_entries(ROMHeader *rom, size_t *len)
+{
+  ROMListEntry *sorted;
+  const char *path;
+  size_t i, n, path_len;
+
+  sorted = __atomic_load_n(&rom->sorted, __ATOMIC_ACQUIRE);
+  if (!sorted)
+  {
+    pthread_mutex_lock(&rom->lock);
+    if (!rom->sorted)
+    {
+      /* index each path once, using the entry that lookups resolve it to. */
+      sorted = (ROMListEntry*)malloc(rom->index_slots * sizeof(*sorted));
+      for (i = 0, n = 0; sorted && i != rom->index_slots; ++i)
+      {
+        path = rom_entry_path(rom, i, &path_len);
+        if (path && path[path_len - 1] == 0)
+        {
+          sorted[n].path = path;
+          sorted[n++].slot = i;
+        }
+      }
+      if (sorted)
+      {
+        qsort(sorted, n, sizeof(*sorted), compare_entry_paths);
+        rom->sorted_len = n;
+        __atomic_store_n(&rom->sorted, sorted, __ATOMIC_RELEASE);
+      }
+    }
+    sorted = rom->sorted;
+    pthread_mutex_unlock(&rom->lock);
+    if (!sorted)
+      return 0;
+  }
+
+  *len = rom->sorted_len;
+  return sorted;
+}
+
+/* return the position of the first of the sorted entries whose path is not
+ * before the given prefix.
+ */
+static size_t find_first_entry(const ROMListEntry *sorted, size_t len, const char *prefix)
+{
+  size_t low, high, mid;
+
+  for (low = 0, high = len; low != high;)
+  {
+    mid = low + (high - low) / 2;
+    if (strcmp(sorted[mid].path, prefix) < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return low;
+}
+
+/* call fn for each file of a ROM whose path starts with prefix, which may be
+ * NULL or empty for every file, in path order.  fn is passed ctx, the mount
+ * point, which is empty, the path and the length of the file, and may return
+ * non-zero to stop the listing.  Files are listed without being inflated.
+ * return the number of files listed.
+ */
+size_t list_rom_files(const char *romfs, const char *prefix, ROMListCallback fn, void *ctx)
+{
+  ROMHeader *rom;
+  const ROMListEntry *sorted;
+  size_t len, prefix_len, i, listed;
+
+  rom = (ROMHeader*)romfs;
+  if (!rom || strncmp("ROM", rom->magic, 3) != 0 || !fn)
+    return 0;
+
+  sorted = sorted_rom_entries(rom, &len);
+  if (!sorted)
+    return 0;
+
+  prefix = prefix ? prefix : "";
+  prefix_len = strlen(prefix);
+  listed = 0;
+  for (i = find_first_entry(sorted, len, prefix);
+      i != len && strncmp(sorted[i].path, prefix, prefix_len) == 0; ++i)
+  {
+    ++listed;
+    if (fn(ctx, "", sorted[i].path, rom_entry_len(rom, sorted[i].slot)))
+      break;
+  }
+
+  return listed;
+}
+
+/* store the length of the file matching the given path in file_len, if given,
+ * without inflating it.
+ * return zero if the file is not found.
+ */
+int stat_rom_file(const char *romfs, const char *path, size_t *file_len)
+{
+  ROMHeader *rom;
+  size_t slot;
+
+  rom = (ROMHeader*)romfs;
+  if (!rom || strncmp("ROM", rom->magic, 3) != 0 || !path)
+    return 0;
+
+  slot = find_index_slot(rom, path, strlen(path) + 1, 0);
+  if (slot == rom->index_slots || read_slot(rom, slot) == 0)
+    return 0;
+
+  if (file_len)
+    *file_len = rom_entry_len(rom, slot);
+  return 1;
+}
+
+/* return non-zero if the entry of a ROM in a table is not shadowed by an
+ * earlier ROM, that is, if the table index resolves its full path to it.
+ */
+static int table_entry_visible(const ROMTable *table, size_t mount, const ROMListEntry *entry)
+{
+  const ROMMount *m;
+  const ROMTableEntry *e;
+  size_t i, n;
+  uint32_t hash;
+
+  m = table->mounts + mount;
+  hash = hash_bytes(hash_bytes(FNV_OFFSET_BASIS, m->mount_point, m->mount_point_len),
+      entry->path, strlen(entry->path));
+  for (n = 0, i = hash; n != table->index_slots; ++n, ++i)
+  {
+    e = table->index + (i & (table->index_slots - 1));
+    if (e->mount == 0)
+      return 0;
+    if (e->mount == mount + 1 && e->slot == entry->slot)
+      return 1;
+  }
+
+  return 0;
+}
+
+/* call fn for each file of the ROMs in a table whose full path starts with
+ * prefix, as per list_rom_files.  fn is passed the mount point and the path
+ * within the ROM, which together form the full path.  Files shadowed by an
+ * earlier ROM are not listed.  The files of each ROM are listed in path order,
+ * in the order the ROMs were added.
+ * return the number of files listed.
+ */
+size_t list_table_files(ROMTable *table, const char *prefix, ROMListCallback fn, void *ctx)
+{
+  const ROMMount *m;
+  const ROMListEntry *sorted;
+  const char *rom_prefix;
+  size_t mount, len, prefix_len, rom_prefix_len, i, listed;
+
+  if (!table || !fn)
+    return 0;
+
+  prefix = prefix ? prefix : "";
+  prefix_len = strlen(prefix);
+  listed = 0;
+  for (mount = 0; mount != table->mounts_len; ++mount)
+  {
+    /* the prefix either extends the mount point or is a prefix of it. */
+    m = table->mounts + mount;
+    if (prefix_len >= m->mount_point_len && memcmp(prefix, m->mount_point, m->mount_point_len) == 0)
+      rom_prefix = prefix + m->mount_point_len;
+    else if (strncmp(m->mount_point, prefix, prefix_len) == 0)
+      rom_prefix = "";
+    else
+      continue;
+
+    sorted = sorted_rom_entries(m->rom, &len);
+    if (!sorted)
+      continue;
+
+    rom_prefix_len = strlen(rom_prefix);
+    for (i = find_first_entry(sorted, len, rom_prefix);
+        i != len && strncmp(sorted[i].path, rom_prefix, rom_prefix_len) == 0; ++i)
+    {
+      if (!table_entry_visible(table, mount, sorted + i))
+        continue;
+
+      ++listed;
+      if (fn(ctx, m->mount_point, sorted[i].path, rom_entry_len(m->rom, sorted[i].slot)))
+        return listed;
+    }
+  }
+
+  return listed;
+}
+
+/* store the length of the file matching the given full path in any ROM of a
+ * table in file_len, if given, without inflating it.  Store the position of the
+ * ROM holding the file in mount_index if given, as per extract_table_file.
+ * return zero if the file is not found.
+ */
+int stat_table_file(ROMTable *table, const char *path, size_t *file_len, size_t *mount_index)
+{
+  ROMTableEntry *entry;
+  const ROMHeader *rom;
+  size_t path_len;
+
+  if (!table || !path || !table->index_slots)
+    return 0;
+
+  path_len = strlen(path);
+  entry = find_table_entry(table, hash_path(path, path_len), path, path_len, 0);
+  if (!entry || entry->mount == 0)
+    return 0;
+
+  rom = table->mounts[entry->mount - 1].rom;
+  if (file_len)
+    *file_len = rom_entry_len(rom, entry->slot);
+  if (mount_index)
+    *mount_index = entry->mount - 1;
+  return 1;
+}
+
+/* A stream reads a file of a ROM a part at a time.  Files held uncompressed are
+ * read directly from the ROM image and files compressed individually with zlib
+ * or zstd are decompressed as they are read, so that reading needs memory only
+ * for the decompressor and the caller's buffer.  Files compressed with LZ4 are
+ * held as single blocks, which cannot be decompressed in parts, and so are
+ * decompressed as a whole when the stream is opened.
+ */
+struct _ROMStream {
+  ROMHeader *rom;
+  int codec;                  /* RFS_STORED if the file is read from content. */
+  const unsigned char *data;  /* compressed data of the file. */
+  size_t data_len;
+  const char *content;        /* uncompressed content of the file, or zero. */
+  size_t len;                 /* length of the file. */
+  size_t pos;                 /* position of the next byte read from the file. */
+  char *owned;                /* content decompressed when the stream was opened, or zero. */
+  z_stream strm;
+#ifdef WITH_ZSTD
+  ZSTD_DCtx *dctx;
+  ZSTD_inBuffer in;
+#endif
+};
+
+/* start decompressing the file of a stream from its beginning.
+ * return zero on failure.
+ */
+static int rewind_rom_stream(ROMStream *stream)
+{
+  stream->pos = 0;
+  if (stream->codec == RFS_ZLIB)
+  {
+    if (inflateReset(&stream->strm) != Z_OK)
+      return 0;
+    stream->strm.next_in = (unsigned char*)stream->data;
+    stream->strm.avail_in = ZLIB_LEN(stream->data_len);
+  }
+#ifdef WITH_ZSTD
+  if (stream->codec == RFS_ZSTD)
+  {
+    if (ZSTD_isError(ZSTD_DCtx_reset(stream->dctx, ZSTD_reset_session_only)))
+      return 0;
+    stream->in.src = stream->data;
+    stream->in.size = stream->data_len;
+    stream->in.pos = 0;
+  }
+#endif
+
+  return 1;
+}
+
+/* open a stream of the file referenced by an index slot of a ROM, which must
+ * hold a complete entry.
+ * return zero on failure.
+ */
+static ROMStream* open_rom_entry(ROMHeader *rom, size_t slot)
+{
+  ROMStream *stream;
+  ROMEntry entry;
+  size_t header_len;
+  int ok;
+
+  if (!read_slot_entry(rom, slot, &entry))
+    return 0;
+
+  stream = (ROMStream*)malloc(sizeof(ROMStream));
+  if (!stream)
+    return 0;
+  memset(stream, 0, sizeof(ROMStream));
+
+  stream->rom = rom;
+  stream->codec = RFS_STORED;
+  if (!rom->files)
+  {
+    stream->content = (const char*)entry.data;
+    stream->len = entry.data_len - 1; /* exclude null terminator. */
+  }
+  else if ((header_len = read_file_header(rom, entry.data, entry.data_len, &stream->len)) != 0)
+  {
+    stream->codec = entry.data[0];
+    stream->data = entry.data + header_len;
+    stream->data_len = entry.data_len - header_len;
+  }
+  else
+  {
+    free(stream);
+    return 0;
+  }
+
+  ok = 1;
+  if (stream->codec == RFS_STORED && !stream->content)
+  {
+    stream->content = (const char*)stream->data;
+    ok = stream->data_len && stream->data_len - 1 == stream->len;
+  }
+  else if (stream->codec == RFS_ZLIB)
+    ok = inflateInit(&stream->strm) == Z_OK && rewind_rom_stream(stream);
+#ifdef WITH_ZSTD
+  else if (stream->codec == RFS_ZSTD)
+  {
+    stream->dctx = ZSTD_createDCtx();
+    ok = stream->dctx && (!rom->ddict || !ZSTD_isError(ZSTD_DCtx_refDDict(stream->dctx, rom->ddict))) &&
+        rewind_rom_stream(stream);
+  }
+#endif
+  else if (stream->codec != RFS_STORED)
+  {
+    stream->owned = (char*)malloc(stream->len + 1);
+    pthread_mutex_lock(&rom->lock);
+    ok = stream->owned && decompress_file(rom, stream->codec, stream->owned, stream->len, stream->data, stream->data_len);
+    pthread_mutex_unlock(&rom->lock);
+    stream->content = stream->owned;
+    stream->codec = RFS_STORED;
+  }
+
+  if (!ok)
+  {
+    stream->rom = 0;
+    close_rom_stream(stream);
+    return 0;
+  }
+
+  retain_rom((const char*)rom);
+  return stream;
+}
+
+/* open and return a stream reading the file matching the given path, which
+ * must be released with close_rom_stream.  The stream holds a reference to the
+ * ROM, so the ROM may be unmounted while the stream is open.
+ * return zero if the file is not found or could not be opened.
+ */
+ROMStream* open_rom_file(const char *romfs, const char *path)
+{
+  ROMHeader *rom;
+  size_t slot;
+
+  rom = (ROMHeader*)romfs;
+  if (!rom || strncmp("ROM", rom->magic, 3) != 0 || !path)
+    return 0;
+
+  slot = find_index_slot(rom, path, strlen(path) + 1, 0);
+  if (slot == rom->index_slots || read_slot(rom, slot) == 0)
+    return 0;
+
+  return open_rom_entry(rom, slot);
+}
+
+/* open a stream reading the file matching the given full path in any ROM of a
+ * table, as per open_rom_file.
+ */
+ROMStream* open_table_file(ROMTable *table, const char *path)
+{
+  ROMTableEntry *entry;
+  size_t path_len;
+
+  if (!table || !path || !table->index_slots)
+    return 0;
+
+  path_len = strlen(path);
+  entry = find_table_entry(table, hash_path(path, path_len), path, path_len, 0);
+  if (!entry || entry->mount == 0)
+    return 0;
+
+  return open_rom_entry(table->mounts[entry->mount - 1].rom, entry->slot);
+}
+
+/* read up to len bytes from a stream into buffer.
+ * return the number of bytes read, which is less than len only at the end of
+ * the file or on failure.
+ */
+size_t read_rom_stream(ROMStream *stream, char *buffer, size_t len)
+{
+  size_t read;
+  int ret;
+
+  if (!stream)
+    return 0;
+
+  if (len > stream->len - stream->pos)
+    len = stream->len - stream->pos;
+  if (len == 0)
+    return 0;
+
+  read = 0;
+  if (stream->content)
+  {
+    memcpy(buffer, stream->content + stream->pos, len);
+    read = len;
+  }
+  else if (stream->codec == RFS_ZLIB)
+  {
+    stream->strm.next_out = (unsigned char*)buffer;
+    do
+    {
+      if (stream->strm.avail_in == 0)
+        stream->strm.avail_in = ZLIB_LEN((size_t)(stream->data + stream->data_len - stream->strm.next_in));
+      stream->strm.avail_out = ZLIB_LEN(len - read);
+      ret = inflate(&stream->strm, Z_SYNC_FLUSH);
+      read = (char*)stream->strm.next_out - buffer;
+      if (ret == Z_NEED_DICT && (!stream->rom->dict ||
+          inflateSetDictionary(&stream->strm, (const unsigned char*)stream->rom->dict, stream->rom->dict_len) != Z_OK))
+        break;
+    }
+    while ((ret == Z_OK || ret == Z_NEED_DICT) && read != len);
+  }
+#ifdef WITH_ZSTD
+  else if (stream->codec == RFS_ZSTD)
+  {
+    ZSTD_outBuffer out;
+    size_t in_pos;
+
+    out.dst = buffer;
+    out.size = len;
+    out.pos = 0;
+    do
+    {
+      in_pos = stream->in.pos;
+      read = out.pos;
+      ret = !ZSTD_isError(ZSTD_decompressStream(stream->dctx, &out, &stream->in));
+    }
+    while (ret && out.pos != len && (stream->in.pos != in_pos || out.pos != read));
+    read = out.pos;
+  }
+#endif
+
+  stream->pos += read;
+  return read;
+}
+
+/* move the position of a stream to the given offset from the start of the
+ * file.  Moving back in a compressed file decompresses it again from the start.
+ * return zero if the offset is beyond the end of the file or on failure.
+ */
+int seek_rom_stream(ROMStream *stream, size_t offset)
+{
+  char buffer[4096];
+  size_t len;
+
+  if (!stream || offset > stream->len)
+    return 0;
+
+  if (stream->content)
+  {
+    stream->pos = offset;
+    return 1;
+  }
+
+  if (offset < stream->pos && !rewind_rom_stream(stream))
+    return 0;
+
+  while (stream->pos < offset)
+  {
+    len = offset - stream->pos < sizeof(buffer) ? offset - stream->pos : sizeof(buffer);
+    if (read_rom_stream(stream, buffer, len) != len)
+      return 0;
+  }
+
+  return 1;
+}
+
+/* return the position of a stream, from the start of the file. */
+size_t tell_rom_stream(const ROMStream *stream)
+{
+  return stream ? stream->pos : 0;
+}
+
+/* return the length of the file read by a stream. */
+size_t rom_stream_len(const ROMStream *stream)
+{
+  return stream ? stream->len : 0;
+}
+
+/* close a stream opened by open_rom_file or open_table_file and release its
+ * reference to the ROM.
+ */
+void close_rom_stream(ROMStream *stream)
+{
+  if (!stream)
+    return;
+
+  if (stream->codec == RFS_ZLIB)
+    inflateEnd(&stream->strm);
+#ifdef WITH_ZSTD
+  ZSTD_freeDCtx(stream->dctx);
+#endif
+  unmount_rom((const char*)stream->rom);
+  free(stream->owned);
+  free(stream);
+}
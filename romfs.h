@@ -9,9 +9,9 @@
 
 /* mount and return the filesystem content of a ROM blob.  This must be
  * called on a ROM blob before trying to extract files from it.
- * Store the length of the mounted filesystem in romfs_len.
- * The returned pointer is dynamically allocated and must be free'd by the caller
- * when the ROM is nolonger needed.
+ * Store the number of bytes allocated for the mounted filesystem in romfs_len.
+ * The returned object must be released with unmount_rom when the ROM is
+ * nolonger needed.
  *
  * passphrase may be NULL.
  *
@@ -19,11 +19,239 @@
  */
 const char* mount_rom(const char *rom_blob, size_t rom_blob_len, size_t *romfs_len, const char *passphrase);
 
+/* mount and return the filesystem content of a ROM blob as per mount_rom, except
+ * that uncompressed (ASC) and unencrypted RFS ROMs are used in place rather than
+ * copied.  The blob must not be changed or released until the ROM is unmounted.
+ */
+const char* mount_rom_in_place(const char *rom_blob, size_t rom_blob_len, size_t *romfs_len, const char *passphrase);
+
+/* mount and return the filesystem content of a ROM blob as per
+ * mount_rom_in_place, except that the ROM is not counted in the totals of
+ * get_rom_stats, for ROMs used internally such as the Lua library's bootstrap.
+ */
+const char* mount_rom_unlisted(const char *rom_blob, size_t rom_blob_len, size_t *romfs_len, const char *passphrase);
+
+/* mount and return the filesystem content of a ROM file.  Uncompressed (ASC)
+ * and unencrypted RFS ROMs are served directly from a read-only mapping of the
+ * file, so that their content is held in the page cache rather than copied to
+ * the heap.  Other ROMs are mounted from the mapping as per mount_rom.
+ * Store the number of bytes allocated for the mounted filesystem in romfs_len.
+ * The returned object must be released with unmount_rom when the ROM is
+ * nolonger needed.
+ *
+ * passphrase may be NULL.
+ *
+ * return zero on failure, with errno set if the file could not be read.
+ */
+const char* mount_rom_file(const char *path, size_t *romfs_len, const char *passphrase);
+
+/* release a reference to a ROM filesystem returned by mount_rom, mount_rom_in_place,
+ * mount_rom_unlisted, mount_rom_file or retain_rom, and release the ROM with its
+ * last reference.
+ */
+void unmount_rom(const char *romfs);
+
+/* add a reference to a mounted ROM, so that it may be shared, for example by
+ * several Lua states or threads.  Each reference is released by a call to
+ * unmount_rom, and the ROM is released with the last reference.
+ * A mounted ROM may be used by several threads at once.
+ * return the ROM, or zero if it is not valid.
+ */
+const char* retain_rom(const char *romfs);
+
+/* hold the lock of a ROM, which serialises access to the files inflated from
+ * it.  A thread must hold the lock while using a file extracted from a ROM that
+ * is shared with other threads and has a cache limit, since extraction by
+ * another thread may evict the file.  The lock may be held recursively.
+ */
+void lock_rom(const char *romfs);
+
+/* release the lock of a ROM held by lock_rom. */
+void unlock_rom(const char *romfs);
+
 /* find and return a pointer to the string containing the contents of the file
  * matching the given path.  Store the file length in file_len if given.
+ * Files in RFS ROMs are inflated on first access and held until the ROM is
+ * unmounted or, if the ROM has a cache limit, until they are evicted by a later
+ * call, which invalidates the returned pointer.
  * return zero if the file is not found.
  */
 const char* extract_rom_file(const char *romfs, const char *path, size_t *file_len);
 
+/* called for each file listed by list_rom_files or list_table_files with the
+ * given context, the mount point and path of the file, which together form its
+ * full path, and the length of the file.  Return non-zero to stop the listing.
+ */
+typedef int (*ROMListCallback)(void *ctx, const char *mount_point, const char *path, size_t file_len);
+
+/* call fn for each file of a ROM whose path starts with prefix, which may be
+ * NULL or empty for every file, in path order.  The mount point passed to fn is
+ * empty.  Files are listed without being inflated, using a table of the paths
+ * sorted on first use, so that listing costs O(log n + k).
+ * return the number of files listed.
+ */
+size_t list_rom_files(const char *romfs, const char *prefix, ROMListCallback fn, void *ctx);
+
+/* store the length of the file matching the given path in file_len, if given,
+ * without inflating it.
+ * return zero if the file is not found.
+ */
+int stat_rom_file(const char *romfs, const char *path, size_t *file_len);
+
+/* limit the bytes held by files inflated from an RFS ROM.  When the limit is
+ * exceeded the least recently used files are released, apart from the one most
+ * recently extracted.  A limit of zero, the default, keeps every file.
+ */
+void set_rom_cache_limit(const char *romfs, size_t cache_limit);
+
+/* return the limit on the bytes held by files inflated from an RFS ROM, or zero
+ * if there is none.
+ */
+size_t get_rom_cache_limit(const char *romfs);
+
+/* store the number of extractions served from and missing the cache of files
+ * inflated from an RFS ROM, and the bytes held by the cache.  Any pointer may
+ * be NULL.
+ */
+void get_rom_cache_stats(const char *romfs, size_t *hits, size_t *misses, size_t *cache_len);
+
+/* return the tag identifying the Lua VM that compiled the .lua files of a ROM to
+ * bytecode and store its length in tag_len.  The tag is the stripped bytecode of
+ * an empty chunk, which encodes the VM version, bytecode format and type sizes.
+ * return zero if the ROM does not hold bytecode.
+ */
+const char* get_rom_bytecode_tag(const char *romfs, size_t *tag_len);
+
+/* counters of the work done by a ROM, or by all of the ROMs mounted by the process. */
+typedef struct _ROMStats
+{
+  size_t mounts;                  /* ROMs mounted. */
+  size_t unmounts;                /* ROMs unmounted. */
+  size_t lookups;                 /* paths looked up by extract_rom_file or extract_table_file. */
+  size_t lookup_misses;           /* paths looked up but not found. */
+  size_t entries_scanned;         /* index entries examined by the lookups. */
+  size_t bytes_inflated;          /* bytes decompressed, at mount and from individual files. */
+  size_t bytes_decrypted;         /* bytes decrypted at mount. */
+  unsigned long long inflate_ns;  /* time spent decompressing. */
+  unsigned long long decrypt_ns;  /* time spent decrypting. */
+  unsigned long long lookup_ns;   /* time spent in lookups, measured only while enabled by set_rom_lookup_timing. */
+  size_t resident_bytes;          /* bytes held by the mounted ROMs, including files inflated from them. */
+}
+  ROMStats;
+
+/* store the counters of a ROM in stats, or the totals for all ROMs mounted by
+ * the process if romfs is NULL, including those since unmounted.
+ */
+void get_rom_stats(const char *romfs, ROMStats *stats);
+
+/* enable or disable measuring the time spent in lookups.  This is disabled by
+ * default, because reading the clock costs about as much as a lookup.
+ */
+void set_rom_lookup_timing(int enabled);
+
+/* A ROM table overlays the files of several mounted ROMs, each under a mount
+ * point, so that a path is found with a single lookup however many ROMs are in
+ * the table.  Where ROMs hold the same path, the ROM added first is used.
+ */
+typedef struct _ROMTable ROMTable;
+
+/* create and return an empty ROM table, which must be released with
+ * release_rom_table.
+ * return zero on failure.
+ */
+ROMTable* create_rom_table(void);
+
+/* release a ROM table.  The ROMs it holds are not unmounted. */
+void release_rom_table(ROMTable *table);
+
+/* add a mounted ROM to a table, with its files under the given mount point,
+ * which is prefixed to their paths as is and may be NULL.  The files of the
+ * ROM are shadowed by those of the ROMs already in the table.  The ROM must not
+ * be unmounted while it is in the table.
+ * return zero on failure.
+ */
+int add_rom_to_table(ROMTable *table, const char *romfs, const char *mount_point);
+
+/* remove a ROM from a table, uncovering any files it shadowed.
+ * return zero if the ROM is not in the table or the index could not be rebuilt,
+ * in which case the table is empty.
+ */
+int remove_rom_from_table(ROMTable *table, const char *romfs);
+
+/* find and return the contents of the file matching the given full path in any
+ * ROM of a table, as per extract_rom_file.  Store the position of the ROM
+ * holding the file, in the order the ROMs were added, in mount_index if given.
+ * return zero if the file is not found.
+ */
+const char* extract_table_file(ROMTable *table, const char *path, size_t *file_len, size_t *mount_index);
+
+/* call fn for each file of the ROMs in a table whose full path starts with
+ * prefix, as per list_rom_files.  fn is passed the mount point and the path
+ * within the ROM, which together form the full path.  Files shadowed by an
+ * earlier ROM are not listed.  The files of each ROM are listed in path order,
+ * in the order the ROMs were added.
+ * return the number of files listed.
+ */
+size_t list_table_files(ROMTable *table, const char *prefix, ROMListCallback fn, void *ctx);
+
+/* store the length of the file matching the given full path in any ROM of a
+ * table in file_len, if given, without inflating it.  Store the position of the
+ * ROM holding the file in mount_index if given, as per extract_table_file.
+ * return zero if the file is not found.
+ */
+int stat_table_file(ROMTable *table, const char *path, size_t *file_len, size_t *mount_index);
+
+/* A stream reads a file of a ROM a part at a time, decompressing files that
+ * are compressed individually as they are read, so that large files can be
+ * read without holding them in memory as a whole.
+ */
+typedef struct _ROMStream ROMStream;
+
+/* open and return a stream reading the file matching the given path, which
+ * must be released with close_rom_stream.  The stream holds a reference to the
+ * ROM, so the ROM may be unmounted while the stream is open.
+ * return zero if the file is not found or could not be opened.
+ */
+ROMStream* open_rom_file(const char *romfs, const char *path);
+
+/* open a stream reading the file matching the given full path in any ROM of a
+ * table, as per open_rom_file.
+ */
+ROMStream* open_table_file(ROMTable *table, const char *path);
+
+/* read up to len bytes from a stream into buffer.
+ * return the number of bytes read, which is less than len only at the end of
+ * the file or on failure.
+ */
+size_t read_rom_stream(ROMStream *stream, char *buffer, size_t len);
+
+/* move the position of a stream to the given offset from the start of the
+ * file.  Moving back in a compressed file decompresses it again from the start.
+ * return zero if the offset is beyond the end of the file or on failure.
+ */
+int seek_rom_stream(ROMStream *stream, size_t offset);
+
+/* return the position of a stream, from the start of the file. */
+size_t tell_rom_stream(const ROMStream *stream);
+
+/* return the length of the file read by a stream. */
+size_t rom_stream_len(const ROMStream *stream);
+
+/* close a stream opened by open_rom_file or open_table_file and release its
+ * reference to the ROM.
+ */
+void close_rom_stream(ROMStream *stream);
+
+/* return the ROM at the given position in a table, in the order the ROMs were
+ * added, or zero if there is none.
+ */
+const char* get_table_rom(const ROMTable *table, size_t mount_index);
+
+/* store in stats the lookups, misses, entries scanned and lookup time of the
+ * lookups by extract_table_file that found no file in any ROM of a table.
+ * Lookups that find a file are counted by the ROM holding it.
+ */
+void get_table_stats(ROMTable *table, ROMStats *stats);
+
 #endif
 